@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mu-riscv.h"
+
+/***************************************************************/
+/* Write the len bytes at s as a JSON string                                               */
+/***************************************************************/
+void json_string(FILE *out, const char *s, size_t len)
+{
+	const char *end = s + len;
+
+	fputc('"', out);
+	for (; s < end; s++)
+	{
+		if (*s == '"' || *s == '\\')
+		{
+			fprintf(out, "\\%c", *s);
+		}
+		else if ((unsigned char)*s < 0x20)
+		{
+			fprintf(out, "\\u%04x", (unsigned char)*s);
+		}
+		else
+		{
+			fputc(*s, out);
+		}
+	}
+	fputc('"', out);
+}
+
+/***************************************************************/
+/* Run the command script against the loaded program                         */
+/***************************************************************/
+static void batch_script(sim_t *sim, const char *script)
+{
+	FILE *fp = fopen(script, "r");
+	if (fp == NULL)
+	{
+		printf("Error: Can't open command script %s\n", script);
+		exit(-1);
+	}
+	while (execute_command(sim, fp))
+	{
+	}
+	fclose(fp);
+}
+
+/***************************************************************/
+/* Write a hart's instruction count, PC and registers as JSON fields          */
+/***************************************************************/
+static void json_hart(FILE *out, sim_t *hart)
+{
+	int i;
+
+	fprintf(out, "\"instructions\":%llu,\"pc\":%u,\"regs\":[", (unsigned long long)hart->INSTRUCTION_COUNT, hart->CURRENT_STATE.PC);
+	for (i = 0; i < RISCV_REGS; i++)
+	{
+		fprintf(out, (i == 0) ? "%u" : ",%u", hart->CURRENT_STATE.REGS[i]);
+	}
+	fprintf(out, "]");
+}
+
+/***************************************************************/
+/* Load prog_file, run the script, then simulate for at most limit            */
+/* instructions and write the outcome to out as one line of JSON. A file    */
+/* that does not load gets "exit":"load_error" and the reason in "error".   */
+/***************************************************************/
+void batch_run(sim_t *sim, const char *script, uint64_t limit, FILE *out)
+{
+	run_result_t result;
+	const char *reason = "limit";
+	uint64_t remaining = limit;
+	int engine = sim->ENGINE;
+	int stats_on = sim->STATS_ON;
+	int loaded;
+	sim_t *exit_hart = sim;
+	char *output = NULL;
+	size_t output_size = 0;
+	uint32_t i;
+
+	/* every program starts from scratch, whatever the previous one did */
+	memset(&sim->CURRENT_STATE, 0, sizeof(sim->CURRENT_STATE));
+	sim->INSTRUCTION_COUNT = 0;
+	memset(&sim->STATS, 0, sizeof(sim->STATS));
+	initialize(sim);
+	if (sim->CAPTURE_OUTPUT)
+	{
+		sim->OUTPUT = open_memstream(&output, &output_size);
+		if (sim->OUTPUT == NULL)
+		{
+			printf("Error: Can't capture the output of %s\n", sim->prog_file);
+			exit(-1);
+		}
+	}
+	loaded = load_program(sim);
+	if (loaded && script != NULL)
+	{
+		batch_script(sim, script);
+	}
+
+	if (!loaded)
+	{
+		/* a bad file is this program's result, not the end of the batch */
+		reason = "load_error";
+	}
+	else if (!harts_running(sim))
+	{
+		/* the script already ran it to the end */
+		reason = "stopped";
+	}
+	else if (sim->NUM_HARTS > 1)
+	{
+		/* limit counts the instructions of each hart */
+		result = harts_run(sim, limit);
+		exit_hart = sim->HARTS[result.hart];
+		switch (result.reason)
+		{
+		case RUN_ECALL:
+			reason = "exit";
+			break;
+		case RUN_BREAKPOINT:
+			reason = "breakpoint";
+			break;
+		case RUN_ILLEGAL:
+			reason = "illegal";
+			break;
+		case RUN_HALTED:
+			reason = "halted";
+			break;
+		default:
+			reason = "limit";
+			break;
+		}
+	}
+	while (loaded && sim->NUM_HARTS == 1 && sim->RUN_FLAG && remaining > 0)
+	{
+		result = run_budget(sim, remaining > UINT32_MAX ? UINT32_MAX : remaining);
+		remaining -= result.executed;
+		if (result.reason == RUN_ECALL)
+		{
+			SYSCALL_Processing(sim, sim->CURRENT_STATE.REGS[17]);
+			reason = sim->RUN_FLAG ? "limit" : "exit";
+		}
+		else if (result.reason == RUN_BREAKPOINT)
+		{
+			reason = "breakpoint";
+			break;
+		}
+		else if (result.reason == RUN_ILLEGAL)
+		{
+			sim->RUN_FLAG = FALSE;
+			reason = "illegal";
+		}
+		else if (result.reason == RUN_HALTED)
+		{
+			sim->RUN_FLAG = FALSE;
+			reason = "halted";
+		}
+		else
+		{
+			reason = "limit";
+		}
+	}
+	fflush(sim->OUTPUT);
+
+	fprintf(out, "{\"program\":");
+	json_string(out, sim->prog_file, strlen(sim->prog_file));
+	fprintf(out, ",\"exit\":\"%s\"", reason);
+	if (strcmp(reason, "exit") == 0)
+	{
+		/* exit (93) passes a status in a0, RARS exit (10) does not */
+		fprintf(out, ",\"exit_code\":%d", (exit_hart->CURRENT_STATE.REGS[17] == 93) ? (int32_t)exit_hart->CURRENT_STATE.REGS[10] : 0);
+	}
+	if (!loaded)
+	{
+		fprintf(out, ",\"error\":");
+		json_string(out, sim->LOAD_ERROR, strlen(sim->LOAD_ERROR));
+	}
+	fprintf(out, ",");
+	json_hart(out, sim);
+	fprintf(out, ",\"hi\":%u,\"lo\":%u", sim->CURRENT_STATE.HI, sim->CURRENT_STATE.LO);
+	if (loaded && sim->NUM_HARTS > 1)
+	{
+		/* hart 0 is the object itself; the others follow */
+		fprintf(out, ",\"exit_hart\":%u,\"harts\":[", exit_hart->HART_ID);
+		for (i = 1; i < sim->NUM_HARTS; i++)
+		{
+			fprintf(out, (i == 1) ? "{" : ",{");
+			json_hart(out, sim->HARTS[i]);
+			fprintf(out, "}");
+		}
+		fprintf(out, "]");
+	}
+	if (sim->STATS_ON)
+	{
+		fprintf(out, ",\"stats\":");
+		stats_json(sim, out);
+	}
+	if (sim->PROFILE != NULL)
+	{
+		fprintf(out, ",\"profile\":");
+		profile_json(sim, out, PROFILE_TOP);
+	}
+	if (sim->CACHE != NULL)
+	{
+		fprintf(out, ",\"cache\":");
+		cache_json(sim, out);
+	}
+	if (sim->BPRED != NULL)
+	{
+		fprintf(out, ",\"branches\":");
+		bpred_json(sim, out, BPRED_TOP);
+	}
+	if (sim->CAPTURE_OUTPUT)
+	{
+		fclose(sim->OUTPUT);
+		sim->OUTPUT = stdout;
+		fprintf(out, ",\"output\":");
+		json_string(out, output, output_size);
+		free(output);
+	}
+	fprintf(out, "}\n");
+	fflush(out);
+
+	free_memory(sim);
+	sim->ENGINE = engine;
+	sim->STATS_ON = stats_on;
+}
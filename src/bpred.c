@@ -0,0 +1,603 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mu-riscv.h"
+
+/* What bpred_start() builds unless configured otherwise */
+static const bpred_config_t BPRED_DEFAULTS = { BPRED_GSHARE, 12, 12, 9, 16 };
+
+static const char *const BPRED_MODEL_NAMES[] = { "static", "bimodal", "gshare", "tage" };
+
+typedef struct {
+	uint32_t pc;
+	uint64_t executed, taken, mispredicted;
+} bpred_row_t;
+
+/***************************************************************/
+/* Find or create the counters for the page holding pc                               */
+/***************************************************************/
+static bpred_page_t *bpred_page(bpred_t *bpred, uint32_t pc)
+{
+	bpred_page_t **table = bpred->dir[PAGE_DIR_INDEX(pc)];
+
+	if (table == NULL)
+	{
+		table = calloc(PAGE_TABLE_ENTRIES, sizeof(bpred_page_t *));
+		if (table == NULL)
+		{
+			printf("Error: Out of memory allocating branch table\n");
+			exit(-1);
+		}
+		bpred->dir[PAGE_DIR_INDEX(pc)] = table;
+	}
+	if (table[PAGE_TABLE_INDEX(pc)] == NULL)
+	{
+		table[PAGE_TABLE_INDEX(pc)] = calloc(1, sizeof(bpred_page_t));
+		if (table[PAGE_TABLE_INDEX(pc)] == NULL)
+		{
+			printf("Error: Out of memory allocating branch page for 0x%08x\n", pc);
+			exit(-1);
+		}
+	}
+	return table[PAGE_TABLE_INDEX(pc)];
+}
+
+/* The newest length bits of history, folded into bits bits by xor */
+static uint32_t fold_history(uint64_t history, uint32_t length, uint32_t bits)
+{
+	uint32_t folded = 0;
+
+	if (length < 64)
+	{
+		history &= (1ULL << length) - 1;
+	}
+	while (history != 0)
+	{
+		folded ^= history & ((1U << bits) - 1);
+		history >>= bits;
+	}
+	return folded;
+}
+
+static void counter_train(uint8_t *counter, int taken)
+{
+	if (taken && *counter < 3)
+	{
+		(*counter)++;
+	}
+	else if (!taken && *counter > 0)
+	{
+		(*counter)--;
+	}
+}
+
+/***************************************************************/
+/* TAGE-lite: predict the branch at pc with the longest tagged table that  */
+/* matches, or the base, then train them on taken                                      */
+/***************************************************************/
+static int bpred_tage(bpred_t *bpred, uint32_t pc, int taken)
+{
+	uint32_t bits = bpred->config.table_bits - 2;
+	uint32_t index[BPRED_TAGE_TABLES];
+	uint16_t tag[BPRED_TAGE_TABLES];
+	uint8_t *base = &bpred->counters[(pc >> 2) & ((1U << bpred->config.table_bits) - 1)];
+	bpred_tagged_t *entry, *provider = NULL;
+	int provider_table = -1, prediction, alternate = (*base >= 2);
+	int t, claimed = FALSE;
+	uint32_t i;
+
+	for (t = 0; t < BPRED_TAGE_TABLES; t++)
+	{
+		index[t] = ((pc >> 2) ^ (pc >> (2 + bits)) ^ fold_history(bpred->history, bpred->lengths[t], bits)) &
+				   ((1U << bits) - 1);
+		/* the bit above the tag marks entries in use, so empty ones never match */
+		tag[t] = (((pc >> 2) ^ fold_history(bpred->history, bpred->lengths[t], BPRED_TAGE_TAG_BITS) ^
+				   (fold_history(bpred->history, bpred->lengths[t], BPRED_TAGE_TAG_BITS - 1) << 1)) &
+				  ((1U << BPRED_TAGE_TAG_BITS) - 1)) | (1U << BPRED_TAGE_TAG_BITS);
+		entry = &bpred->tagged[t][index[t]];
+		if (entry->tag == tag[t])
+		{
+			if (provider != NULL)
+			{
+				alternate = (provider->counter >= 0);
+			}
+			provider = entry;
+			provider_table = t;
+		}
+	}
+	prediction = (provider != NULL) ? (provider->counter >= 0) : alternate;
+
+	if (provider == NULL)
+	{
+		counter_train(base, taken);
+	}
+	else
+	{
+		if (prediction != alternate)
+		{
+			if (prediction == taken && provider->useful < 3)
+			{
+				provider->useful++;
+			}
+			else if (prediction != taken && provider->useful > 0)
+			{
+				provider->useful--;
+			}
+		}
+		if (taken && provider->counter < 3)
+		{
+			provider->counter++;
+		}
+		else if (!taken && provider->counter > -4)
+		{
+			provider->counter--;
+		}
+	}
+
+	/* a miss claims an entry in a longer table, if one is not useful */
+	if (prediction != taken)
+	{
+		for (t = provider_table + 1; t < BPRED_TAGE_TABLES && !claimed; t++)
+		{
+			entry = &bpred->tagged[t][index[t]];
+			if (entry->useful == 0)
+			{
+				entry->tag = tag[t];
+				entry->counter = taken ? 0 : -1;
+				claimed = TRUE;
+			}
+		}
+		/* otherwise they all age, so one will be free next time */
+		for (t = provider_table + 1; t < BPRED_TAGE_TABLES && !claimed; t++)
+		{
+			bpred->tagged[t][index[t]].useful--;
+		}
+	}
+	if (++bpred->updates % BPRED_TAGE_AGING == 0)
+	{
+		for (t = 0; t < BPRED_TAGE_TABLES; t++)
+		{
+			for (i = 0; i < (1U << bits); i++)
+			{
+				bpred->tagged[t][i].useful >>= 1;
+			}
+		}
+	}
+	return prediction;
+}
+
+/***************************************************************/
+/* Predict the direction of the conditional branch at pc, whose target    */
+/* is backward or not, then train the model on taken                                   */
+/***************************************************************/
+static int bpred_direction(bpred_t *bpred, uint32_t pc, int backward, int taken)
+{
+	uint32_t mask = (1U << bpred->config.table_bits) - 1;
+	uint8_t *counter;
+	int prediction;
+
+	switch (bpred->config.model)
+	{
+	case BPRED_STATIC:
+		return backward;
+	case BPRED_BIMODAL:
+		counter = &bpred->counters[(pc >> 2) & mask];
+		break;
+	case BPRED_GSHARE:
+		counter = &bpred->counters[((pc >> 2) ^ fold_history(bpred->history, bpred->config.history_bits,
+																 bpred->config.table_bits)) & mask];
+		break;
+	default:
+		return bpred_tage(bpred, pc, taken);
+	}
+	prediction = (*counter >= 2);
+	counter_train(counter, taken);
+	return prediction;
+}
+
+/***************************************************************/
+/* Did the BTB hold target for the transfer at pc? It does afterwards.     */
+/***************************************************************/
+static int bpred_btb(bpred_t *bpred, uint32_t pc, uint32_t target)
+{
+	bpred_btb_t *entry = &bpred->btb[(pc >> 2) & ((1U << bpred->config.btb_bits) - 1)];
+	int hit = entry->valid && entry->pc == pc && entry->target == target;
+
+	bpred->btb_lookups++;
+	bpred->btb_hits += hit;
+	entry->valid = TRUE;
+	entry->pc = pc;
+	entry->target = target;
+	return hit;
+}
+
+/***************************************************************/
+/* Predict and train on count retired instructions that started at pc;     */
+/* control went on to next_pc after the last of them, the only one that    */
+/* can transfer it                                                                                     */
+/***************************************************************/
+void bpred_retire(sim_t *sim, const decoded_insn_t *insns, uint32_t count, uint32_t pc, uint32_t next_pc)
+{
+	bpred_t *bpred = sim->BPRED;
+	const decoded_insn_t *last;
+	bpred_page_t *page;
+	uint32_t index;
+	int taken, mispredicted = FALSE;
+
+	if (count == 0)
+	{
+		return;
+	}
+	bpred->instructions += count;
+	last = &insns[count - 1];
+	pc += 4 * (count - 1);
+	taken = (next_pc != pc + 4);
+
+	if (ISA_TABLE[last->op].format == FMT_B)
+	{
+		mispredicted = (bpred_direction(bpred, pc, (int32_t)last->imm < 0, taken) != taken);
+		bpred->history = (bpred->history << 1) | taken;
+		bpred->branches++;
+		bpred->taken += taken;
+		bpred->mispredicted += mispredicted;
+		if (taken)
+		{
+			bpred_btb(bpred, pc, next_pc);
+		}
+	}
+	else if (last->op == OP_jal)
+	{
+		bpred_btb(bpred, pc, next_pc);
+	}
+	else if (last->op == OP_jalr && REG_IS_LINK(last->rs1) && (!REG_IS_LINK(last->rd) || last->rs1 != last->rd))
+	{
+		/* a return: pop the address its call pushed */
+		if (bpred->ras_count > 0)
+		{
+			bpred->ras_top = (bpred->ras_top + bpred->config.ras_depth - 1) % bpred->config.ras_depth;
+			bpred->ras_count--;
+			mispredicted = (bpred->ras[bpred->ras_top] != next_pc);
+		}
+		else
+		{
+			mispredicted = TRUE;
+		}
+		bpred->returns++;
+		bpred->returns_mispredicted += mispredicted;
+	}
+	else if (last->op == OP_jalr)
+	{
+		mispredicted = !bpred_btb(bpred, pc, next_pc);
+		bpred->indirect++;
+		bpred->indirect_mispredicted += mispredicted;
+	}
+	else
+	{
+		return;
+	}
+
+	if ((last->op == OP_jal || last->op == OP_jalr) && REG_IS_LINK(last->rd))
+	{
+		/* a call: the oldest entry goes when the stack is full */
+		bpred->ras[bpred->ras_top] = pc + 4;
+		bpred->ras_top = (bpred->ras_top + 1) % bpred->config.ras_depth;
+		if (bpred->ras_count < bpred->config.ras_depth)
+		{
+			bpred->ras_count++;
+		}
+	}
+	page = bpred_page(bpred, pc);
+	index = DECODE_INDEX(pc);
+	page->executed[index]++;
+	page->taken[index] += taken;
+	page->mispredicted[index] += mispredicted;
+}
+
+/***************************************************************/
+/* Forget every prediction and count; the tables start out cold                     */
+/***************************************************************/
+void bpred_clear(sim_t *sim)
+{
+	bpred_t *bpred = sim->BPRED;
+	uint32_t t, entries;
+	int i, j;
+
+	if (bpred == NULL)
+	{
+		return;
+	}
+	for (i = 0; i < PAGE_DIR_ENTRIES; i++)
+	{
+		if (bpred->dir[i] == NULL)
+		{
+			continue;
+		}
+		for (j = 0; j < PAGE_TABLE_ENTRIES; j++)
+		{
+			free(bpred->dir[i][j]);
+		}
+		free(bpred->dir[i]);
+		bpred->dir[i] = NULL;
+	}
+	/* weakly not taken */
+	memset(bpred->counters, 1, 1U << bpred->config.table_bits);
+	entries = 1U << (bpred->config.table_bits - 2);
+	for (t = 0; t < BPRED_TAGE_TABLES; t++)
+	{
+		memset(bpred->tagged[t], 0, entries * sizeof(bpred_tagged_t));
+	}
+	memset(bpred->btb, 0, (1U << bpred->config.btb_bits) * sizeof(bpred_btb_t));
+	bpred->history = 0;
+	bpred->updates = 0;
+	bpred->ras_top = 0;
+	bpred->ras_count = 0;
+	bpred->instructions = 0;
+	bpred->branches = bpred->taken = bpred->mispredicted = 0;
+	bpred->returns = bpred->returns_mispredicted = 0;
+	bpred->indirect = bpred->indirect_mispredicted = 0;
+	bpred->btb_lookups = bpred->btb_hits = 0;
+}
+
+static void bpred_free(bpred_t *bpred)
+{
+	uint32_t t;
+
+	free(bpred->counters);
+	for (t = 0; t < BPRED_TAGE_TABLES; t++)
+	{
+		free(bpred->tagged[t]);
+	}
+	free(bpred->btb);
+	free(bpred->ras);
+	free(bpred);
+}
+
+/***************************************************************/
+/* Switch the predictors on, cold, as configured. Returns FALSE if they    */
+/* can't be.                                                                                                */
+/***************************************************************/
+int bpred_start(sim_t *sim)
+{
+	bpred_t *bpred;
+	uint32_t t, entries;
+
+	if (sim->NUM_HARTS > 1)
+	{
+		printf("Error: Branch predictors follow a single hart\n\n");
+		return FALSE;
+	}
+	if (sim->BPRED != NULL)
+	{
+		return TRUE;
+	}
+	bpred = calloc(1, sizeof(bpred_t));
+	if (bpred == NULL)
+	{
+		printf("Error: Out of memory starting the branch predictors\n\n");
+		return FALSE;
+	}
+	bpred->config = (sim->BPRED_CONFIG.table_bits != 0) ? sim->BPRED_CONFIG : BPRED_DEFAULTS;
+	entries = 1U << (bpred->config.table_bits - 2);
+	bpred->counters = malloc(1U << bpred->config.table_bits);
+	for (t = 0; t < BPRED_TAGE_TABLES; t++)
+	{
+		/* geometric, up to history_bits */
+		bpred->lengths[t] = bpred->config.history_bits >> (BPRED_TAGE_TABLES - 1 - t);
+		if (bpred->lengths[t] == 0)
+		{
+			bpred->lengths[t] = 1;
+		}
+		bpred->tagged[t] = malloc(entries * sizeof(bpred_tagged_t));
+		if (bpred->tagged[t] == NULL)
+		{
+			break;
+		}
+	}
+	bpred->btb = malloc((1U << bpred->config.btb_bits) * sizeof(bpred_btb_t));
+	bpred->ras = calloc(bpred->config.ras_depth, sizeof(uint32_t));
+	if (bpred->counters == NULL || t < BPRED_TAGE_TABLES || bpred->btb == NULL || bpred->ras == NULL)
+	{
+		printf("Error: Out of memory starting the branch predictors\n\n");
+		bpred_free(bpred);
+		return FALSE;
+	}
+	sim->BPRED = bpred;
+	bpred_clear(sim);
+	return TRUE;
+}
+
+/***************************************************************/
+/* Switch the predictors off and forget what they counted                          */
+/***************************************************************/
+void bpred_stop(sim_t *sim)
+{
+	if (sim->BPRED == NULL)
+	{
+		return;
+	}
+	bpred_clear(sim);
+	bpred_free(sim->BPRED);
+	sim->BPRED = NULL;
+}
+
+/***************************************************************/
+/* Select the model and sizes, restarting the predictors cold if they are */
+/* on. Returns FALSE if the configuration is unusable.                                */
+/***************************************************************/
+int bpred_configure(sim_t *sim, const bpred_config_t *config)
+{
+	if (config->model > BPRED_TAGE || config->table_bits < 4 || config->table_bits > 24 ||
+		config->history_bits < 1 || config->history_bits > 64 || config->btb_bits < 1 || config->btb_bits > 20 ||
+		config->ras_depth < 1 || config->ras_depth > 1024)
+	{
+		printf("Error: Predictors need 4-24 table bits, 1-64 history bits, 1-20 BTB bits and 1-1024 RAS entries\n\n");
+		return FALSE;
+	}
+	sim->BPRED_CONFIG = *config;
+	if (sim->BPRED != NULL)
+	{
+		bpred_stop(sim);
+		return bpred_start(sim);
+	}
+	return TRUE;
+}
+
+static int row_compare(const void *a, const void *b)
+{
+	const bpred_row_t *x = a, *y = b;
+
+	if (x->mispredicted != y->mispredicted)
+	{
+		return (x->mispredicted < y->mispredicted) ? 1 : -1;
+	}
+	if (x->executed != y->executed)
+	{
+		return (x->executed < y->executed) ? 1 : -1;
+	}
+	return (x->pc > y->pc) - (x->pc < y->pc);
+}
+
+/***************************************************************/
+/* Every control transfer seen, most mispredicted first. Returns how many */
+/* rows there are; free them after.                                                              */
+/***************************************************************/
+static uint32_t bpred_rows(bpred_t *bpred, bpred_row_t **rows)
+{
+	uint32_t n = 0, capacity = 0;
+	uint32_t i, j, k;
+	bpred_page_t *page;
+
+	*rows = NULL;
+	for (i = 0; i < PAGE_DIR_ENTRIES; i++)
+	{
+		for (j = 0; bpred->dir[i] != NULL && j < PAGE_TABLE_ENTRIES; j++)
+		{
+			page = bpred->dir[i][j];
+			for (k = 0; page != NULL && k < DECODE_PAGE_ENTRIES; k++)
+			{
+				if (page->executed[k] == 0)
+				{
+					continue;
+				}
+				if (n == capacity)
+				{
+					capacity = capacity ? 2 * capacity : 256;
+					*rows = realloc(*rows, capacity * sizeof(bpred_row_t));
+					if (*rows == NULL)
+					{
+						printf("Error: Out of memory sorting the branches\n");
+						exit(-1);
+					}
+				}
+				(*rows)[n].pc = (i << (PAGE_SHIFT + PAGE_TABLE_BITS)) | (j << PAGE_SHIFT) | (k << 2);
+				(*rows)[n].executed = page->executed[k];
+				(*rows)[n].taken = page->taken[k];
+				(*rows)[n].mispredicted = page->mispredicted[k];
+				n++;
+			}
+		}
+	}
+	qsort(*rows, n, sizeof(bpred_row_t), row_compare);
+	return n;
+}
+
+static double mpki(uint64_t mispredicted, uint64_t instructions)
+{
+	return (instructions > 0) ? 1000.0 * mispredicted / instructions : 0.0;
+}
+
+static double percent(uint64_t part, uint64_t whole)
+{
+	return (whole > 0) ? 100.0 * part / whole : 0.0;
+}
+
+/***************************************************************/
+/* Dump the accuracy, then the top most mispredicted transfers, to the     */
+/* terminal                                                                                                */
+/***************************************************************/
+void bpred_print(sim_t *sim, uint32_t top)
+{
+	bpred_t *bpred = sim->BPRED;
+	bpred_row_t *rows;
+	uint64_t mispredicted;
+	uint32_t n, i;
+	char text[64];
+
+	if (bpred == NULL)
+	{
+		printf("The branch predictors are off.\n");
+		return;
+	}
+	mispredicted = bpred->mispredicted + bpred->returns_mispredicted + bpred->indirect_mispredicted;
+	printf("-------------------------------------\n");
+	printf("Branch Prediction (%s, 2^%u counters, %u history bits)\n", BPRED_MODEL_NAMES[bpred->config.model],
+		   bpred->config.table_bits, bpred->config.history_bits);
+	printf("-------------------------------------\n");
+	printf("# Instructions Predicted\t: %llu\n", (unsigned long long)bpred->instructions);
+	printf("Conditional Branches\t: %llu (%.2f%% taken)\n", (unsigned long long)bpred->branches,
+		   percent(bpred->taken, bpred->branches));
+	printf("Direction Mispredicted\t: %llu (%.2f%% accurate)\n", (unsigned long long)bpred->mispredicted,
+		   100.0 - percent(bpred->mispredicted, bpred->branches));
+	printf("Returns (RAS, %u deep)\t: %llu, %llu mispredicted\n", bpred->config.ras_depth,
+		   (unsigned long long)bpred->returns, (unsigned long long)bpred->returns_mispredicted);
+	printf("Indirect Jumps (BTB)\t: %llu, %llu mispredicted\n", (unsigned long long)bpred->indirect,
+		   (unsigned long long)bpred->indirect_mispredicted);
+	printf("BTB Hits (2^%u entries)\t: %llu / %llu\n", bpred->config.btb_bits, (unsigned long long)bpred->btb_hits,
+		   (unsigned long long)bpred->btb_lookups);
+	printf("MPKI\t: %.3f\n", mpki(mispredicted, bpred->instructions));
+	printf("-------------------------------------\n");
+	printf("[Address]\t[Executed]\t[Taken %%]\t[Mispredicted]\t[MPKI]\t[Instruction]\n");
+	printf("-------------------------------------\n");
+	n = bpred_rows(bpred, &rows);
+	for (i = 0; i < n && i < top; i++)
+	{
+		disassemble(mem_read_32(sim, rows[i].pc), text, sizeof(text));
+		printf("0x%08x\t%llu\t%.2f\t%llu\t%.3f\t%s\n", rows[i].pc, (unsigned long long)rows[i].executed,
+			   percent(rows[i].taken, rows[i].executed), (unsigned long long)rows[i].mispredicted,
+			   mpki(rows[i].mispredicted, bpred->instructions), text);
+	}
+	free(rows);
+	printf("-------------------------------------\n");
+}
+
+/***************************************************************/
+/* Write the accuracy and the top most mispredicted transfers as one JSON */
+/* object                                                                                                    */
+/***************************************************************/
+void bpred_json(sim_t *sim, FILE *out, uint32_t top)
+{
+	bpred_t *bpred = sim->BPRED;
+	bpred_row_t *rows;
+	uint64_t mispredicted = bpred->mispredicted + bpred->returns_mispredicted + bpred->indirect_mispredicted;
+	uint32_t n, i;
+	char text[64];
+
+	fprintf(out, "{\"model\":\"%s\",\"table_bits\":%u,\"history_bits\":%u,\"btb_bits\":%u,\"ras_depth\":%u",
+			BPRED_MODEL_NAMES[bpred->config.model], bpred->config.table_bits, bpred->config.history_bits,
+			bpred->config.btb_bits, bpred->config.ras_depth);
+	fprintf(out, ",\"instructions\":%llu,\"branches\":{\"count\":%llu,\"taken\":%llu,\"mispredicted\":%llu}",
+			(unsigned long long)bpred->instructions, (unsigned long long)bpred->branches,
+			(unsigned long long)bpred->taken, (unsigned long long)bpred->mispredicted);
+	fprintf(out, ",\"returns\":{\"count\":%llu,\"mispredicted\":%llu}", (unsigned long long)bpred->returns,
+			(unsigned long long)bpred->returns_mispredicted);
+	fprintf(out, ",\"indirect\":{\"count\":%llu,\"mispredicted\":%llu}", (unsigned long long)bpred->indirect,
+			(unsigned long long)bpred->indirect_mispredicted);
+	fprintf(out, ",\"btb\":{\"lookups\":%llu,\"hits\":%llu},\"mpki\":%.3f,\"pcs\":[",
+			(unsigned long long)bpred->btb_lookups, (unsigned long long)bpred->btb_hits,
+			mpki(mispredicted, bpred->instructions));
+	n = bpred_rows(bpred, &rows);
+	for (i = 0; i < n && i < top; i++)
+	{
+		disassemble(mem_read_32(sim, rows[i].pc), text, sizeof(text));
+		fprintf(out, "%s{\"pc\":%u,\"executed\":%llu,\"taken\":%llu,\"mispredicted\":%llu,\"mpki\":%.3f,\"insn\":",
+				(i == 0) ? "" : ",", rows[i].pc, (unsigned long long)rows[i].executed,
+				(unsigned long long)rows[i].taken, (unsigned long long)rows[i].mispredicted,
+				mpki(rows[i].mispredicted, bpred->instructions));
+		json_string(out, text, strlen(text));
+		fprintf(out, "}");
+	}
+	free(rows);
+	fprintf(out, "]}");
+}
@@ -0,0 +1,513 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mu-riscv.h"
+
+/* What cache_start() builds for a level left unconfigured */
+static const cache_config_t CACHE_DEFAULTS[CACHE_LEVELS] = {
+	{ 32768, 8, 64, 1, CACHE_PLRU, TRUE },	/* L1I */
+	{ 32768, 8, 64, 4, CACHE_LRU, TRUE },	/* L1D */
+	{ 262144, 16, 64, 12, CACHE_LRU, TRUE }	/* L2 */
+};
+#define CACHE_DEFAULT_MEMORY_LATENCY 100
+
+static const char *const CACHE_LEVEL_NAMES[CACHE_LEVELS] = { "l1i", "l1d", "l2" };
+static const char *const CACHE_REGION_NAMES[CACHE_REGIONS] = { "text", "data", "stack", "other" };
+
+#define IS_POWER_OF_2(x) ((x) != 0 && ((x) & ((x) - 1)) == 0)
+
+static uint32_t log2_of(uint32_t x)
+{
+	uint32_t n = 0;
+
+	while (x > 1)
+	{
+		x >>= 1;
+		n++;
+	}
+	return n;
+}
+
+/***************************************************************/
+/* Which region address is in; sp splits the data segment from the stack */
+/***************************************************************/
+static uint32_t cache_region(uint32_t address, uint32_t sp)
+{
+	if (address >= MEM_TEXT_BEGIN && address <= MEM_TEXT_END)
+	{
+		return CACHE_TEXT;
+	}
+	if (address >= MEM_DATA_BEGIN && address <= MEM_DATA_END)
+	{
+		return (address >= sp) ? CACHE_STACK : CACHE_DATA;
+	}
+	return CACHE_OTHER;
+}
+
+/***************************************************************/
+/* Mark way of set as the most recently used                                             */
+/***************************************************************/
+static void cache_touch(cache_level_t *level, uint32_t set, uint32_t way)
+{
+	uint32_t bits = log2_of(level->config.ways);
+	uint32_t node = 1, bit;
+	uint64_t tree;
+
+	if (level->config.policy == CACHE_LRU)
+	{
+		level->stamps[set * level->config.ways + way] = ++level->clock;
+		return;
+	}
+	/* every node on the way's path points at the other half */
+	tree = level->plru[set];
+	while (bits-- > 0)
+	{
+		bit = (way >> bits) & 1;
+		if (bit)
+		{
+			tree &= ~(1ULL << node);
+		}
+		else
+		{
+			tree |= 1ULL << node;
+		}
+		node = 2 * node + bit;
+	}
+	level->plru[set] = tree;
+}
+
+/***************************************************************/
+/* The way of set to fill next: an invalid one if there is one, else the  */
+/* one the policy picks                                                                                */
+/***************************************************************/
+static uint32_t cache_victim(cache_level_t *level, uint32_t set)
+{
+	uint32_t ways = level->config.ways, base = set * ways;
+	uint32_t bits = log2_of(ways);
+	uint32_t way, node = 1, victim = 0;
+	uint64_t tree = level->plru[set];
+
+	for (way = 0; way < ways; way++)
+	{
+		if (!(level->state[base + way] & CACHE_VALID))
+		{
+			return way;
+		}
+	}
+	if (level->config.policy == CACHE_LRU)
+	{
+		for (way = 1; way < ways; way++)
+		{
+			if (level->stamps[base + way] < level->stamps[base + victim])
+			{
+				victim = way;
+			}
+		}
+		return victim;
+	}
+	while (bits-- > 0)
+	{
+		victim = (victim << 1) | ((tree >> node) & 1);
+		node = 2 * node + (victim & 1);
+	}
+	return victim;
+}
+
+static uint32_t cache_access(cache_t *cache, cache_level_t *level, uint32_t address, int write, uint32_t sp);
+
+/***************************************************************/
+/* Pass a write of the line at address on below level                                  */
+/***************************************************************/
+static void cache_write_next(cache_t *cache, cache_level_t *level, uint32_t address, uint32_t sp)
+{
+	if (level->next != NULL)
+	{
+		cache_access(cache, level->next, address, TRUE, sp);
+	}
+	else
+	{
+		cache->memory_writes++;
+	}
+}
+
+/***************************************************************/
+/* Look address up in level, filling it from the levels below on a miss.  */
+/* Returns the cycles the access takes from level down.                              */
+/***************************************************************/
+static uint32_t cache_access(cache_t *cache, cache_level_t *level, uint32_t address, int write, uint32_t sp)
+{
+	uint32_t line = address >> level->line_shift;
+	uint32_t set = line & (level->sets - 1);
+	uint32_t base = set * level->config.ways;
+	uint32_t region = cache_region(address, sp);
+	uint32_t way, cycles = level->config.latency;
+
+	level->accesses[region]++;
+	for (way = 0; way < level->config.ways; way++)
+	{
+		if ((level->state[base + way] & CACHE_VALID) && level->tags[base + way] == line)
+		{
+			break;
+		}
+	}
+	if (way < level->config.ways)
+	{
+		cache_touch(level, set, way);
+		if (write && level->config.write_back)
+		{
+			level->state[base + way] |= CACHE_DIRTY;
+		}
+		else if (write)
+		{
+			cache_write_next(cache, level, address, sp);
+		}
+		return cycles;
+	}
+
+	level->misses[region]++;
+	if (write && !level->config.write_back)
+	{
+		/* no write allocate */
+		cache_write_next(cache, level, address, sp);
+		return cycles;
+	}
+	if (level->next != NULL)
+	{
+		cycles += cache_access(cache, level->next, address, FALSE, sp);
+	}
+	else
+	{
+		cache->memory_reads++;
+		cycles += cache->memory_latency;
+	}
+	way = cache_victim(level, set);
+	if ((level->state[base + way] & (CACHE_VALID | CACHE_DIRTY)) == (CACHE_VALID | CACHE_DIRTY))
+	{
+		level->writebacks++;
+		cache_write_next(cache, level, level->tags[base + way] << level->line_shift, sp);
+	}
+	level->tags[base + way] = line;
+	level->state[base + way] = CACHE_VALID | (write ? CACHE_DIRTY : 0);
+	cache_touch(level, set, way);
+	return cycles;
+}
+
+/***************************************************************/
+/* Access the size bytes at address through the L1 level, once per line  */
+/* they touch, adding any stall to the region of address                            */
+/***************************************************************/
+static void cache_reference(cache_t *cache, uint32_t l1, uint32_t address, uint32_t size, int write, uint32_t sp)
+{
+	cache_level_t *level = &cache->levels[l1];
+	uint32_t line = address >> level->line_shift;
+	uint32_t last = (address + size - 1) >> level->line_shift;
+	uint32_t cycles;
+
+	for (;;)
+	{
+		cycles = cache_access(cache, level, line << level->line_shift, write, sp);
+		if (!write)
+		{
+			cache->stalls[cache_region(address, sp)] += cycles - level->config.latency;
+		}
+		if (line == last)
+		{
+			break;
+		}
+		line++;
+	}
+}
+
+/***************************************************************/
+/* Run the fetch of the instruction that retired at pc and its memory      */
+/* access, which was at address, through the caches                                     */
+/***************************************************************/
+void cache_retire(sim_t *sim, const decoded_insn_t *insn, uint32_t pc, uint32_t address)
+{
+	cache_t *cache = sim->CACHE;
+	uint32_t sp = sim->CURRENT_STATE.REGS[2];
+	uint32_t size = 1 << (ISA_TABLE[insn->op].f3 & 3);
+
+	cache_reference(cache, CACHE_L1I, pc, 4, FALSE, sp);
+	switch (ISA_TABLE[insn->op].format)
+	{
+	case FMT_LOAD:
+		cache_reference(cache, CACHE_L1D, address, size, FALSE, sp);
+		break;
+	case FMT_S:
+		cache_reference(cache, CACHE_L1D, address, size, TRUE, sp);
+		break;
+	case FMT_AMO:
+		if (insn->op != OP_sc_w)
+		{
+			cache_reference(cache, CACHE_L1D, address, 4, FALSE, sp);
+		}
+		if (insn->op != OP_lr_w)
+		{
+			cache_reference(cache, CACHE_L1D, address, 4, TRUE, sp);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/***************************************************************/
+/* Check a level's geometry. Returns FALSE, saying why, if it is unusable. */
+/***************************************************************/
+static int cache_config_valid(const cache_config_t *config)
+{
+	if (!IS_POWER_OF_2(config->size) || !IS_POWER_OF_2(config->ways) || !IS_POWER_OF_2(config->line))
+	{
+		printf("Error: Cache size, ways and line size must be powers of two\n\n");
+		return FALSE;
+	}
+	if (config->line < 4 || config->ways > CACHE_MAX_WAYS || config->size < config->ways * config->line)
+	{
+		printf("Error: A cache needs lines of at least 4 bytes, at most %d ways and one full set\n\n", CACHE_MAX_WAYS);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void cache_level_free(cache_level_t *level)
+{
+	free(level->tags);
+	free(level->state);
+	free(level->stamps);
+	free(level->plru);
+}
+
+/***************************************************************/
+/* Empty every cache and zero the counters                                                  */
+/***************************************************************/
+void cache_clear(sim_t *sim)
+{
+	cache_t *cache = sim->CACHE;
+	cache_level_t *level;
+	uint32_t i;
+
+	if (cache == NULL)
+	{
+		return;
+	}
+	for (i = 0; i < CACHE_LEVELS; i++)
+	{
+		level = &cache->levels[i];
+		memset(level->state, 0, level->sets * level->config.ways);
+		memset(level->plru, 0, level->sets * sizeof(uint64_t));
+		level->clock = 0;
+		memset(level->accesses, 0, sizeof(level->accesses));
+		memset(level->misses, 0, sizeof(level->misses));
+		level->writebacks = 0;
+	}
+	cache->memory_reads = 0;
+	cache->memory_writes = 0;
+	memset(cache->stalls, 0, sizeof(cache->stalls));
+}
+
+/***************************************************************/
+/* Switch the cache model on, cold, with the configured levels. Returns    */
+/* FALSE if it can't be.                                                                                */
+/***************************************************************/
+int cache_start(sim_t *sim)
+{
+	cache_t *cache;
+	cache_level_t *level;
+	uint32_t i, lines;
+
+	if (sim->NUM_HARTS > 1)
+	{
+		printf("Error: The cache model follows a single hart\n\n");
+		return FALSE;
+	}
+	if (sim->CACHE != NULL)
+	{
+		return TRUE;
+	}
+	cache = calloc(1, sizeof(cache_t));
+	if (cache == NULL)
+	{
+		printf("Error: Out of memory starting the cache model\n\n");
+		return FALSE;
+	}
+	for (i = 0; i < CACHE_LEVELS; i++)
+	{
+		level = &cache->levels[i];
+		level->config = (sim->CACHE_CONFIG[i].size != 0) ? sim->CACHE_CONFIG[i] : CACHE_DEFAULTS[i];
+		level->sets = level->config.size / (level->config.ways * level->config.line);
+		level->line_shift = log2_of(level->config.line);
+		lines = level->sets * level->config.ways;
+		level->tags = calloc(lines, sizeof(uint32_t));
+		level->state = calloc(lines, sizeof(uint8_t));
+		level->stamps = calloc(lines, sizeof(uint64_t));
+		level->plru = calloc(level->sets, sizeof(uint64_t));
+		if (level->tags == NULL || level->state == NULL || level->stamps == NULL || level->plru == NULL)
+		{
+			printf("Error: Out of memory starting the cache model\n\n");
+			for (i = 0; i < CACHE_LEVELS; i++)
+			{
+				cache_level_free(&cache->levels[i]);
+			}
+			free(cache);
+			return FALSE;
+		}
+	}
+	cache->levels[CACHE_L1I].next = &cache->levels[CACHE_L2];
+	cache->levels[CACHE_L1D].next = &cache->levels[CACHE_L2];
+	cache->memory_latency = (sim->CACHE_MEMORY_LATENCY != 0) ? sim->CACHE_MEMORY_LATENCY : CACHE_DEFAULT_MEMORY_LATENCY;
+	sim->CACHE = cache;
+	return TRUE;
+}
+
+/***************************************************************/
+/* Switch the cache model off and forget what it counted                             */
+/***************************************************************/
+void cache_stop(sim_t *sim)
+{
+	uint32_t i;
+
+	if (sim->CACHE == NULL)
+	{
+		return;
+	}
+	for (i = 0; i < CACHE_LEVELS; i++)
+	{
+		cache_level_free(&sim->CACHE->levels[i]);
+	}
+	free(sim->CACHE);
+	sim->CACHE = NULL;
+}
+
+/***************************************************************/
+/* Set the geometry of one level, rebuilding the model cold if it is on.  */
+/* Returns FALSE if the geometry is unusable.                                           */
+/***************************************************************/
+int cache_configure(sim_t *sim, uint32_t level, const cache_config_t *config)
+{
+	if (level >= CACHE_LEVELS || !cache_config_valid(config))
+	{
+		return FALSE;
+	}
+	sim->CACHE_CONFIG[level] = *config;
+	if (sim->CACHE != NULL)
+	{
+		cache_stop(sim);
+		return cache_start(sim);
+	}
+	return TRUE;
+}
+
+static double percent(uint64_t part, uint64_t whole)
+{
+	return (whole > 0) ? 100.0 * part / whole : 0.0;
+}
+
+/***************************************************************/
+/* Dump the configuration, hit rates and stalls to the terminal                   */
+/***************************************************************/
+void cache_print(sim_t *sim)
+{
+	cache_t *cache = sim->CACHE;
+	const cache_level_t *level;
+	uint64_t accesses, misses, stalls = 0;
+	uint32_t i, r;
+
+	if (cache == NULL)
+	{
+		printf("The cache model is off.\n");
+		return;
+	}
+	printf("-------------------------------------\n");
+	printf("Cache Model\n");
+	printf("-------------------------------------\n");
+	printf("[Level]\t[Size]\t[Ways]\t[Line]\t[Policy]\t[Latency]\n");
+	for (i = 0; i < CACHE_LEVELS; i++)
+	{
+		level = &cache->levels[i];
+		printf("%s\t%u\t%u\t%u\t%s %s\t%u\n", CACHE_LEVEL_NAMES[i], level->config.size, level->config.ways,
+			   level->config.line, (level->config.policy == CACHE_LRU) ? "lru" : "plru",
+			   level->config.write_back ? "wb" : "wt", level->config.latency);
+	}
+	printf("memory\t\t\t\t\t%u\n", cache->memory_latency);
+	printf("-------------------------------------\n");
+	printf("[Level]\t[Region]\t[Accesses]\t[Misses]\t[Miss %%]\n");
+	printf("-------------------------------------\n");
+	for (i = 0; i < CACHE_LEVELS; i++)
+	{
+		level = &cache->levels[i];
+		accesses = misses = 0;
+		for (r = 0; r < CACHE_REGIONS; r++)
+		{
+			accesses += level->accesses[r];
+			misses += level->misses[r];
+			if (level->accesses[r] != 0)
+			{
+				printf("%s\t%s\t%llu\t%llu\t%.2f\n", CACHE_LEVEL_NAMES[i], CACHE_REGION_NAMES[r],
+					   (unsigned long long)level->accesses[r], (unsigned long long)level->misses[r],
+					   percent(level->misses[r], level->accesses[r]));
+			}
+		}
+		printf("%s\tall\t%llu\t%llu\t%.2f\n", CACHE_LEVEL_NAMES[i], (unsigned long long)accesses,
+			   (unsigned long long)misses, percent(misses, accesses));
+	}
+	printf("-------------------------------------\n");
+	for (r = 0; r < CACHE_REGIONS; r++)
+	{
+		if (cache->stalls[r] != 0)
+		{
+			printf("Stall Cycles (%s)\t: %llu\n", CACHE_REGION_NAMES[r], (unsigned long long)cache->stalls[r]);
+		}
+		stalls += cache->stalls[r];
+	}
+	printf("Stall Cycles\t: %llu\n", (unsigned long long)stalls);
+	printf("Writebacks (L1D/L2)\t: %llu / %llu\n", (unsigned long long)cache->levels[CACHE_L1D].writebacks,
+		   (unsigned long long)cache->levels[CACHE_L2].writebacks);
+	printf("Memory Reads / Writes\t: %llu / %llu\n", (unsigned long long)cache->memory_reads,
+		   (unsigned long long)cache->memory_writes);
+	printf("-------------------------------------\n");
+}
+
+/***************************************************************/
+/* Write the configuration and counters as one JSON object                        */
+/***************************************************************/
+void cache_json(sim_t *sim, FILE *out)
+{
+	cache_t *cache = sim->CACHE;
+	const cache_level_t *level;
+	const char *sep;
+	uint64_t stalls = 0;
+	uint32_t i, r;
+
+	fprintf(out, "{\"memory_latency\":%u,\"levels\":{", cache->memory_latency);
+	for (i = 0; i < CACHE_LEVELS; i++)
+	{
+		level = &cache->levels[i];
+		fprintf(out, "%s\"%s\":{\"size\":%u,\"ways\":%u,\"line\":%u,\"latency\":%u,\"policy\":\"%s\",\"write\":\"%s\"",
+				(i == 0) ? "" : ",", CACHE_LEVEL_NAMES[i], level->config.size, level->config.ways, level->config.line,
+				level->config.latency, (level->config.policy == CACHE_LRU) ? "lru" : "plru",
+				level->config.write_back ? "back" : "through");
+		fprintf(out, ",\"writebacks\":%llu,\"regions\":{", (unsigned long long)level->writebacks);
+		sep = "";
+		for (r = 0; r < CACHE_REGIONS; r++)
+		{
+			if (level->accesses[r] != 0)
+			{
+				fprintf(out, "%s\"%s\":{\"accesses\":%llu,\"misses\":%llu}", sep, CACHE_REGION_NAMES[r],
+						(unsigned long long)level->accesses[r], (unsigned long long)level->misses[r]);
+				sep = ",";
+			}
+		}
+		fprintf(out, "}}");
+	}
+	fprintf(out, "},\"memory\":{\"reads\":%llu,\"writes\":%llu},\"stalls\":{",
+			(unsigned long long)cache->memory_reads, (unsigned long long)cache->memory_writes);
+	for (r = 0; r < CACHE_REGIONS; r++)
+	{
+		fprintf(out, "\"%s\":%llu,", CACHE_REGION_NAMES[r], (unsigned long long)cache->stalls[r]);
+		stalls += cache->stalls[r];
+	}
+	fprintf(out, "\"total\":%llu}}", (unsigned long long)stalls);
+}
@@ -0,0 +1,341 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mu-riscv.h"
+
+/***************************************************************/
+/* Does this guest page live inside the mapped checkpoint?                     */
+/***************************************************************/
+int checkpoint_owns_page(sim_t *sim, const uint8_t *page)
+{
+	return sim->CHECKPOINT_IMAGE != NULL && page >= sim->CHECKPOINT_IMAGE &&
+		page < sim->CHECKPOINT_IMAGE + sim->CHECKPOINT_IMAGE_SIZE;
+}
+
+/***************************************************************/
+/* Unmap the last restored checkpoint; no guest page may point into it   */
+/***************************************************************/
+void checkpoint_unload(sim_t *sim)
+{
+	if (sim->CHECKPOINT_IMAGE != NULL)
+	{
+		munmap(sim->CHECKPOINT_IMAGE, sim->CHECKPOINT_IMAGE_SIZE);
+		sim->CHECKPOINT_IMAGE = NULL;
+		sim->CHECKPOINT_IMAGE_SIZE = 0;
+	}
+}
+
+static int page_is_zero(const uint8_t *page)
+{
+	return page[0] == 0 && memcmp(page, page + 1, PAGE_SIZE - 1) == 0;
+}
+
+/***************************************************************/
+/* Write registers, counters and every non-zero guest page to path.         */
+/* Returns FALSE if the file could not be written.                                */
+/***************************************************************/
+int checkpoint_save(sim_t *sim, const char *path)
+{
+	checkpoint_header_t header;
+	uint32_t *pages = NULL;
+	uint32_t capacity = 0;
+	uint32_t i, j;
+	uint8_t *page;
+	FILE *fp;
+	long pad;
+
+	if (sim->NUM_HARTS > 1)
+	{
+		printf("Error: Checkpoints hold a single hart\n\n");
+		return FALSE;
+	}
+
+	/* collect the non-zero pages, in address order */
+	memset(&header, 0, sizeof(header));
+	for (i = 0; i < PAGE_DIR_ENTRIES; i++)
+	{
+		if (sim->PAGE_DIR[i] == NULL)
+		{
+			continue;
+		}
+		for (j = 0; j < PAGE_TABLE_ENTRIES; j++)
+		{
+			page = sim->PAGE_DIR[i][j];
+			if (page == NULL || page_is_zero(page))
+			{
+				continue;
+			}
+			if (header.num_pages == capacity)
+			{
+				capacity = capacity ? 2 * capacity : 256;
+				pages = realloc(pages, capacity * sizeof(uint32_t));
+				if (pages == NULL)
+				{
+					printf("Error: Out of memory writing checkpoint %s\n", path);
+					exit(-1);
+				}
+			}
+			pages[header.num_pages++] = (i << PAGE_TABLE_BITS) | j;
+		}
+	}
+
+	memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+	header.version = CHECKPOINT_VERSION;
+	header.data_offset = (sizeof(header) + header.num_pages * sizeof(uint32_t) + PAGE_OFFSET_MASK) & ~PAGE_OFFSET_MASK;
+	header.pc = sim->CURRENT_STATE.PC;
+	memcpy(header.regs, sim->CURRENT_STATE.REGS, sizeof(header.regs));
+	header.hi = sim->CURRENT_STATE.HI;
+	header.lo = sim->CURRENT_STATE.LO;
+	header.instruction_count = sim->INSTRUCTION_COUNT;
+	header.run_flag = sim->RUN_FLAG;
+	header.program_base = sim->PROGRAM_BASE;
+	header.program_size = sim->PROGRAM_SIZE;
+
+	fp = fopen(path, "wb");
+	if (fp == NULL)
+	{
+		printf("Error: Can't create checkpoint file %s\n\n", path);
+		free(pages);
+		return FALSE;
+	}
+	fwrite(&header, sizeof(header), 1, fp);
+	fwrite(pages, sizeof(uint32_t), header.num_pages, fp);
+	pad = header.data_offset - sizeof(header) - header.num_pages * sizeof(uint32_t);
+	fwrite(ZERO_PAGE, 1, pad, fp);
+	for (i = 0; i < header.num_pages; i++)
+	{
+		fwrite(mem_page_read(sim, pages[i] << PAGE_SHIFT), PAGE_SIZE, 1, fp);
+	}
+	free(pages);
+	if (ferror(fp) | fclose(fp))
+	{
+		printf("Error: Can't write checkpoint file %s\n\n", path);
+		return FALSE;
+	}
+
+	sim_log("Checkpoint saved to %s.\n%d pages written.\n\n", path, header.num_pages);
+	return TRUE;
+}
+
+/***************************************************************/
+/* Replace registers, counters and all of guest memory with the contents  */
+/* of a checkpoint. The file is mapped, not read: its pages become guest  */
+/* pages as they are, and reset() still goes back to the loaded program.  */
+/* Returns FALSE, with the simulator untouched, if the file is not usable. */
+/***************************************************************/
+int checkpoint_restore(sim_t *sim, const char *path)
+{
+	const checkpoint_header_t *header;
+	const uint32_t *pages;
+	struct stat st;
+	uint8_t *image;
+	uint32_t i;
+	int fd;
+
+	if (sim->NUM_HARTS > 1)
+	{
+		printf("Error: Checkpoints hold a single hart\n\n");
+		return FALSE;
+	}
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+	{
+		printf("Error: Can't open checkpoint file %s\n\n", path);
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		return FALSE;
+	}
+	if ((size_t)st.st_size < sizeof(checkpoint_header_t))
+	{
+		printf("Error: %s is not a checkpoint\n\n", path);
+		close(fd);
+		return FALSE;
+	}
+	image = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (image == MAP_FAILED)
+	{
+		printf("Error: Can't map checkpoint file %s\n\n", path);
+		return FALSE;
+	}
+
+	header = (const checkpoint_header_t *)image;
+	pages = (const uint32_t *)(header + 1);
+	if (memcmp(header->magic, CHECKPOINT_MAGIC, sizeof(header->magic)) != 0 ||
+		header->version != CHECKPOINT_VERSION ||
+		(header->data_offset & PAGE_OFFSET_MASK) != 0 ||
+		header->data_offset < sizeof(*header) + (uint64_t)header->num_pages * sizeof(uint32_t) ||
+		header->data_offset + (uint64_t)header->num_pages * PAGE_SIZE > (uint64_t)st.st_size)
+	{
+		printf("Error: %s is not a checkpoint or is truncated\n\n", path);
+		munmap(image, st.st_size);
+		return FALSE;
+	}
+	for (i = 0; i < header->num_pages; i++)
+	{
+		if (pages[i] >= NUM_GUEST_PAGES)
+		{
+			printf("Error: %s is not a checkpoint or is truncated\n\n", path);
+			munmap(image, st.st_size);
+			return FALSE;
+		}
+	}
+
+	/* nothing may point into the previous checkpoint once it is unmapped */
+	mem_discard_pages(sim);
+	decode_flush(sim);
+	checkpoint_unload(sim);
+	sim->CHECKPOINT_IMAGE = image;
+	sim->CHECKPOINT_IMAGE_SIZE = st.st_size;
+
+	for (i = 0; i < header->num_pages; i++)
+	{
+		mem_page_map(sim, pages[i] << PAGE_SHIFT, image + header->data_offset + (size_t)i * PAGE_SIZE);
+		mem_mark_dirty(sim, pages[i] << PAGE_SHIFT);
+	}
+
+	sim->CURRENT_STATE.PC = header->pc;
+	memcpy(sim->CURRENT_STATE.REGS, header->regs, sizeof(header->regs));
+	sim->CURRENT_STATE.HI = header->hi;
+	sim->CURRENT_STATE.LO = header->lo;
+	sim->INSTRUCTION_COUNT = header->instruction_count;
+	sim->RUN_FLAG = header->run_flag;
+	sim->PROGRAM_BASE = header->program_base;
+	sim->PROGRAM_SIZE = header->program_size;
+
+	sim_log("Checkpoint restored from %s.\n%d pages mapped.\n\n", path, header->num_pages);
+	return TRUE;
+}
+
+static int page_number_cmp(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return (x > y) - (x < y);
+}
+
+/***************************************************************/
+/* Take an interval checkpoint of a single-hart simulation that has         */
+/* retired start instructions. prev is the one taken before it, or NULL.   */
+/* The simulation's dirty pages are the ones written since it was loaded; */
+/* those that still match prev's copy share it.                                     */
+/***************************************************************/
+interval_t *interval_take(sim_t *sim, const interval_t *prev, uint64_t start)
+{
+	interval_t *interval = calloc(1, sizeof(interval_t));
+	uint32_t i, j = 0;
+	uint8_t *page;
+	interval_page_t *copy;
+
+	if (interval == NULL || (sim->NUM_DIRTY_PAGES > 0 &&
+		((interval->pages = malloc(sim->NUM_DIRTY_PAGES * sizeof(uint32_t))) == NULL ||
+		(interval->data = malloc(sim->NUM_DIRTY_PAGES * sizeof(interval_page_t *))) == NULL)))
+	{
+		printf("Error: Out of memory taking an interval checkpoint\n");
+		exit(-1);
+	}
+	interval->refs = 1;
+	interval->start = start;
+	interval->state = sim->CURRENT_STATE;
+	if (sim->NUM_DIRTY_PAGES > 0)
+	{
+		memcpy(interval->pages, sim->DIRTY_PAGES, sim->NUM_DIRTY_PAGES * sizeof(uint32_t));
+		qsort(interval->pages, sim->NUM_DIRTY_PAGES, sizeof(uint32_t), page_number_cmp);
+	}
+
+	for (i = 0; i < sim->NUM_DIRTY_PAGES; i++)
+	{
+		page = mem_page_read(sim, interval->pages[i] << PAGE_SHIFT);
+		if (page == ZERO_PAGE)
+		{
+			/* a store outside every memory region, which changed nothing */
+			continue;
+		}
+
+		/* both lists are sorted: walk prev's alongside */
+		while (prev != NULL && j < prev->num_pages && prev->pages[j] < interval->pages[i])
+		{
+			j++;
+		}
+		if (prev != NULL && j < prev->num_pages && prev->pages[j] == interval->pages[i] &&
+			memcmp(prev->data[j]->data, page, PAGE_SIZE) == 0)
+		{
+			copy = prev->data[j];
+			__atomic_add_fetch(&copy->refs, 1, __ATOMIC_RELAXED);
+		}
+		else
+		{
+			copy = malloc(sizeof(interval_page_t));
+			if (copy == NULL)
+			{
+				printf("Error: Out of memory taking an interval checkpoint\n");
+				exit(-1);
+			}
+			copy->refs = 1;
+			memcpy(copy->data, page, PAGE_SIZE);
+		}
+		interval->pages[interval->num_pages] = interval->pages[i];
+		interval->data[interval->num_pages++] = copy;
+	}
+	return interval;
+}
+
+/***************************************************************/
+/* Put a simulation of the same program where an interval checkpoint was */
+/* taken. Its INSTRUCTION_COUNT starts over at 0 for the interval.           */
+/***************************************************************/
+void interval_restore(sim_t *sim, const interval_t *interval)
+{
+	uint32_t i, address;
+	uint8_t *page;
+
+	/* back to the loaded program, then the pages written since */
+	mem_restore_dirty(sim);
+	for (i = 0; i < interval->num_pages; i++)
+	{
+		address = interval->pages[i] << PAGE_SHIFT;
+		page = mem_page_write(sim, address);
+		if (page == NULL)
+		{
+			/* outside the memory regions, where only the loader maps pages */
+			page = mem_page_map(sim, address, NULL);
+		}
+		memcpy(page, interval->data[i]->data, PAGE_SIZE);
+		decode_forget_page(sim, address);
+	}
+	sim->CURRENT_STATE = interval->state;
+	sim->INSTRUCTION_COUNT = 0;
+	sim->RUN_FLAG = TRUE;
+	sim->RESERVATION = TLB_INVALID;
+}
+
+/***************************************************************/
+/* Drop a reference to an interval checkpoint. The last one frees it and   */
+/* the page copies only it held.                                                               */
+/***************************************************************/
+void interval_release(interval_t *interval)
+{
+	uint32_t i;
+
+	if (__atomic_sub_fetch(&interval->refs, 1, __ATOMIC_ACQ_REL) > 0)
+	{
+		return;
+	}
+	for (i = 0; i < interval->num_pages; i++)
+	{
+		if (__atomic_sub_fetch(&interval->data[i]->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		{
+			free(interval->data[i]);
+		}
+	}
+	free(interval->pages);
+	free(interval->data);
+	free(interval);
+}
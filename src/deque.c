@@ -0,0 +1,64 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "mu-riscv.h"
+
+/***************************************************************/
+/* Give a deque the jobs top up to, not including, bottom                          */
+/***************************************************************/
+void deque_init(job_deque_t *deque, int64_t top, int64_t bottom)
+{
+	atomic_init(&deque->top, top);
+	atomic_init(&deque->bottom, bottom);
+}
+
+/***************************************************************/
+/* Owner end of a deque: the job at the bottom, or -1 if it is empty         */
+/***************************************************************/
+int64_t deque_pop(job_deque_t *deque)
+{
+	int64_t bottom = atomic_load(&deque->bottom) - 1;
+	int64_t top, job;
+
+	atomic_store(&deque->bottom, bottom);
+	top = atomic_load(&deque->top);
+	if (top > bottom)
+	{
+		/* empty, put bottom back */
+		atomic_store(&deque->bottom, bottom + 1);
+		return -1;
+	}
+	job = bottom;
+	if (top == bottom)
+	{
+		/* last job: race the thieves for it. A failed exchange overwrites */
+		/* top, so the deque is left empty from bottom, not from top.       */
+		if (!atomic_compare_exchange_strong(&deque->top, &top, top + 1))
+		{
+			job = -1;
+		}
+		atomic_store(&deque->bottom, bottom + 1);
+	}
+	return job;
+}
+
+/***************************************************************/
+/* Thief end of a deque: the job at the top, or -1 if there is none           */
+/***************************************************************/
+int64_t deque_steal(job_deque_t *deque)
+{
+	int64_t top = atomic_load(&deque->top);
+	int64_t bottom = atomic_load(&deque->bottom);
+
+	while (top < bottom)
+	{
+		if (atomic_compare_exchange_strong(&deque->top, &top, top + 1))
+		{
+			return top;
+		}
+		/* top now holds the current value; another thief or the owner won */
+		bottom = atomic_load(&deque->bottom);
+	}
+	return -1;
+}
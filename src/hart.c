@@ -0,0 +1,255 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "mu-riscv.h"
+
+/* One harts_run() call: the budget every hart gets and the first event */
+/* that stopped the machine.                                                                           */
+typedef struct {
+	sim_t *sim;
+	uint64_t cycles;
+	int stop;	/* set once result holds a reason to stop every hart */
+	pthread_mutex_t lock;
+	run_result_t result;
+} hart_run_t;
+
+typedef struct {
+	hart_run_t *run;
+	sim_t *hart;
+} hart_thread_t;
+
+/***************************************************************/
+/* Throw away every hart but hart 0                                                                   */
+/***************************************************************/
+void harts_stop(sim_t *sim)
+{
+	uint32_t i;
+
+	for (i = 1; i < MAX_HARTS; i++)
+	{
+		if (sim->HARTS[i] != NULL)
+		{
+			sim_destroy(sim->HARTS[i]);
+			sim->HARTS[i] = NULL;
+		}
+	}
+}
+
+/***************************************************************/
+/* Give the loaded program NUM_HARTS harts, each starting from the state */
+/* hart 0 was loaded with                                                                                   */
+/***************************************************************/
+void harts_start(sim_t *sim)
+{
+	sim_t *hart;
+	uint32_t i;
+
+	harts_stop(sim);
+	for (i = 1; i < sim->NUM_HARTS; i++)
+	{
+		hart = sim_create();
+		hart->MEMORY = sim;
+		hart->HART_ID = i;
+		hart->PROGRAM_BASE = sim->PROGRAM_BASE;
+		hart->PROGRAM_SIZE = sim->PROGRAM_SIZE;
+		hart->CURRENT_STATE = sim->PRISTINE_STATE;
+		hart->CURRENT_STATE.REGS[10] = i;	/* a0 */
+		hart->CURRENT_STATE.REGS[4] = i;	/* tp */
+		hart->CURRENT_STATE.REGS[2] -= i * HART_STACK_SIZE;	/* sp */
+		hart->PRISTINE_STATE = hart->CURRENT_STATE;
+		decode_share_image(hart);
+		sim->HARTS[i] = hart;
+	}
+}
+
+/***************************************************************/
+/* Can any hart still run?                                                                                   */
+/***************************************************************/
+int harts_running(sim_t *sim)
+{
+	uint32_t i;
+
+	for (i = 0; i < sim->NUM_HARTS; i++)
+	{
+		if (sim->HARTS[i] != NULL && sim->HARTS[i]->RUN_FLAG)
+		{
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/***************************************************************/
+/* Service what stopped one hart's run_budget(). Returns TRUE if the other */
+/* harts can go on: only a hart running off the end of the program stops   */
+/* by itself. An exit ends every hart, a breakpoint pauses them all.          */
+/***************************************************************/
+static int hart_exit(hart_run_t *run, sim_t *hart, run_result_t result)
+{
+	switch (result.reason)
+	{
+	case RUN_ECALL:
+		SYSCALL_Processing(hart, hart->CURRENT_STATE.REGS[17]);
+		if (hart->RUN_FLAG)
+		{
+			return TRUE;
+		}
+		break;
+	case RUN_BREAKPOINT:
+		sim_log("Breakpoint at 0x%08x on hart %u.\n\n", result.pc, hart->HART_ID);
+		break;
+	case RUN_ILLEGAL:
+		sim_log("Invalid instruction at 0x%08x on hart %u.\n\n", result.pc, hart->HART_ID);
+		hart->RUN_FLAG = FALSE;
+		break;
+	case RUN_HALTED:
+		SYSCALL_Processing(hart, 10);
+		return TRUE;
+	default:
+		return TRUE;
+	}
+
+	pthread_mutex_lock(&run->lock);
+	if (!run->stop)
+	{
+		result.hart = hart->HART_ID;
+		run->result = result;
+		__atomic_store_n(&run->stop, TRUE, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&run->lock);
+	return FALSE;
+}
+
+/***************************************************************/
+/* Free-running hart: run_budget() in slices of HART_SLICE, looking for a */
+/* stop from the other harts in between                                                        */
+/***************************************************************/
+static void *hart_thread(void *arg)
+{
+	hart_thread_t *thread = arg;
+	hart_run_t *run = thread->run;
+	sim_t *hart = thread->hart;
+	uint64_t done = 0;
+	run_result_t result;
+
+	while (hart->RUN_FLAG && done < run->cycles && !__atomic_load_n(&run->stop, __ATOMIC_ACQUIRE))
+	{
+		result = run_budget(hart, (run->cycles - done > HART_SLICE) ? HART_SLICE : run->cycles - done);
+		done += result.executed;
+		if (result.reason != RUN_BUDGET && !hart_exit(run, hart, result))
+		{
+			break;
+		}
+	}
+	return NULL;
+}
+
+/***************************************************************/
+/* Lockstep: the harts take turns, LOCKSTEP instructions each, in hart id  */
+/* order on this thread                                                                                     */
+/***************************************************************/
+static void harts_lockstep(hart_run_t *run)
+{
+	sim_t *sim = run->sim;
+	uint64_t done[MAX_HARTS] = { 0 };
+	run_result_t result;
+	sim_t *hart;
+	uint32_t i;
+	int turns;
+
+	do
+	{
+		turns = 0;
+		for (i = 0; i < sim->NUM_HARTS; i++)
+		{
+			hart = sim->HARTS[i];
+			if (!hart->RUN_FLAG || done[i] == run->cycles)
+			{
+				continue;
+			}
+			result = run_budget(hart, (run->cycles - done[i] > sim->LOCKSTEP) ? sim->LOCKSTEP : run->cycles - done[i]);
+			done[i] += result.executed;
+			turns++;
+			if (result.reason != RUN_BUDGET && !hart_exit(run, hart, result))
+			{
+				return;
+			}
+		}
+	} while (turns > 0);
+}
+
+/***************************************************************/
+/* Run every hart for up to cycles instructions. Services ecalls itself and */
+/* returns when the harts used up their cycles, all ran off the end of the */
+/* program, or one of them hit an exit, breakpoint or invalid instruction; */
+/* the result says which and on what hart.                                                */
+/***************************************************************/
+run_result_t harts_run(sim_t *sim, uint64_t cycles)
+{
+	hart_thread_t threads[MAX_HARTS];
+	pthread_t ids[MAX_HARTS];
+	hart_run_t run;
+	sim_t *hart;
+	uint32_t i;
+
+	memset(&run, 0, sizeof(run));
+	run.sim = sim;
+	run.cycles = cycles;
+	pthread_mutex_init(&run.lock, NULL);
+
+	/* the REPL only ever changes hart 0 */
+	for (i = 1; i < sim->NUM_HARTS; i++)
+	{
+		hart = sim->HARTS[i];
+		hart->OUTPUT = sim->OUTPUT;
+		hart->STATS_ON = sim->STATS_ON;
+		if (hart->ENGINE != sim->ENGINE)
+		{
+			hart->ENGINE = sim->ENGINE;
+			block_flush(hart);
+		}
+	}
+
+	if (sim->LOCKSTEP > 0)
+	{
+		harts_lockstep(&run);
+	}
+	else
+	{
+		for (i = 0; i < sim->NUM_HARTS; i++)
+		{
+			threads[i].run = &run;
+			threads[i].hart = sim->HARTS[i];
+			if (i > 0 && pthread_create(&ids[i], NULL, hart_thread, &threads[i]) != 0)
+			{
+				printf("Error: Can't start a thread for hart %u\n", i);
+				exit(-1);
+			}
+		}
+		hart_thread(&threads[0]);
+		for (i = 1; i < sim->NUM_HARTS; i++)
+		{
+			pthread_join(ids[i], NULL);
+		}
+	}
+	pthread_mutex_destroy(&run.lock);
+
+	if (!run.stop)
+	{
+		run.result.reason = harts_running(sim) ? RUN_BUDGET : RUN_HALTED;
+		run.result.pc = sim->CURRENT_STATE.PC;
+		return run.result;
+	}
+	if (run.result.reason == RUN_ECALL || run.result.reason == RUN_ILLEGAL)
+	{
+		/* the program is over for every hart */
+		for (i = 0; i < sim->NUM_HARTS; i++)
+		{
+			sim->HARTS[i]->RUN_FLAG = FALSE;
+		}
+	}
+	return run.result;
+}
@@ -0,0 +1,464 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "mu-riscv.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+
+#include <sys/mman.h>
+
+/***************************************************************/
+/* Translated code layout                                                                                  */
+/*                                                                                                                          */
+/* Each translated block is a function uint32_t f(sim_t *sim). rbx holds   */
+/* sim for the whole block; guest registers are read and written in place */
+/* in sim->CURRENT_STATE.REGS, so the interpreter and translated code     */
+/* never have to sync a register file. eax, ecx, edx, esi and edi are      */
+/* scratch. Before returning, the block stores the next guest PC in        */
+/* sim->CURRENT_STATE.PC and returns how many instructions it retired.     */
+/***************************************************************/
+#define JIT_MAX_INSN_BYTES 80	/* longest sequence emitted for one instruction */
+#define JIT_FRAME_BYTES 64	/* prologue and final exit */
+
+#define REG_DISP(r) ((uint32_t)(offsetof(sim_t, CURRENT_STATE.REGS) + 4 * (r)))
+#define PC_DISP ((uint32_t)offsetof(sim_t, CURRENT_STATE.PC))
+#define FLUSH_DISP ((uint32_t)offsetof(sim_t, BLOCK_FLUSH_PENDING))
+
+/* x86 register numbers used in ModRM */
+#define X86_EAX 0
+#define X86_ECX 1
+#define X86_EDX 2
+#define X86_ESI 6
+#define X86_EDI 7
+
+static int JIT_BROKEN;	/* mmap failed, never try again */
+static __thread uint8_t *EMIT;	/* write cursor, per thread so simulations can compile in parallel */
+
+static void emit8(uint8_t value)
+{
+	*EMIT++ = value;
+}
+
+static void emit32(uint32_t value)
+{
+	memcpy(EMIT, &value, 4);
+	EMIT += 4;
+}
+
+static void emit64(uint64_t value)
+{
+	memcpy(EMIT, &value, 8);
+	EMIT += 8;
+}
+
+/* <opcode> reg, [rbx + disp32] (or the reverse, depending on opcode) */
+static void emit_rbx_op(uint8_t opcode, int reg, uint32_t disp)
+{
+	emit8(opcode);
+	emit8(0x80 | (reg << 3) | 3);
+	emit32(disp);
+}
+
+/* mov reg, guest register */
+static void emit_load_reg(int reg, uint32_t guest)
+{
+	emit_rbx_op(0x8B, reg, REG_DISP(guest));
+}
+
+/* mov guest register, reg */
+static void emit_store_reg(uint32_t guest, int reg)
+{
+	emit_rbx_op(0x89, reg, REG_DISP(guest));
+}
+
+/* mov dword [rbx + disp32], imm32 */
+static void emit_store_imm(uint32_t disp, uint32_t value)
+{
+	emit_rbx_op(0xC7, 0, disp);
+	emit32(value);
+}
+
+/* mov rdi, rbx; mov rax, target; call rax: target(sim, esi, edx) */
+static void emit_call(void *target)
+{
+	emit8(0x48);	/* mov rdi, rbx */
+	emit8(0x89);
+	emit8(0xDF);
+	emit8(0x48);
+	emit8(0xB8);
+	emit64((uint64_t)(uintptr_t)target);
+	emit8(0xFF);
+	emit8(0xD0);
+}
+
+/* leave the block: state->PC = next_pc, return retired */
+static void emit_exit(uint32_t next_pc, uint32_t retired)
+{
+	emit_store_imm(PC_DISP, next_pc);
+	emit8(0xB8);	/* mov eax, imm32 */
+	emit32(retired);
+	emit8(0x5B);	/* pop rbx */
+	emit8(0xC3);	/* ret */
+}
+#define EXIT_BYTES 17
+
+/* esi = guest rs1 + imm, the effective address of a load or store */
+static void emit_address(const decoded_insn_t *insn)
+{
+	emit_load_reg(X86_ESI, insn->rs1);
+	emit8(0x81);	/* add esi, imm32 */
+	emit8(0xC6);
+	emit32(insn->imm);
+}
+
+/* eax = rs1 <op> rs2, written back to rd */
+static void emit_alu_reg(uint8_t opcode, const decoded_insn_t *insn)
+{
+	emit_load_reg(X86_EAX, insn->rs1);
+	emit_rbx_op(opcode, X86_EAX, REG_DISP(insn->rs2));
+	emit_store_reg(insn->rd, X86_EAX);
+}
+
+/* eax = rs1 <op> imm, written back to rd */
+static void emit_alu_imm(uint8_t opcode, const decoded_insn_t *insn)
+{
+	emit_load_reg(X86_EAX, insn->rs1);
+	emit8(opcode);	/* <op> eax, imm32 */
+	emit32(insn->imm);
+	emit_store_reg(insn->rd, X86_EAX);
+}
+
+/* eax = rs1 shifted by imm, written back to rd */
+static void emit_shift_imm(uint8_t modrm, const decoded_insn_t *insn)
+{
+	emit_load_reg(X86_EAX, insn->rs1);
+	emit8(0xC1);
+	emit8(modrm);
+	emit8(insn->imm);
+	emit_store_reg(insn->rd, X86_EAX);
+}
+
+/* eax = rs1 shifted by rs2 & 31 (x86 masks cl the same way), written back to rd */
+static void emit_shift_reg(uint8_t modrm, const decoded_insn_t *insn)
+{
+	emit_load_reg(X86_ECX, insn->rs2);
+	emit_load_reg(X86_EAX, insn->rs1);
+	emit8(0xD3);
+	emit8(modrm);
+	emit_store_reg(insn->rd, X86_EAX);
+}
+
+/* rd = set<cc> after cmp eax, second operand (rs2, or imm if insn is I-type) */
+static void emit_set_less(uint8_t setcc, int imm, const decoded_insn_t *insn)
+{
+	emit_load_reg(X86_EAX, insn->rs1);
+	if (imm)
+	{
+		emit8(0x3D);	/* cmp eax, imm32 */
+		emit32(insn->imm);
+	}
+	else
+	{
+		emit_rbx_op(0x3B, X86_EAX, REG_DISP(insn->rs2));	/* cmp eax, rs2 */
+	}
+	emit8(0x0F);	/* set<cc> al */
+	emit8(setcc);
+	emit8(0xC0);
+	emit8(0x0F);	/* movzx eax, al */
+	emit8(0xB6);
+	emit8(0xC0);
+	emit_store_reg(insn->rd, X86_EAX);
+}
+
+/* rd = read(rs1 + imm), extended with the given movsx/movzx (0 for none) */
+static void emit_load(void *reader, uint8_t extend, const decoded_insn_t *insn)
+{
+	emit_address(insn);
+	emit_call(reader);
+	if (extend)
+	{
+		emit8(0x0F);
+		emit8(extend);
+		emit8(0xC0);	/* eax, al/ax */
+	}
+	emit_store_reg(insn->rd, X86_EAX);
+}
+
+/* write(rs1 + imm, rs2); stop after it if it overwrote cached code */
+static void emit_store(void *writer, const decoded_insn_t *insn, uint32_t pc, uint32_t retired)
+{
+	emit_address(insn);
+	emit_load_reg(X86_EDX, insn->rs2);
+	emit_call(writer);
+
+	emit_rbx_op(0x83, 7, FLUSH_DISP);	/* cmp dword sim->BLOCK_FLUSH_PENDING, 0 */
+	emit8(0x00);
+	emit8(0x74);	/* je over the exit */
+	emit8(EXIT_BYTES);
+	emit_exit(pc + 4, retired);
+}
+
+/* state->PC = cond ? taken : not taken, using cmov<cc> after cmp rs1, rs2 */
+static void emit_branch(uint8_t cmov, const decoded_insn_t *insn, uint32_t pc, uint32_t retired)
+{
+	emit_load_reg(X86_EAX, insn->rs1);
+	emit_rbx_op(0x3B, X86_EAX, REG_DISP(insn->rs2));	/* cmp eax, rs2 */
+	emit8(0xB9);	/* mov ecx, not taken */
+	emit32(pc + 4);
+	emit8(0xBA);	/* mov edx, taken */
+	emit32(pc + insn->imm);
+	emit8(0x0F);	/* cmov<cc> ecx, edx */
+	emit8(cmov);
+	emit8(0xCA);
+	emit_rbx_op(0x89, X86_ECX, PC_DISP);
+	emit8(0xB8);	/* mov eax, retired */
+	emit32(retired);
+	emit8(0x5B);	/* pop rbx */
+	emit8(0xC3);	/* ret */
+}
+
+/***************************************************************/
+/* Is the translator usable on this host?                                                       */
+/***************************************************************/
+int jit_available()
+{
+	return !JIT_BROKEN;
+}
+
+/***************************************************************/
+/* Forget every translated block; the caller drops the blocks too           */
+/***************************************************************/
+void jit_reset(sim_t *sim)
+{
+	sim->JIT_USED = 0;
+}
+
+/***************************************************************/
+/* Unmap the code buffer of a simulation that is going away                     */
+/***************************************************************/
+void jit_free(sim_t *sim)
+{
+	if (sim->JIT_CODE != NULL)
+	{
+		munmap(sim->JIT_CODE, JIT_CODE_SIZE);
+		sim->JIT_CODE = NULL;
+	}
+	sim->JIT_USED = 0;
+}
+
+/***************************************************************/
+/* Translate a block to host code. Returns NULL if the block starts with  */
+/* an instruction that has to be interpreted or the code buffer is full.   */
+/***************************************************************/
+jit_fn_t jit_compile(sim_t *sim, const block_t *block)
+{
+	uint32_t i;
+	uint32_t pc;
+	uint8_t *start;
+	const decoded_insn_t *insn;
+
+	if (sim->JIT_CODE == NULL && !JIT_BROKEN)
+	{
+		sim->JIT_CODE = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+						MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (sim->JIT_CODE == MAP_FAILED)
+		{
+			printf("Warning: can't map JIT code buffer, interpreting instead.\n");
+			sim->JIT_CODE = NULL;
+			JIT_BROKEN = TRUE;
+		}
+	}
+	if (sim->JIT_CODE == NULL)
+	{
+		return NULL;
+	}
+	if (sim->JIT_USED + block->len * JIT_MAX_INSN_BYTES + JIT_FRAME_BYTES > JIT_CODE_SIZE)
+	{
+		/* full: flush everything at the next block boundary and start over */
+		sim->BLOCK_FLUSH_PENDING = TRUE;
+		return NULL;
+	}
+
+	start = sim->JIT_CODE + sim->JIT_USED;
+	EMIT = start;
+	emit8(0x53);	/* push rbx */
+	emit8(0x48);	/* mov rbx, rdi (sim) */
+	emit8(0x89);
+	emit8(0xFB);
+
+	for (i = 0; i < block->len; i++)
+	{
+		insn = &block->insns[i];
+		pc = block->start_pc + 4 * i;
+		switch (insn->op)
+		{
+		case OP_nop:
+			break;
+		case OP_add:
+			emit_alu_reg(0x03, insn);
+			break;
+		case OP_sub:
+			emit_alu_reg(0x2B, insn);
+			break;
+		case OP_or:
+			emit_alu_reg(0x0B, insn);
+			break;
+		case OP_and:
+			emit_alu_reg(0x23, insn);
+			break;
+		case OP_xor:
+			emit_alu_reg(0x33, insn);
+			break;
+		case OP_sll:
+			emit_shift_reg(0xE0, insn);	/* shl eax, cl */
+			break;
+		case OP_srl:
+			emit_shift_reg(0xE8, insn);	/* shr eax, cl */
+			break;
+		case OP_sra:
+			emit_shift_reg(0xF8, insn);	/* sar eax, cl */
+			break;
+		case OP_slt:
+			emit_set_less(0x9C, FALSE, insn);	/* setl */
+			break;
+		case OP_sltu:
+			emit_set_less(0x92, FALSE, insn);	/* setb */
+			break;
+		case OP_slti:
+			emit_set_less(0x9C, TRUE, insn);
+			break;
+		case OP_sltiu:
+			emit_set_less(0x92, TRUE, insn);
+			break;
+		case OP_addi:
+			emit_alu_imm(0x05, insn);
+			break;
+		case OP_xori:
+			emit_alu_imm(0x35, insn);
+			break;
+		case OP_ori:
+			emit_alu_imm(0x0D, insn);
+			break;
+		case OP_andi:
+			emit_alu_imm(0x25, insn);
+			break;
+		case OP_slli:
+			emit_shift_imm(0xE0, insn);	/* shl eax, imm8 */
+			break;
+		case OP_srli:
+			emit_shift_imm(0xE8, insn);	/* shr eax, imm8 */
+			break;
+		case OP_srai:
+			emit_shift_imm(0xF8, insn);	/* sar eax, imm8 */
+			break;
+		case OP_lui:
+			emit_store_imm(REG_DISP(insn->rd), insn->imm);
+			break;
+		case OP_auipc:
+			emit_store_imm(REG_DISP(insn->rd), pc + insn->imm);
+			break;
+		case OP_lb:
+			emit_load(mem_read_8, 0xBE, insn);	/* movsx eax, al */
+			break;
+		case OP_lbu:
+			emit_load(mem_read_8, 0xB6, insn);	/* movzx eax, al */
+			break;
+		case OP_lh:
+			emit_load(mem_read_16, 0xBF, insn);	/* movsx eax, ax */
+			break;
+		case OP_lhu:
+			emit_load(mem_read_16, 0xB7, insn);	/* movzx eax, ax */
+			break;
+		case OP_lw:
+			emit_load(mem_read_32, 0, insn);
+			break;
+		case OP_sb:
+			emit_store(mem_write_8, insn, pc, i + 1);
+			break;
+		case OP_sh:
+			emit_store(mem_write_16, insn, pc, i + 1);
+			break;
+		case OP_sw:
+			emit_store(mem_write_32, insn, pc, i + 1);
+			break;
+		case OP_beq:
+			emit_branch(0x44, insn, pc, i + 1);	/* cmove */
+			break;
+		case OP_bne:
+			emit_branch(0x45, insn, pc, i + 1);	/* cmovne */
+			break;
+		case OP_blt:
+			emit_branch(0x4C, insn, pc, i + 1);	/* cmovl */
+			break;
+		case OP_bge:
+			emit_branch(0x4D, insn, pc, i + 1);	/* cmovge */
+			break;
+		case OP_bltu:
+			emit_branch(0x42, insn, pc, i + 1);	/* cmovb */
+			break;
+		case OP_bgeu:
+			emit_branch(0x43, insn, pc, i + 1);	/* cmovae */
+			break;
+		case OP_jal:
+			emit_store_imm(REG_DISP(insn->rd), pc + 4);
+			emit_exit(pc + insn->imm, i + 1);
+			break;
+		case OP_jalr:
+			emit_load_reg(X86_EAX, insn->rs1);
+			emit8(0x05);	/* add eax, imm32 */
+			emit32(insn->imm);
+			emit8(0x83);	/* and eax, ~1 */
+			emit8(0xE0);
+			emit8(0xFE);
+			emit_store_imm(REG_DISP(insn->rd), pc + 4);
+			emit_rbx_op(0x89, X86_EAX, PC_DISP);
+			emit8(0xB8);	/* mov eax, retired */
+			emit32(i + 1);
+			emit8(0x5B);	/* pop rbx */
+			emit8(0xC3);	/* ret */
+			break;
+		default:
+			/* unimplemented, invalid...: hand this one to the interpreter */
+			if (i == 0)
+			{
+				return NULL;
+			}
+			emit_exit(pc, i);
+			sim->JIT_USED += EMIT - start;
+			return (jit_fn_t)start;
+		}
+	}
+
+	/* ran off the end of a block that was split for length or a page boundary */
+	if (!op_ends_block(block->insns[block->len - 1].op))
+	{
+		emit_exit(block->start_pc + 4 * block->len, block->len);
+	}
+	sim->JIT_USED += EMIT - start;
+	return (jit_fn_t)start;
+}
+
+#else
+
+int jit_available()
+{
+	return FALSE;
+}
+
+void jit_reset(sim_t *sim)
+{
+}
+
+void jit_free(sim_t *sim)
+{
+}
+
+jit_fn_t jit_compile(sim_t *sim, const block_t *block)
+{
+	return NULL;
+}
+
+#endif
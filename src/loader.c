@@ -0,0 +1,907 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "mu-riscv.h"
+
+#ifndef EM_RISCV
+#define EM_RISCV 243
+#endif
+
+static program_image_t *IMAGE_CACHE;	/* every image, most recently loaded first */
+static pthread_mutex_t IMAGE_LOCK = PTHREAD_MUTEX_INITIALIZER;	/* guards the list and users */
+
+/***************************************************************/
+/* Does this page live inside one of the mappings of the program file?     */
+/***************************************************************/
+int image_owns_page(sim_t *sim, const uint8_t *page)
+{
+	return sim->PROGRAM_IMAGE != NULL &&
+		((page >= sim->PROGRAM_IMAGE && page < sim->PROGRAM_IMAGE + sim->PROGRAM_IMAGE_SIZE) ||
+		 (page >= sim->PROGRAM_PRISTINE && page < sim->PROGRAM_PRISTINE + sim->PROGRAM_IMAGE_SIZE));
+}
+
+/***************************************************************/
+/* Untouched file contents behind a page mapped from the file, or NULL   */
+/***************************************************************/
+const uint8_t *image_pristine_page(sim_t *sim, const uint8_t *page)
+{
+	if (sim->PROGRAM_IMAGE == NULL || page < sim->PROGRAM_IMAGE || page >= sim->PROGRAM_IMAGE + sim->PROGRAM_IMAGE_SIZE)
+	{
+		return NULL;
+	}
+	return sim->PROGRAM_PRISTINE + (page - sim->PROGRAM_IMAGE);
+}
+
+/***************************************************************/
+/* Drop the mapped program file and its symbols. Guest pages that pointed   */
+/* into the file must already be gone.                                                    */
+/***************************************************************/
+void image_unload(sim_t *sim)
+{
+	uint32_t i;
+
+	if (sim->IMAGE != NULL)
+	{
+		/* only the private mapping is ours; the rest belongs to the image */
+		if (sim->PROGRAM_IMAGE != NULL)
+		{
+			munmap(sim->PROGRAM_IMAGE, sim->PROGRAM_IMAGE_SIZE);
+		}
+		image_release(sim->IMAGE);
+		sim->IMAGE = NULL;
+		sim->PROGRAM_IMAGE = NULL;
+		sim->PROGRAM_PRISTINE = NULL;
+		sim->PROGRAM_IMAGE_SIZE = 0;
+		sim->SYMBOLS = NULL;
+		sim->NUM_SYMBOLS = 0;
+		return;
+	}
+	if (sim->PROGRAM_IMAGE != NULL)
+	{
+		munmap(sim->PROGRAM_IMAGE, sim->PROGRAM_IMAGE_SIZE);
+		munmap((void *)sim->PROGRAM_PRISTINE, sim->PROGRAM_IMAGE_SIZE);
+		sim->PROGRAM_IMAGE = NULL;
+		sim->PROGRAM_PRISTINE = NULL;
+		sim->PROGRAM_IMAGE_SIZE = 0;
+	}
+	for (i = 0; i < sim->NUM_SYMBOLS; i++)
+	{
+		free(sim->SYMBOLS[i].name);
+	}
+	free(sim->SYMBOLS);
+	sim->SYMBOLS = NULL;
+	sim->NUM_SYMBOLS = 0;
+}
+
+/***************************************************************/
+/* Record why a load failed in LOAD_ERROR; returns FALSE for the loader    */
+/* to pass on. A bad program file fails its load, not the whole process.   */
+/***************************************************************/
+static int load_fail(sim_t *sim, const char *format, ...)
+{
+	va_list args;
+
+	va_start(args, format);
+	vsnprintf(sim->LOAD_ERROR, sizeof(sim->LOAD_ERROR), format, args);
+	va_end(args);
+	return FALSE;
+}
+
+static int elf_fail(sim_t *sim, const char *path, const char *why)
+{
+	return load_fail(sim, "%s is not a loadable RV32 ELF program (%s)", path, why);
+}
+
+/***************************************************************/
+/* Map the program file private into PROGRAM_IMAGE                              */
+/***************************************************************/
+static int image_map_file(sim_t *sim, const char *path)
+{
+	struct stat st;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0)
+	{
+		if (fd >= 0)
+		{
+			close(fd);
+		}
+		return load_fail(sim, "Can't open program file %s", path);
+	}
+	if (st.st_size == 0)
+	{
+		close(fd);
+		return load_fail(sim, "Program file %s is empty", path);
+	}
+	sim->PROGRAM_IMAGE_SIZE = st.st_size;
+	sim->PROGRAM_IMAGE = mmap(NULL, sim->PROGRAM_IMAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	sim->PROGRAM_PRISTINE = mmap(NULL, sim->PROGRAM_IMAGE_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (sim->PROGRAM_IMAGE == MAP_FAILED || sim->PROGRAM_PRISTINE == MAP_FAILED)
+	{
+		if (sim->PROGRAM_IMAGE != MAP_FAILED)
+		{
+			munmap(sim->PROGRAM_IMAGE, sim->PROGRAM_IMAGE_SIZE);
+		}
+		if (sim->PROGRAM_PRISTINE != MAP_FAILED)
+		{
+			munmap((void *)sim->PROGRAM_PRISTINE, sim->PROGRAM_IMAGE_SIZE);
+		}
+		sim->PROGRAM_IMAGE = NULL;
+		sim->PROGRAM_PRISTINE = NULL;
+		sim->PROGRAM_IMAGE_SIZE = 0;
+		return load_fail(sim, "Can't map program file %s", path);
+	}
+	return TRUE;
+}
+
+/***************************************************************/
+/* Copy a segment of the mapped file into guest memory. Pages the file    */
+/* covers completely, at a page-aligned offset, are used in place: the     */
+/* mapping is private, so the host copies a page only when the guest       */
+/* writes it. Bytes past filesz up to memsz are zeroed.                        */
+/***************************************************************/
+static void image_map_segment(sim_t *sim, uint32_t vaddr, uint32_t offset, uint32_t filesz, uint32_t memsz)
+{
+	uint32_t first = vaddr & ~PAGE_OFFSET_MASK;
+	uint32_t pages = (vaddr - first + memsz + PAGE_OFFSET_MASK) >> PAGE_SHIFT;
+	uint64_t file_end = (uint64_t)vaddr + filesz;
+	uint64_t mem_end = (uint64_t)vaddr + memsz;
+	uint64_t page_base, lo, hi, copy_hi;
+	uint8_t *page;
+	uint32_t i;
+
+	for (i = 0; i < pages; i++)
+	{
+		page_base = (uint64_t)first + ((uint64_t)i << PAGE_SHIFT);
+		lo = (page_base > vaddr) ? page_base : vaddr;
+		hi = (page_base + PAGE_SIZE < mem_end) ? page_base + PAGE_SIZE : mem_end;
+		copy_hi = (hi < file_end) ? hi : file_end;
+
+		if (lo == page_base && copy_hi == page_base + PAGE_SIZE &&
+			((offset - vaddr) & PAGE_OFFSET_MASK) == 0 &&
+			mem_page_read(sim, page_base) == ZERO_PAGE)
+		{
+			mem_page_map(sim, page_base, sim->PROGRAM_IMAGE + offset + (page_base - vaddr));
+			continue;
+		}
+
+		page = mem_page_read(sim, page_base);
+		if (page == ZERO_PAGE)
+		{
+			page = mem_page_map(sim, page_base, NULL);
+		}
+		if (copy_hi > lo)
+		{
+			memcpy(page + (lo - page_base), sim->PROGRAM_IMAGE + offset + (lo - vaddr), copy_hi - lo);
+		}
+		else
+		{
+			copy_hi = lo;
+		}
+		/* .bss; the page may have come from an earlier segment */
+		memset(page + (copy_hi - page_base), 0, hi - copy_hi);
+	}
+}
+
+static int symbol_compare(const void *a, const void *b)
+{
+	const symbol_t *x = a, *y = b;
+	return (x->address > y->address) - (x->address < y->address);
+}
+
+/***************************************************************/
+/* Keep the function, object and label symbols of .symtab, by address    */
+/***************************************************************/
+static void elf_read_symbols(sim_t *sim, const Elf32_Ehdr *eh)
+{
+	const Elf32_Shdr *sections, *symtab, *strtab;
+	const Elf32_Sym *sym;
+	const char *name;
+	uint32_t i, count;
+	int type;
+
+	if (eh->e_shoff == 0 || eh->e_shentsize != sizeof(Elf32_Shdr) ||
+		(uint64_t)eh->e_shoff + (uint64_t)eh->e_shnum * sizeof(Elf32_Shdr) > sim->PROGRAM_IMAGE_SIZE)
+	{
+		return;
+	}
+	sections = (const Elf32_Shdr *)(sim->PROGRAM_IMAGE + eh->e_shoff);
+	for (i = 0; i < eh->e_shnum; i++)
+	{
+		if (sections[i].sh_type == SHT_SYMTAB)
+		{
+			break;
+		}
+	}
+	if (i == eh->e_shnum || sections[i].sh_link >= eh->e_shnum)
+	{
+		return;
+	}
+	symtab = &sections[i];
+	strtab = &sections[symtab->sh_link];
+	if ((uint64_t)symtab->sh_offset + symtab->sh_size > sim->PROGRAM_IMAGE_SIZE ||
+		(uint64_t)strtab->sh_offset + strtab->sh_size > sim->PROGRAM_IMAGE_SIZE || strtab->sh_size == 0)
+	{
+		return;
+	}
+
+	count = symtab->sh_size / sizeof(Elf32_Sym);
+	sim->SYMBOLS = calloc(count ? count : 1, sizeof(symbol_t));
+	if (sim->SYMBOLS == NULL)
+	{
+		printf("Error: Out of memory reading symbols\n");
+		exit(-1);
+	}
+	for (i = 0; i < count; i++)
+	{
+		sym = (const Elf32_Sym *)(sim->PROGRAM_IMAGE + symtab->sh_offset) + i;
+		type = ELF32_ST_TYPE(sym->st_info);
+		if ((type != STT_NOTYPE && type != STT_FUNC && type != STT_OBJECT) ||
+			sym->st_shndx == SHN_UNDEF || sym->st_name >= strtab->sh_size)
+		{
+			continue;
+		}
+		name = (const char *)sim->PROGRAM_IMAGE + strtab->sh_offset + sym->st_name;
+		/* skip assembler-local labels */
+		if (name[0] == '\0' || strncmp(name, ".L", 2) == 0 ||
+			memchr(name, '\0', strtab->sh_size - sym->st_name) == NULL)
+		{
+			continue;
+		}
+		sim->SYMBOLS[sim->NUM_SYMBOLS].address = sym->st_value;
+		sim->SYMBOLS[sim->NUM_SYMBOLS].size = sym->st_size;
+		sim->SYMBOLS[sim->NUM_SYMBOLS].name = strdup(name);
+		sim->NUM_SYMBOLS++;
+	}
+	qsort(sim->SYMBOLS, sim->NUM_SYMBOLS, sizeof(symbol_t), symbol_compare);
+}
+
+/***************************************************************/
+/* Is the file an ELF object? One that can't be read is not; its loader    */
+/* reports why.                                                            */
+/***************************************************************/
+int is_elf_file(const char *path)
+{
+	unsigned char magic[SELFMAG];
+	FILE *fp = fopen(path, "rb");
+	int elf;
+
+	if (fp == NULL)
+	{
+		return FALSE;
+	}
+	elf = fread(magic, 1, SELFMAG, fp) == SELFMAG && memcmp(magic, ELFMAG, SELFMAG) == 0;
+	fclose(fp);
+	return elf;
+}
+
+/***************************************************************/
+/* Load an RV32 ELF executable: map its PT_LOAD segments, zero .bss, read */
+/* its symbols and start at its entry point.                                            */
+/***************************************************************/
+int load_elf(sim_t *sim, const char *path)
+{
+	const Elf32_Ehdr *eh;
+	const Elf32_Phdr *ph;
+	uint32_t i, text_lo = UINT32_MAX, text_hi = 0, gp;
+
+	if (!image_map_file(sim, path))
+	{
+		return FALSE;
+	}
+	if (sim->PROGRAM_IMAGE_SIZE < sizeof(Elf32_Ehdr))
+	{
+		return elf_fail(sim, path, "truncated header");
+	}
+	eh = (const Elf32_Ehdr *)sim->PROGRAM_IMAGE;
+	if (memcmp(eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != ELFCLASS32)
+	{
+		return elf_fail(sim, path, "not ELF32");
+	}
+	if (eh->e_ident[EI_DATA] != ELFDATA2LSB || eh->e_machine != EM_RISCV)
+	{
+		return elf_fail(sim, path, "not little-endian RISC-V");
+	}
+	if (eh->e_type != ET_EXEC)
+	{
+		return elf_fail(sim, path, "not an executable");
+	}
+	if (eh->e_phentsize != sizeof(Elf32_Phdr) ||
+		(uint64_t)eh->e_phoff + (uint64_t)eh->e_phnum * sizeof(Elf32_Phdr) > sim->PROGRAM_IMAGE_SIZE)
+	{
+		return elf_fail(sim, path, "bad program headers");
+	}
+
+	for (i = 0; i < eh->e_phnum; i++)
+	{
+		ph = (const Elf32_Phdr *)(sim->PROGRAM_IMAGE + eh->e_phoff) + i;
+		if (ph->p_type != PT_LOAD || ph->p_memsz == 0)
+		{
+			continue;
+		}
+		if ((uint64_t)ph->p_offset + ph->p_filesz > sim->PROGRAM_IMAGE_SIZE || ph->p_filesz > ph->p_memsz ||
+			(uint64_t)ph->p_vaddr + ph->p_memsz > (uint64_t)UINT32_MAX + 1)
+		{
+			return elf_fail(sim, path, "segment out of range");
+		}
+		image_map_segment(sim, ph->p_vaddr, ph->p_offset, ph->p_filesz, ph->p_memsz);
+		if (!sim->QUIET_LOAD)
+		{
+			printf("mapping segment 0x%08x-0x%08x (%d bytes from file)\n",
+				   ph->p_vaddr, ph->p_vaddr + ph->p_memsz - 1, ph->p_filesz);
+		}
+		if (ph->p_flags & PF_X)
+		{
+			text_lo = (ph->p_vaddr < text_lo) ? ph->p_vaddr : text_lo;
+			text_hi = (ph->p_vaddr + ph->p_filesz > text_hi) ? ph->p_vaddr + ph->p_filesz : text_hi;
+		}
+	}
+	if (text_lo >= text_hi)
+	{
+		return elf_fail(sim, path, "no executable segment");
+	}
+
+	sim->PROGRAM_BASE = text_lo;
+	sim->PROGRAM_SIZE = (text_hi - text_lo) / 4;
+	elf_read_symbols(sim, eh);
+	sim->CURRENT_STATE.PC = eh->e_entry;
+	if (symbol_address(sim, "__global_pointer$", &gp))
+	{
+		sim->CURRENT_STATE.REGS[3] = gp;
+	}
+	sim_log("Program loaded into memory.\nEntry point 0x%08x, %d symbols.\n\n", eh->e_entry, sim->NUM_SYMBOLS);
+	return TRUE;
+}
+
+/***************************************************************/
+/* Load a flat binary image at MEM_TEXT_BEGIN and start at its first word */
+/***************************************************************/
+int load_binary(sim_t *sim, const char *path)
+{
+	if (!image_map_file(sim, path))
+	{
+		return FALSE;
+	}
+	if ((uint64_t)MEM_TEXT_BEGIN + sim->PROGRAM_IMAGE_SIZE > MEM_TEXT_END + 1ULL)
+	{
+		return load_fail(sim, "%s does not fit in the text segment", path);
+	}
+	image_map_segment(sim, MEM_TEXT_BEGIN, 0, sim->PROGRAM_IMAGE_SIZE, sim->PROGRAM_IMAGE_SIZE);
+
+	sim->PROGRAM_BASE = MEM_TEXT_BEGIN;
+	sim->PROGRAM_SIZE = (sim->PROGRAM_IMAGE_SIZE + 3) / 4;
+	sim->CURRENT_STATE.PC = MEM_TEXT_BEGIN;
+	sim_log("Program loaded into memory.\n%d words written into memory.\n\n", sim->PROGRAM_SIZE);
+	return TRUE;
+}
+
+/***************************************************************/
+/* Parse a text file of hex words; returns them and their count, or NULL   */
+/* with LOAD_ERROR set                                                     */
+/***************************************************************/
+static uint32_t *hex_parse(sim_t *sim, const char *path, uint32_t *count)
+{
+	FILE *fp;
+	long size;
+	char *text, *p, *end;
+	uint32_t *words;
+
+	fp = fopen(path, "r");
+	if (fp == NULL)
+	{
+		load_fail(sim, "Can't open program file %s", path);
+		return NULL;
+	}
+	fseek(fp, 0, SEEK_END);
+	size = ftell(fp);
+	rewind(fp);
+	text = malloc(size + 1);
+	/* at most one word per two characters */
+	words = malloc((size / 2 + 1) * sizeof(uint32_t));
+	if (size < 0 || text == NULL || words == NULL || fread(text, 1, size, fp) != (size_t)size)
+	{
+		fclose(fp);
+		free(text);
+		free(words);
+		load_fail(sim, "Can't read program file %s", path);
+		return NULL;
+	}
+	text[size] = '\0';
+	fclose(fp);
+
+	*count = 0;
+	for (p = text; ; p = end)
+	{
+		while (isspace((unsigned char)*p))
+		{
+			p++;
+		}
+		if (*p == '\0')
+		{
+			break;
+		}
+		words[*count] = strtoul(p, &end, 16);
+		if (end == p)
+		{
+			load_fail(sim, "%s: bad hex word at offset %ld", path, (long)(p - text));
+			free(text);
+			free(words);
+			return NULL;
+		}
+		(*count)++;
+	}
+	free(text);
+	return words;
+}
+
+/***************************************************************/
+/* Load a text file of hex words at MEM_TEXT_BEGIN, one copy per page     */
+/***************************************************************/
+int load_hex(sim_t *sim, const char *path)
+{
+	uint32_t i, address, chunk, count;
+	uint32_t bytes;
+	uint32_t *words;
+	uint8_t *page;
+
+	words = hex_parse(sim, path, &count);
+	if (words == NULL)
+	{
+		return FALSE;
+	}
+	bytes = count * 4;
+	if ((uint64_t)MEM_TEXT_BEGIN + bytes > MEM_TEXT_END + 1ULL)
+	{
+		free(words);
+		return load_fail(sim, "%s does not fit in the text segment", path);
+	}
+
+	for (i = 0; i < bytes; i += chunk)
+	{
+		address = MEM_TEXT_BEGIN + i;
+		chunk = PAGE_SIZE - (address & PAGE_OFFSET_MASK);
+		chunk = (chunk < bytes - i) ? chunk : bytes - i;
+		page = mem_page_write(sim, address);
+		memcpy(page + (address & PAGE_OFFSET_MASK), (uint8_t *)words + i, chunk);
+	}
+	if (!sim->QUIET_LOAD)
+	{
+		for (i = 0; i < count; i++)
+		{
+			address = MEM_TEXT_BEGIN + 4 * i;
+			printf("writing 0x%08x into address 0x%08x (%d)\n", words[i], address, address);
+		}
+	}
+	free(words);
+
+	sim->PROGRAM_BASE = MEM_TEXT_BEGIN;
+	sim->PROGRAM_SIZE = count;
+	sim->CURRENT_STATE.PC = MEM_TEXT_BEGIN;
+	sim_log("Program loaded into memory.\n%d words written into memory.\n\n", sim->PROGRAM_SIZE);
+	return TRUE;
+}
+
+/***************************************************************/
+/* Free an image nobody uses any more                                                           */
+/***************************************************************/
+static void image_free(program_image_t *image)
+{
+	uint32_t i;
+
+	if (image->pristine != NULL)
+	{
+		munmap((void *)image->pristine, (size_t)image->num_pages * PAGE_SIZE);
+	}
+	if (image->decoded != NULL)
+	{
+		munmap(image->decoded, (size_t)image->num_decoded * DECODE_PAGE_ENTRIES * sizeof(decoded_insn_t));
+	}
+	if (image->fd >= 0)
+	{
+		close(image->fd);
+	}
+	if (image->file_fd >= 0)
+	{
+		close(image->file_fd);
+	}
+	for (i = 0; i < image->num_symbols; i++)
+	{
+		free(image->symbols[i].name);
+	}
+	free(image->symbols);
+	free(image->pages);
+	free(image->offsets);
+	free(image);
+}
+
+/***************************************************************/
+/* A simulation is done with its image. Keeps the IMAGE_CACHE_MAX most    */
+/* recently loaded unused images and frees older ones.                             */
+/***************************************************************/
+void image_release(program_image_t *image)
+{
+	program_image_t **link, *victim;
+	uint32_t unused = 0;
+
+	pthread_mutex_lock(&IMAGE_LOCK);
+	image->users--;
+	for (link = &IMAGE_CACHE; *link != NULL; )
+	{
+		if ((*link)->users == 0 && ++unused > IMAGE_CACHE_MAX)
+		{
+			victim = *link;
+			*link = victim->next;
+			image_free(victim);
+			continue;
+		}
+		link = &(*link)->next;
+	}
+	pthread_mutex_unlock(&IMAGE_LOCK);
+}
+
+/***************************************************************/
+/* Find the image loaded from this file and make it the most recent one.  */
+/* Called with IMAGE_LOCK held.                                                                  */
+/***************************************************************/
+static program_image_t *image_find(const struct stat *st, int raw)
+{
+	program_image_t **link, *image;
+
+	for (link = &IMAGE_CACHE; (image = *link) != NULL; link = &image->next)
+	{
+		if (image->dev == st->st_dev && image->ino == st->st_ino && image->size == (uint64_t)st->st_size &&
+			image->mtime == (uint64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec && image->raw == raw)
+		{
+			*link = image->next;
+			image->next = IMAGE_CACHE;
+			IMAGE_CACHE = image;
+			return image;
+		}
+	}
+	return NULL;
+}
+
+/***************************************************************/
+/* Map the pages of an image back to back with prot, each run of them from */
+/* the same file in one go. Returns MAP_FAILED if it can't.                        */
+/***************************************************************/
+static uint8_t *image_map(const program_image_t *image, int prot)
+{
+	size_t size = (size_t)image->num_pages * PAGE_SIZE;
+	uint8_t *base = mmap(NULL, size, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	uint64_t from;
+	uint32_t i, run;
+
+	if (base == MAP_FAILED)
+	{
+		return MAP_FAILED;
+	}
+	for (i = 0; i < image->num_pages; i += run)
+	{
+		from = image->offsets[i];
+		for (run = 1; i + run < image->num_pages && image->offsets[i + run] == from + (uint64_t)run * PAGE_SIZE; run++)
+		{
+		}
+		if (mmap(base + (size_t)i * PAGE_SIZE, (size_t)run * PAGE_SIZE, prot, MAP_PRIVATE | MAP_FIXED,
+				 (from & IMAGE_FROM_FILE) ? image->file_fd : image->fd, (off_t)(from & ~IMAGE_FROM_FILE)) == MAP_FAILED)
+		{
+			munmap(base, size);
+			return MAP_FAILED;
+		}
+	}
+	return base;
+}
+
+/***************************************************************/
+/* Make an image of what the loader just put in sim: its non-zero pages,   */
+/* those it copied in a sealed memfd and those it used in place left in   */
+/* the program file, its words decoded, its CPU state and symbols.          */
+/***************************************************************/
+static program_image_t *image_build(sim_t *sim, const struct stat *st)
+{
+	program_image_t *image = calloc(1, sizeof(program_image_t));
+	uint32_t capacity = 0, copied = 0;
+	uint32_t i, j, first, last, end, word;
+	uint8_t *page;
+	const uint8_t *pristine;
+	decoded_insn_t *decoded;
+	struct stat file_st;
+
+	if (image == NULL)
+	{
+		printf("Error: Out of memory building the program image\n");
+		exit(-1);
+	}
+	image->file_fd = -1;
+	if (sim->PROGRAM_IMAGE != NULL)
+	{
+		/* only if it is still the file the loader mapped */
+		image->file_fd = open(sim->prog_file, O_RDONLY | O_CLOEXEC);
+		if (image->file_fd >= 0 && (fstat(image->file_fd, &file_st) < 0 || file_st.st_dev != st->st_dev ||
+									 file_st.st_ino != st->st_ino || file_st.st_mtim.tv_sec != st->st_mtim.tv_sec ||
+									 file_st.st_mtim.tv_nsec != st->st_mtim.tv_nsec))
+		{
+			close(image->file_fd);
+			image->file_fd = -1;
+		}
+	}
+	image->dev = st->st_dev;
+	image->ino = st->st_ino;
+	image->size = st->st_size;
+	image->mtime = (uint64_t)st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+	image->raw = sim->RAW_BINARY;
+
+	/* the non-zero pages, in address order */
+	image->fd = memfd_create("mu-riscv-image", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (image->fd < 0)
+	{
+		printf("Error: Can't create the program image of %s\n", sim->prog_file);
+		exit(-1);
+	}
+	for (i = 0; i < PAGE_DIR_ENTRIES; i++)
+	{
+		for (j = 0; sim->PAGE_DIR[i] != NULL && j < PAGE_TABLE_ENTRIES; j++)
+		{
+			page = sim->PAGE_DIR[i][j];
+			if (page == NULL || (page[0] == 0 && memcmp(page, page + 1, PAGE_SIZE - 1) == 0))
+			{
+				continue;
+			}
+			if (image->num_pages == capacity)
+			{
+				capacity = capacity ? 2 * capacity : 64;
+				image->pages = realloc(image->pages, capacity * sizeof(uint32_t));
+				image->offsets = realloc(image->offsets, capacity * sizeof(uint64_t));
+				if (image->pages == NULL || image->offsets == NULL)
+				{
+					printf("Error: Out of memory building the program image\n");
+					exit(-1);
+				}
+			}
+			pristine = image_pristine_page(sim, page);
+			if (pristine != NULL && image->file_fd >= 0)
+			{
+				/* a page of the file, used in place: keep it that way */
+				image->offsets[image->num_pages] = IMAGE_FROM_FILE | (uint64_t)(pristine - sim->PROGRAM_PRISTINE);
+			}
+			else
+			{
+				if (pwrite(image->fd, page, PAGE_SIZE, (off_t)copied * PAGE_SIZE) != PAGE_SIZE)
+				{
+					printf("Error: Can't write the program image of %s\n", sim->prog_file);
+					exit(-1);
+				}
+				image->offsets[image->num_pages] = (uint64_t)copied++ * PAGE_SIZE;
+			}
+			image->pages[image->num_pages++] = (i << PAGE_TABLE_BITS) | j;
+		}
+	}
+	/* nobody may change it once simulations map it */
+	fcntl(image->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE);
+	if (image->num_pages > 0)
+	{
+		image->pristine = image_map(image, PROT_READ);
+		if (image->pristine == MAP_FAILED)
+		{
+			printf("Error: Can't map the program image of %s\n", sim->prog_file);
+			exit(-1);
+		}
+	}
+
+	/* the program's words, decoded; anything else on their pages stays undecoded */
+	if (sim->PROGRAM_SIZE > 0)
+	{
+		image->decoded_first = sim->PROGRAM_BASE >> PAGE_SHIFT;
+		last = (sim->PROGRAM_BASE + 4 * (sim->PROGRAM_SIZE - 1)) >> PAGE_SHIFT;
+		first = sim->PROGRAM_BASE >> 2;
+		end = first + sim->PROGRAM_SIZE;
+		image->num_decoded = last - image->decoded_first + 1;
+		image->decoded = mmap(NULL, (size_t)image->num_decoded * DECODE_PAGE_ENTRIES * sizeof(decoded_insn_t),
+							  PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (image->decoded == MAP_FAILED)
+		{
+			printf("Error: Out of memory decoding %s\n", sim->prog_file);
+			exit(-1);
+		}
+		for (i = 0; i < image->num_decoded; i++)
+		{
+			decoded = image->decoded + (size_t)i * DECODE_PAGE_ENTRIES;
+			for (j = 0; j < DECODE_PAGE_ENTRIES; j++)
+			{
+				word = ((image->decoded_first + i) << (PAGE_SHIFT - 2)) + j;
+				if (word >= first && word < end)
+				{
+					decode_instruction(mem_read_32(sim, ((image->decoded_first + i) << PAGE_SHIFT) + 4 * j), &decoded[j]);
+				}
+			}
+		}
+		mprotect(image->decoded, (size_t)image->num_decoded * DECODE_PAGE_ENTRIES * sizeof(decoded_insn_t), PROT_READ);
+	}
+
+	image->state = sim->CURRENT_STATE;
+	image->program_base = sim->PROGRAM_BASE;
+	image->program_size = sim->PROGRAM_SIZE;
+	image->symbols = sim->SYMBOLS;
+	image->num_symbols = sim->NUM_SYMBOLS;
+	sim->SYMBOLS = NULL;
+	sim->NUM_SYMBOLS = 0;
+	return image;
+}
+
+/***************************************************************/
+/* Load an image into sim: its pages become guest pages through private    */
+/* mappings, its decoded pages are shared as they are.                          */
+/***************************************************************/
+static void image_attach(sim_t *sim, program_image_t *image)
+{
+	uint32_t i;
+
+	sim->IMAGE = image;
+	if (image->num_pages > 0)
+	{
+		sim->PROGRAM_IMAGE_SIZE = (size_t)image->num_pages * PAGE_SIZE;
+		sim->PROGRAM_IMAGE = image_map(image, PROT_READ | PROT_WRITE);
+		if (sim->PROGRAM_IMAGE == MAP_FAILED)
+		{
+			sim->PROGRAM_IMAGE = NULL;
+			printf("Error: Can't map the program image of %s\n", sim->prog_file);
+			exit(-1);
+		}
+		sim->PROGRAM_PRISTINE = image->pristine;
+		for (i = 0; i < image->num_pages; i++)
+		{
+			mem_page_map(sim, image->pages[i] << PAGE_SHIFT, sim->PROGRAM_IMAGE + (size_t)i * PAGE_SIZE);
+		}
+	}
+	sim->CURRENT_STATE = image->state;
+	sim->PROGRAM_BASE = image->program_base;
+	sim->PROGRAM_SIZE = image->program_size;
+	sim->SYMBOLS = image->symbols;
+	sim->NUM_SYMBOLS = image->num_symbols;
+	decode_share_image(sim);
+}
+
+/***************************************************************/
+/* Load prog_file through the image cache: the first time a file is       */
+/* loaded in this process its loader runs and an image is made of what it */
+/* produced; every load, that one included, then maps the image. Returns  */
+/* FALSE, with LOAD_ERROR set and nothing loaded, if the file is unusable. */
+/***************************************************************/
+int image_load(sim_t *sim)
+{
+	program_image_t *image, *built;
+	struct stat st;
+	int loaded;
+
+	if (stat(sim->prog_file, &st) < 0)
+	{
+		return load_fail(sim, "Can't open program file %s", sim->prog_file);
+	}
+	if (!S_ISREG(st.st_mode))
+	{
+		return load_fail(sim, "Program file %s is not a regular file", sim->prog_file);
+	}
+	pthread_mutex_lock(&IMAGE_LOCK);
+	image = image_find(&st, sim->RAW_BINARY);
+	if (image != NULL)
+	{
+		image->users++;
+	}
+	pthread_mutex_unlock(&IMAGE_LOCK);
+	if (image != NULL)
+	{
+		image_attach(sim, image);
+		sim_log("Program loaded into memory.\n%d pages shared with earlier loads.\n\n", image->num_pages);
+		return TRUE;
+	}
+
+	if (sim->RAW_BINARY)
+	{
+		loaded = load_binary(sim, sim->prog_file);
+	}
+	else if (is_elf_file(sim->prog_file))
+	{
+		loaded = load_elf(sim, sim->prog_file);
+	}
+	else
+	{
+		loaded = load_hex(sim, sim->prog_file);
+	}
+	if (!loaded)
+	{
+		/* drop whatever the loader got to before it gave up */
+		mem_discard_pages(sim);
+		image_unload(sim);
+		return FALSE;
+	}
+	built = image_build(sim, &st);
+	mem_discard_pages(sim);
+	image_unload(sim);
+
+	/* another thread may have loaded the same file meanwhile */
+	pthread_mutex_lock(&IMAGE_LOCK);
+	image = image_find(&st, sim->RAW_BINARY);
+	if (image == NULL)
+	{
+		image = built;
+		image->next = IMAGE_CACHE;
+		IMAGE_CACHE = image;
+		built = NULL;
+	}
+	image->users++;
+	pthread_mutex_unlock(&IMAGE_LOCK);
+	if (built != NULL)
+	{
+		image_free(built);
+	}
+	image_attach(sim, image);
+	return TRUE;
+}
+
+/***************************************************************/
+/* The symbol covering address (the closest one at or below it), or NULL   */
+/***************************************************************/
+const symbol_t *symbol_lookup(sim_t *sim, uint32_t address)
+{
+	uint32_t lo = 0, hi = sim->NUM_SYMBOLS, mid;
+	const symbol_t *sym;
+
+	while (lo < hi)
+	{
+		mid = (lo + hi) / 2;
+		if (sim->SYMBOLS[mid].address <= address)
+		{
+			lo = mid + 1;
+		}
+		else
+		{
+			hi = mid;
+		}
+	}
+	if (lo == 0)
+	{
+		return NULL;
+	}
+	/* first of several symbols at the same address */
+	sym = &sim->SYMBOLS[lo - 1];
+	while (sym > sim->SYMBOLS && sym[-1].address == sym->address)
+	{
+		sym--;
+	}
+	if (sym->size != 0 && address - sym->address >= sym->size)
+	{
+		return NULL;
+	}
+	return sym;
+}
+
+/***************************************************************/
+/* Look a symbol up by name; returns TRUE and its address if found           */
+/***************************************************************/
+int symbol_address(sim_t *sim, const char *name, uint32_t *address)
+{
+	uint32_t i;
+
+	for (i = 0; i < sim->NUM_SYMBOLS; i++)
+	{
+		if (strcmp(sim->SYMBOLS[i].name, name) == 0)
+		{
+			*address = sim->SYMBOLS[i].address;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
@@ -0,0 +1,118 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "mu-riscv.h"
+
+/***************************************************************/
+/* main                                                                                                                                   */
+/***************************************************************/
+int main(int argc, char *argv[])
+{
+	sim_t *sim = sim_create();
+	int opt, usage = FALSE;
+	char *script = NULL, *end;
+	uint64_t limit = UINT64_MAX;
+	FILE *results = stdout;
+
+	while ((opt = getopt(argc, argv, "qbn:s:o:H:L:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'q':
+			sim->QUIET_LOAD = TRUE;
+			break;
+		case 'b':
+			sim->RAW_BINARY = TRUE;
+			break;
+		case 'n':
+			limit = strtoull(optarg, &end, 0);
+			usage |= (*optarg == '\0' || *end != '\0');
+			BATCH_MODE = TRUE;
+			break;
+		case 's':
+			script = optarg;
+			BATCH_MODE = TRUE;
+			break;
+		case 'H':
+			sim->NUM_HARTS = strtoul(optarg, &end, 0);
+			usage |= (*end != '\0' || sim->NUM_HARTS < 1 || sim->NUM_HARTS > MAX_HARTS);
+			break;
+		case 'L':
+			sim->LOCKSTEP = strtoul(optarg, &end, 0);
+			usage |= (*end != '\0' || sim->LOCKSTEP < 1);
+			break;
+		case 'o':
+			results = fopen(optarg, "w");
+			if (results == NULL)
+			{
+				printf("Error: Can't create results file %s\n", optarg);
+				exit(1);
+			}
+			BATCH_MODE = TRUE;
+			break;
+		default:
+			usage = TRUE;
+			break;
+		}
+	}
+	if (usage || optind == argc || (!BATCH_MODE && optind != argc - 1))
+	{
+		printf((optind == argc) ? "Error: You should provide input file.\n" : "Error: Bad arguments.\n");
+		printf("Usage: %s [-q] [-b] [-H <harts>] [-L <instructions>] <input program>\n", argv[0]);
+		printf("       %s [-b] [-H <harts>] [-L <instructions>] [-n <instructions>] [-s <script>] [-o <results>] <program>...\n", argv[0]);
+		printf("  -q  load quietly, without logging every word\n");
+		printf("  -b  the program is a raw binary image for the text segment\n");
+		printf("  -H  run the program on this many harts, up to %d, each on its own thread\n", MAX_HARTS);
+		printf("  -L  lockstep: run the harts in turn on one thread, this many instructions each\n");
+		printf("  -n  batch mode: stop each program after this many instructions\n");
+		printf("  -s  batch mode: run the commands in this file before simulating\n");
+		printf("  -o  batch mode: write results here instead of standard output\n");
+		printf("Batch mode prints no banners and writes one JSON line per program,\n");
+		printf("with the program's own output in its \"output\" field.\n\n");
+		exit(1);
+	}
+
+	if (BATCH_MODE)
+	{
+		sim->QUIET_LOAD = TRUE;
+		/* the program's output goes in the results, not between them */
+		sim->CAPTURE_OUTPUT = TRUE;
+		for (; optind < argc; optind++)
+		{
+			if (strlen(argv[optind]) >= sizeof(sim->prog_file))
+			{
+				printf("Error: Program file name too long.\n\n");
+				exit(1);
+			}
+			strcpy(sim->prog_file, argv[optind]);
+			batch_run(sim, script, limit, results);
+		}
+		fclose(results);
+		sim_destroy(sim);
+		return 0;
+	}
+
+	printf("\n**************************\n");
+	printf("Welcome to MU-RISCV SIM...\n");
+	printf("**************************\n\n");
+	if (strlen(argv[optind]) >= sizeof(sim->prog_file))
+	{
+		printf("Error: Program file name too long.\n\n");
+		exit(1);
+	}
+	strcpy(sim->prog_file, argv[optind]);
+	if (!load_program(sim))
+	{
+		printf("Error: %s\n", sim->LOAD_ERROR);
+		exit(-1);
+	}
+	help();
+	while (1)
+	{
+		handle_command(sim);
+	}
+	return 0;
+}
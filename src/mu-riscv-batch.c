@@ -0,0 +1,297 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mu-riscv.h"
+
+/***************************************************************/
+/* Parallel batch runner                                                                                  */
+/*                                                                                                                          */
+/* Every worker thread owns one sim_t for the whole run, so its page pool, */
+/* JIT buffer and tables are reused from one program to the next. Jobs    */
+/* are dealt out in contiguous runs, one deque per worker. A worker takes */
+/* jobs from the bottom of its own deque and, once that is empty, steals */
+/* from the top of the others'. No job is ever added after the start, so   */
+/* a worker that finds every deque empty is done.                                  */
+/***************************************************************/
+
+typedef struct {
+	int id;
+	sim_t *sim;
+	uint64_t instructions;	/* retired by this worker's jobs */
+	uint32_t jobs, stolen;
+} worker_t;
+
+static char **PROGRAMS;	/* job i runs PROGRAMS[i] */
+static int NUM_PROGRAMS;
+static char **RESULTS;	/* JSON object of job i */
+static job_deque_t *DEQUES;
+static worker_t *WORKERS;
+static int NUM_WORKERS;
+
+static const char *SCRIPT;
+static uint64_t LIMIT = UINT64_MAX;
+static int RAW;
+static int ENGINE_CHOICE = ENGINE_THREADED;
+
+/***************************************************************/
+/* Run one program on the worker's simulation and keep its JSON result    */
+/***************************************************************/
+static void run_job(worker_t *worker, int64_t job)
+{
+	FILE *out;
+	size_t size;
+
+	snprintf(worker->sim->prog_file, sizeof(worker->sim->prog_file), "%s", PROGRAMS[job]);
+	out = open_memstream(&RESULTS[job], &size);
+	if (out == NULL)
+	{
+		printf("Error: Out of memory collecting results\n");
+		exit(-1);
+	}
+	batch_run(worker->sim, SCRIPT, LIMIT, out);
+	fclose(out);
+	worker->instructions += worker->sim->INSTRUCTION_COUNT;
+	worker->jobs++;
+}
+
+static void *worker_main(void *arg)
+{
+	worker_t *worker = arg;
+	int64_t job;
+	int i, victim;
+
+	for (;;)
+	{
+		while ((job = deque_pop(&DEQUES[worker->id])) >= 0)
+		{
+			run_job(worker, job);
+		}
+
+		/* out of work: steal, trying the other workers in turn */
+		job = -1;
+		for (i = 1; i < NUM_WORKERS && job < 0; i++)
+		{
+			victim = (worker->id + i) % NUM_WORKERS;
+			job = deque_steal(&DEQUES[victim]);
+		}
+		if (job < 0)
+		{
+			return NULL;
+		}
+		worker->stolen++;
+		run_job(worker, job);
+	}
+}
+
+/***************************************************************/
+/* Add the programs listed in path, one per line                                      */
+/***************************************************************/
+static void read_program_list(const char *path)
+{
+	FILE *fp = (strcmp(path, "-") == 0) ? stdin : fopen(path, "r");
+	char line[4096];
+	size_t len;
+
+	if (fp == NULL)
+	{
+		printf("Error: Can't open program list %s\n", path);
+		exit(1);
+	}
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		len = strcspn(line, "\r\n");
+		line[len] = '\0';
+		if (len == 0 || line[0] == '#')
+		{
+			continue;
+		}
+		PROGRAMS = realloc(PROGRAMS, (NUM_PROGRAMS + 1) * sizeof(char *));
+		if (PROGRAMS == NULL || (PROGRAMS[NUM_PROGRAMS] = strdup(line)) == NULL)
+		{
+			printf("Error: Out of memory reading %s\n", path);
+			exit(1);
+		}
+		NUM_PROGRAMS++;
+	}
+	if (fp != stdin)
+	{
+		fclose(fp);
+	}
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [-j <threads>] [-n <instructions>] [-s <script>] [-e <engine>]\n", name);
+	printf("       [-b] [-l <list>] [-o <report>] <program>...\n");
+	printf("  -j  worker threads, one per online CPU by default\n");
+	printf("  -n  stop each program after this many instructions\n");
+	printf("  -s  run the commands in this file before simulating each program\n");
+	printf("  -e  classic, threaded or jit\n");
+	printf("  -b  the programs are raw binary images for the text segment\n");
+	printf("  -l  also run the programs listed in this file, one per line (- for stdin)\n");
+	printf("  -o  write the report here instead of standard output\n\n");
+	exit(1);
+}
+
+/***************************************************************/
+/* main                                                                                                                                   */
+/***************************************************************/
+int main(int argc, char *argv[])
+{
+	pthread_t *threads;
+	FILE *report = stdout;
+	struct timespec start, stop;
+	double seconds;
+	uint64_t instructions = 0;
+	uint32_t stolen = 0;
+	char *end;
+	int opt, i, chunk;
+
+	NUM_WORKERS = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "j:n:s:e:bl:o:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'j':
+			NUM_WORKERS = strtol(optarg, &end, 0);
+			if (*end != '\0' || NUM_WORKERS < 1)
+			{
+				usage(argv[0]);
+			}
+			break;
+		case 'n':
+			LIMIT = strtoull(optarg, &end, 0);
+			if (*optarg == '\0' || *end != '\0')
+			{
+				usage(argv[0]);
+			}
+			break;
+		case 's':
+			SCRIPT = optarg;
+			break;
+		case 'e':
+			if (strcmp(optarg, "classic") == 0)
+			{
+				ENGINE_CHOICE = ENGINE_CLASSIC;
+			}
+			else if (strcmp(optarg, "threaded") == 0)
+			{
+				ENGINE_CHOICE = ENGINE_THREADED;
+			}
+			else if (strcmp(optarg, "jit") == 0 && jit_available())
+			{
+				ENGINE_CHOICE = ENGINE_JIT;
+			}
+			else
+			{
+				usage(argv[0]);
+			}
+			break;
+		case 'b':
+			RAW = TRUE;
+			break;
+		case 'l':
+			read_program_list(optarg);
+			break;
+		case 'o':
+			report = fopen(optarg, "w");
+			if (report == NULL)
+			{
+				printf("Error: Can't create report file %s\n", optarg);
+				exit(1);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	for (; optind < argc; optind++)
+	{
+		PROGRAMS = realloc(PROGRAMS, (NUM_PROGRAMS + 1) * sizeof(char *));
+		if (PROGRAMS == NULL)
+		{
+			printf("Error: Out of memory\n");
+			exit(1);
+		}
+		PROGRAMS[NUM_PROGRAMS++] = argv[optind];
+	}
+	if (NUM_PROGRAMS == 0)
+	{
+		usage(argv[0]);
+	}
+	if (NUM_WORKERS > NUM_PROGRAMS)
+	{
+		NUM_WORKERS = NUM_PROGRAMS;
+	}
+
+	BATCH_MODE = TRUE;
+	RESULTS = calloc(NUM_PROGRAMS, sizeof(char *));
+	DEQUES = aligned_alloc(64, NUM_WORKERS * sizeof(job_deque_t));
+	WORKERS = calloc(NUM_WORKERS, sizeof(worker_t));
+	threads = calloc(NUM_WORKERS, sizeof(pthread_t));
+	if (RESULTS == NULL || DEQUES == NULL || WORKERS == NULL || threads == NULL)
+	{
+		printf("Error: Out of memory\n");
+		exit(1);
+	}
+
+	/* deal the jobs out in contiguous runs, so neighbours stay together */
+	chunk = (NUM_PROGRAMS + NUM_WORKERS - 1) / NUM_WORKERS;
+	for (i = 0; i < NUM_WORKERS; i++)
+	{
+		deque_init(&DEQUES[i], (int64_t)i * chunk < NUM_PROGRAMS ? (int64_t)i * chunk : NUM_PROGRAMS,
+				   (int64_t)(i + 1) * chunk < NUM_PROGRAMS ? (int64_t)(i + 1) * chunk : NUM_PROGRAMS);
+		WORKERS[i].id = i;
+		WORKERS[i].sim = sim_create();
+		WORKERS[i].sim->QUIET_LOAD = TRUE;
+		WORKERS[i].sim->RAW_BINARY = RAW;
+		WORKERS[i].sim->ENGINE = ENGINE_CHOICE;
+		WORKERS[i].sim->CAPTURE_OUTPUT = TRUE;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < NUM_WORKERS; i++)
+	{
+		if (pthread_create(&threads[i], NULL, worker_main, &WORKERS[i]) != 0)
+		{
+			printf("Error: Can't start worker thread %d\n", i);
+			exit(1);
+		}
+	}
+	for (i = 0; i < NUM_WORKERS; i++)
+	{
+		pthread_join(threads[i], NULL);
+		instructions += WORKERS[i].instructions;
+		stolen += WORKERS[i].stolen;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	seconds = (stop.tv_sec - start.tv_sec) + (stop.tv_nsec - start.tv_nsec) / 1e9;
+
+	/* one report, results in the order the programs were given */
+	fprintf(report, "{\"threads\":%d,\"jobs\":%d,\"stolen\":%u,\"instructions\":%llu,\"seconds\":%.6f,\"mips\":%.2f,\"results\":[\n",
+			NUM_WORKERS, NUM_PROGRAMS, stolen, (unsigned long long)instructions, seconds,
+			(seconds > 0) ? instructions / seconds / 1e6 : 0.0);
+	for (i = 0; i < NUM_PROGRAMS; i++)
+	{
+		/* batch_run() ends each object with a newline */
+		RESULTS[i][strcspn(RESULTS[i], "\n")] = '\0';
+		fprintf(report, "%s%s\n", RESULTS[i], (i + 1 < NUM_PROGRAMS) ? "," : "");
+		free(RESULTS[i]);
+	}
+	fprintf(report, "]}\n");
+	if (report != stdout)
+	{
+		fclose(report);
+	}
+
+	for (i = 0; i < NUM_WORKERS; i++)
+	{
+		sim_destroy(WORKERS[i].sim);
+	}
+	return 0;
+}
@@ -0,0 +1,529 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mu-riscv.h"
+
+/***************************************************************/
+/* Interval-sampled simulation                                                                         */
+/*                                                                                                                          */
+/* The main thread fast-forwards the program and cuts its run into         */
+/* intervals of -k instructions. At the start of every chosen interval it    */
+/* takes an interval checkpoint. When it reaches the end of that interval */
+/* it also knows the state the interval ends in, and queues it. Worker      */
+/* threads restore queued intervals into their own simulation of the        */
+/* program and replay them with the settings of the -s script, which is    */
+/* where slower detailed models get turned on. Each replay is checked     */
+/* against the state the fast-forward reached. Replays run while the       */
+/* fast-forward goes on, so a run takes about as long as the longer of    */
+/* the fast-forward and the replays divided by the number of workers.      */
+/***************************************************************/
+
+typedef struct sample {
+	struct sample *next;	/* replay queue */
+	uint64_t index;	/* interval number */
+	interval_t *interval;	/* its start, until the replay restored it */
+	CPU_State end;	/* where the fast-forward was after it */
+	uint64_t length;	/* instructions in it; only the last may be short */
+	const char *end_reason;	/* how the fast-forward left it */
+
+	/* filled in by the replay */
+	uint64_t replayed;
+	const char *exit;
+	int matches;
+	double seconds;
+	char *stats;	/* JSON counters of the replay, if the script turned them on */
+} sample_t;
+
+typedef struct {
+	int id;
+	sim_t *sim;
+	uint64_t instructions;	/* replayed by this worker */
+	double seconds;
+	uint32_t samples;
+} worker_t;
+
+static sample_t **SAMPLES;	/* every one taken, in interval order */
+static uint32_t NUM_SAMPLES;
+static sample_t *QUEUE_HEAD, *QUEUE_TAIL;	/* waiting for a worker */
+static int QUEUE_DONE;	/* the fast-forward has queued its last sample */
+static pthread_mutex_t QUEUE_LOCK = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t QUEUE_READY = PTHREAD_COND_INITIALIZER;
+
+static worker_t *WORKERS;
+static int NUM_WORKERS;
+
+static const char *SCRIPT;
+static uint64_t INTERVAL = 10000000;
+static uint64_t LIMIT = UINT64_MAX;
+static uint64_t PERIOD = 1;
+static uint64_t *CHOSEN;	/* -i: intervals to replay, instead of every PERIOD-th */
+static uint32_t NUM_CHOSEN;
+static int RAW;
+static int ENGINE_CHOICE = ENGINE_THREADED;
+static FILE *DISCARD;	/* output of the replays */
+
+static double seconds_since(const struct timespec *start)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/***************************************************************/
+/* Run up to count instructions, servicing ecalls. Returns how many were   */
+/* retired and says in reason how the run ended. Anything but running out  */
+/* of instructions ends the program.                                                          */
+/***************************************************************/
+static uint64_t advance(sim_t *sim, uint64_t count, const char **reason)
+{
+	run_result_t result;
+	uint64_t done = 0;
+
+	*reason = "limit";
+	while (sim->RUN_FLAG && done < count)
+	{
+		result = run_budget(sim, (count - done > UINT32_MAX) ? UINT32_MAX : count - done);
+		done += result.executed;
+		switch (result.reason)
+		{
+		case RUN_ECALL:
+			SYSCALL_Processing(sim, sim->CURRENT_STATE.REGS[17]);
+			if (!sim->RUN_FLAG)
+			{
+				*reason = "exit";
+			}
+			break;
+		case RUN_BREAKPOINT:
+			*reason = "breakpoint";
+			sim->RUN_FLAG = FALSE;
+			break;
+		case RUN_ILLEGAL:
+			*reason = "illegal";
+			sim->RUN_FLAG = FALSE;
+			break;
+		case RUN_HALTED:
+			*reason = "halted";
+			sim->RUN_FLAG = FALSE;
+			break;
+		default:
+			break;
+		}
+	}
+	return done;
+}
+
+/***************************************************************/
+/* Is interval index one to replay?                                                                 */
+/***************************************************************/
+static int interval_chosen(uint64_t index)
+{
+	uint32_t i;
+
+	if (NUM_CHOSEN == 0)
+	{
+		return index % PERIOD == 0;
+	}
+	for (i = 0; i < NUM_CHOSEN; i++)
+	{
+		if (CHOSEN[i] == index)
+		{
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+static void queue_push(sample_t *sample)
+{
+	pthread_mutex_lock(&QUEUE_LOCK);
+	if (QUEUE_TAIL != NULL)
+	{
+		QUEUE_TAIL->next = sample;
+	}
+	else
+	{
+		QUEUE_HEAD = sample;
+	}
+	QUEUE_TAIL = sample;
+	pthread_cond_signal(&QUEUE_READY);
+	pthread_mutex_unlock(&QUEUE_LOCK);
+}
+
+/***************************************************************/
+/* The next sample to replay, waiting for the fast-forward if need be;      */
+/* NULL once there are no more                                                                     */
+/***************************************************************/
+static sample_t *queue_pop()
+{
+	sample_t *sample;
+
+	pthread_mutex_lock(&QUEUE_LOCK);
+	while (QUEUE_HEAD == NULL && !QUEUE_DONE)
+	{
+		pthread_cond_wait(&QUEUE_READY, &QUEUE_LOCK);
+	}
+	sample = QUEUE_HEAD;
+	if (sample != NULL)
+	{
+		QUEUE_HEAD = sample->next;
+		if (QUEUE_HEAD == NULL)
+		{
+			QUEUE_TAIL = NULL;
+		}
+	}
+	pthread_mutex_unlock(&QUEUE_LOCK);
+	return sample;
+}
+
+/***************************************************************/
+/* Restore a sample's interval and replay it                                                */
+/***************************************************************/
+static void replay(worker_t *worker, sample_t *sample)
+{
+	sim_t *sim = worker->sim;
+	struct timespec start;
+	FILE *out;
+	size_t size;
+
+	stats_clear(sim);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	interval_restore(sim, sample->interval);
+	interval_release(sample->interval);
+	sample->interval = NULL;
+	/* an interval the program ended in runs until it ends again */
+	sample->replayed = advance(sim, (strcmp(sample->end_reason, "limit") == 0) ? sample->length : INTERVAL, &sample->exit);
+	sample->seconds = seconds_since(&start);
+	sample->matches = sample->replayed == sample->length && strcmp(sample->exit, sample->end_reason) == 0 &&
+		memcmp(&sim->CURRENT_STATE, &sample->end, sizeof(CPU_State)) == 0;
+	if (sim->STATS_ON)
+	{
+		out = open_memstream(&sample->stats, &size);
+		if (out == NULL)
+		{
+			printf("Error: Out of memory collecting statistics\n");
+			exit(1);
+		}
+		stats_json(sim, out);
+		fclose(out);
+	}
+
+	worker->instructions += sample->replayed;
+	worker->seconds += sample->seconds;
+	worker->samples++;
+}
+
+static void *worker_main(void *arg)
+{
+	worker_t *worker = arg;
+	sample_t *sample;
+
+	while ((sample = queue_pop()) != NULL)
+	{
+		replay(worker, sample);
+	}
+	return NULL;
+}
+
+/***************************************************************/
+/* Load the program into sim and run the command script against it        */
+/***************************************************************/
+static void sample_load(sim_t *sim, const char *program, const char *script)
+{
+	FILE *fp;
+
+	snprintf(sim->prog_file, sizeof(sim->prog_file), "%s", program);
+	sim->QUIET_LOAD = TRUE;
+	sim->RAW_BINARY = RAW;
+	sim->ENGINE = ENGINE_CHOICE;
+	if (!load_program(sim))
+	{
+		printf("Error: %s\n", sim->LOAD_ERROR);
+		exit(-1);
+	}
+	if (script == NULL)
+	{
+		return;
+	}
+	fp = fopen(script, "r");
+	if (fp == NULL)
+	{
+		printf("Error: Can't open command script %s\n", script);
+		exit(1);
+	}
+	while (execute_command(sim, fp))
+	{
+	}
+	fclose(fp);
+}
+
+/***************************************************************/
+/* Read the -i list of interval numbers                                                          */
+/***************************************************************/
+static int parse_chosen(char *list)
+{
+	char *item, *end;
+
+	for (item = strtok(list, ","); item != NULL; item = strtok(NULL, ","))
+	{
+		CHOSEN = realloc(CHOSEN, (NUM_CHOSEN + 1) * sizeof(uint64_t));
+		if (CHOSEN == NULL)
+		{
+			printf("Error: Out of memory\n");
+			exit(1);
+		}
+		CHOSEN[NUM_CHOSEN++] = strtoull(item, &end, 0);
+		if (*item == '\0' || *end != '\0')
+		{
+			return FALSE;
+		}
+	}
+	return NUM_CHOSEN > 0;
+}
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [-k <instructions>] [-p <period> | -i <list>] [-j <threads>]\n", name);
+	printf("       [-n <instructions>] [-s <script>] [-e <engine>] [-b] [-o <report>] <program>\n");
+	printf("  -k  instructions per interval, 10000000 by default\n");
+	printf("  -p  replay every period-th interval, every one by default\n");
+	printf("  -i  replay these intervals, numbered from 0 and separated by commas\n");
+	printf("  -j  replay threads, one per online CPU by default\n");
+	printf("  -n  stop the program after this many instructions\n");
+	printf("  -s  run the commands in this file on every replay simulation first\n");
+	printf("  -e  classic, threaded or jit, for the fast-forward and the replays\n");
+	printf("  -b  the program is a raw binary image for the text segment\n");
+	printf("  -o  write the report here instead of after the program's output\n\n");
+	exit(1);
+}
+
+/***************************************************************/
+/* main                                                                                                                                   */
+/***************************************************************/
+int main(int argc, char *argv[])
+{
+	pthread_t *threads;
+	FILE *report = stdout;
+	struct timespec start;
+	double seconds, forward_seconds, replay_seconds = 0;
+	uint64_t retired = 0, replayed = 0, intervals = 0, length;
+	uint32_t diverged = 0;
+	interval_t *prev = NULL, *taken;
+	sample_t *sample;
+	const char *reason = "limit";
+	sim_t *sim;
+	char *end;
+	int opt, i;
+
+	NUM_WORKERS = sysconf(_SC_NPROCESSORS_ONLN);
+	while ((opt = getopt(argc, argv, "k:p:i:j:n:s:e:bo:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'k':
+			INTERVAL = strtoull(optarg, &end, 0);
+			if (*end != '\0' || INTERVAL == 0)
+			{
+				usage(argv[0]);
+			}
+			break;
+		case 'p':
+			PERIOD = strtoull(optarg, &end, 0);
+			if (*end != '\0' || PERIOD == 0)
+			{
+				usage(argv[0]);
+			}
+			break;
+		case 'i':
+			if (!parse_chosen(optarg))
+			{
+				usage(argv[0]);
+			}
+			break;
+		case 'j':
+			NUM_WORKERS = strtol(optarg, &end, 0);
+			if (*end != '\0' || NUM_WORKERS < 1)
+			{
+				usage(argv[0]);
+			}
+			break;
+		case 'n':
+			LIMIT = strtoull(optarg, &end, 0);
+			if (*optarg == '\0' || *end != '\0')
+			{
+				usage(argv[0]);
+			}
+			break;
+		case 's':
+			SCRIPT = optarg;
+			break;
+		case 'e':
+			if (strcmp(optarg, "classic") == 0)
+			{
+				ENGINE_CHOICE = ENGINE_CLASSIC;
+			}
+			else if (strcmp(optarg, "threaded") == 0)
+			{
+				ENGINE_CHOICE = ENGINE_THREADED;
+			}
+			else if (strcmp(optarg, "jit") == 0 && jit_available())
+			{
+				ENGINE_CHOICE = ENGINE_JIT;
+			}
+			else
+			{
+				usage(argv[0]);
+			}
+			break;
+		case 'b':
+			RAW = TRUE;
+			break;
+		case 'o':
+			report = fopen(optarg, "w");
+			if (report == NULL)
+			{
+				printf("Error: Can't create report file %s\n", optarg);
+				exit(1);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+	{
+		usage(argv[0]);
+	}
+
+	BATCH_MODE = TRUE;
+	DISCARD = fopen("/dev/null", "w");
+	WORKERS = calloc(NUM_WORKERS, sizeof(worker_t));
+	threads = calloc(NUM_WORKERS, sizeof(pthread_t));
+	if (DISCARD == NULL || WORKERS == NULL || threads == NULL)
+	{
+		printf("Error: Out of memory\n");
+		exit(1);
+	}
+
+	/* the first load makes the image every replay simulation shares */
+	sim = sim_create();
+	sample_load(sim, argv[optind], NULL);
+	for (i = 0; i < NUM_WORKERS; i++)
+	{
+		WORKERS[i].id = i;
+		WORKERS[i].sim = sim_create();
+		WORKERS[i].sim->OUTPUT = DISCARD;
+		sample_load(WORKERS[i].sim, argv[optind], SCRIPT);
+		if (pthread_create(&threads[i], NULL, worker_main, &WORKERS[i]) != 0)
+		{
+			printf("Error: Can't start worker thread %d\n", i);
+			exit(1);
+		}
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (intervals = 0; sim->RUN_FLAG && retired < LIMIT; intervals++)
+	{
+		if (!interval_chosen(intervals))
+		{
+			retired += advance(sim, (LIMIT - retired < INTERVAL) ? LIMIT - retired : INTERVAL, &reason);
+			continue;
+		}
+
+		/* the previous checkpoint stays until this one shares its pages */
+		taken = interval_take(sim, prev, retired);
+		if (prev != NULL)
+		{
+			interval_release(prev);
+		}
+		prev = taken;
+		length = advance(sim, (LIMIT - retired < INTERVAL) ? LIMIT - retired : INTERVAL, &reason);
+
+		sample = calloc(1, sizeof(sample_t));
+		SAMPLES = realloc(SAMPLES, (NUM_SAMPLES + 1) * sizeof(sample_t *));
+		if (sample == NULL || SAMPLES == NULL)
+		{
+			printf("Error: Out of memory\n");
+			exit(1);
+		}
+		sample->index = intervals;
+		sample->interval = taken;
+		__atomic_add_fetch(&taken->refs, 1, __ATOMIC_RELAXED);
+		sample->end = sim->CURRENT_STATE;
+		sample->length = length;
+		sample->end_reason = reason;
+		retired += length;
+		SAMPLES[NUM_SAMPLES++] = sample;
+		queue_push(sample);
+	}
+	forward_seconds = seconds_since(&start);
+	if (prev != NULL)
+	{
+		interval_release(prev);
+	}
+	fflush(sim->OUTPUT);
+
+	pthread_mutex_lock(&QUEUE_LOCK);
+	QUEUE_DONE = TRUE;
+	pthread_cond_broadcast(&QUEUE_READY);
+	pthread_mutex_unlock(&QUEUE_LOCK);
+	for (i = 0; i < NUM_WORKERS; i++)
+	{
+		pthread_join(threads[i], NULL);
+		replayed += WORKERS[i].instructions;
+		replay_seconds += WORKERS[i].seconds;
+	}
+	seconds = seconds_since(&start);
+
+	/* one report; scale is what replayed counts get multiplied by for the whole run */
+	fprintf(report, "{\"program\":");
+	json_string(report, argv[optind], strlen(argv[optind]));
+	fprintf(report, ",\"interval\":%llu,\"intervals\":%llu,\"threads\":%d,\"seconds\":%.6f,\n",
+			(unsigned long long)INTERVAL, (unsigned long long)intervals, NUM_WORKERS, seconds);
+	fprintf(report, "\"fast_forward\":{\"instructions\":%llu,\"exit\":\"%s\",\"seconds\":%.6f,\"mips\":%.2f},\n",
+			(unsigned long long)retired, reason, forward_seconds, (forward_seconds > 0) ? retired / forward_seconds / 1e6 : 0.0);
+	for (i = 0; i < NUM_SAMPLES; i++)
+	{
+		diverged += !SAMPLES[i]->matches;
+	}
+	fprintf(report, "\"replay\":{\"samples\":%u,\"diverged\":%u,\"instructions\":%llu,\"seconds\":%.6f,\"mips\":%.2f,\"scale\":%.6f},\n",
+			NUM_SAMPLES, diverged, (unsigned long long)replayed, replay_seconds,
+			(replay_seconds > 0) ? replayed / replay_seconds / 1e6 : 0.0, (replayed > 0) ? (double)retired / replayed : 0.0);
+	fprintf(report, "\"samples\":[\n");
+	for (i = 0; i < NUM_SAMPLES; i++)
+	{
+		sample = SAMPLES[i];
+		fprintf(report, "{\"interval\":%llu,\"start\":%llu,\"instructions\":%llu,\"pc\":%u,\"exit\":\"%s\",\"matches\":%s,\"seconds\":%.6f",
+				(unsigned long long)sample->index, (unsigned long long)sample->index * INTERVAL, (unsigned long long)sample->replayed,
+				sample->end.PC, sample->exit, sample->matches ? "true" : "false", sample->seconds);
+		if (sample->stats != NULL)
+		{
+			fprintf(report, ",\"stats\":%s", sample->stats);
+		}
+		fprintf(report, "}%s\n", (i + 1 < NUM_SAMPLES) ? "," : "");
+		free(sample->stats);
+		free(sample);
+	}
+	fprintf(report, "]}\n");
+	if (report != stdout)
+	{
+		fclose(report);
+	}
+
+	sim_destroy(sim);
+	for (i = 0; i < NUM_WORKERS; i++)
+	{
+		sim_destroy(WORKERS[i].sim);
+	}
+	fclose(DISCARD);
+	free(SAMPLES);
+	free(CHOSEN);
+	free(WORKERS);
+	free(threads);
+	return 0;
+}
@@ -0,0 +1,81 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "mu-riscv.h"
+
+/***************************************************************/
+/* Trace decoder: prints a trace written by the trace command as text,     */
+/* one instruction per line with its disassembly, the value it wrote to rd */
+/* and the address it accessed.                                                                   */
+/***************************************************************/
+
+static void usage(const char *name)
+{
+	printf("Usage: %s [-n <instructions>] [-o <text>] <trace>\n", name);
+	printf("  -n  stop after this many instructions\n");
+	printf("  -o  write the text here instead of standard output\n\n");
+	exit(1);
+}
+
+/***************************************************************/
+/* main                                                                                                                                   */
+/***************************************************************/
+int main(int argc, char *argv[])
+{
+	FILE *in, *out = stdout;
+	uint64_t limit = UINT64_MAX;
+	char *end;
+	int opt, ok;
+
+	while ((opt = getopt(argc, argv, "n:o:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			limit = strtoull(optarg, &end, 0);
+			if (*optarg == '\0' || *end != '\0')
+			{
+				usage(argv[0]);
+			}
+			break;
+		case 'o':
+			out = fopen(optarg, "w");
+			if (out == NULL)
+			{
+				printf("Error: Can't create %s\n", optarg);
+				exit(1);
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+	{
+		usage(argv[0]);
+	}
+
+	in = fopen(argv[optind], "rb");
+	if (in == NULL)
+	{
+		printf("Error: Can't open trace %s\n", argv[optind]);
+		exit(1);
+	}
+	setvbuf(in, NULL, _IOFBF, 1 << 20);
+	isa_init();
+	ok = trace_decode(in, out, limit);
+	fclose(in);
+	if (out != stdout)
+	{
+		fclose(out);
+	}
+	if (!ok)
+	{
+		printf("Error: %s is not a trace, or is cut short\n", argv[optind]);
+		exit(1);
+	}
+	return 0;
+}
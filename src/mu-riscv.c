@@ -1,12 +1,31 @@
 #include <stdio.h>
-#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdarg.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "mu-riscv.h"
 
+/***************************************************************/
+/* State shared by every simulation (declared in mu-riscv.h)                          */
+/***************************************************************/
+mem_region_t MEM_REGIONS[NUM_MEM_REGION] = {
+	{ MEM_TEXT_BEGIN, MEM_TEXT_END },
+	{ MEM_DATA_BEGIN, MEM_DATA_END },
+	{ MEM_KDATA_BEGIN, MEM_KDATA_END },
+	{ MEM_KTEXT_BEGIN, MEM_KTEXT_END }
+};
+
+uint8_t ZERO_PAGE[PAGE_SIZE];
+
+uint8_t DECODE_MAJOR[128][8];
+uint8_t DECODE_MINOR[DECODE_MINOR_TABLES][128];
+
+int BATCH_MODE;
+
 /***************************************************************/
 /* Print out a list of commands available                                                                  */
 /***************************************************************/
@@ -23,11 +42,39 @@ void help()
 	printf("high <val>\t-- set the HI register to <val>\n");
 	printf("low <val>\t-- set the LO register to <val>\n");
 	printf("print\t-- print the program loaded into memory\n");
+	printf("save <file>\t-- write a checkpoint of registers and memory to <file>\n");
+	printf("restore <file>\t-- continue from the checkpoint in <file>\n");
+	printf("engine <classic|threaded|jit>\t-- select the interpreter core\n");
+	printf("stats <on|off|reset|print|json>\t-- control and show execution statistics\n");
+	printf("trace <file|off>\t-- write a binary trace of executed instructions to <file>\n");
+	printf("profile <on|off|reset|top <n>|flame <file>>\t-- profile hot code and call stacks\n");
+	printf("cache <on|off|reset|print|json>\t-- control and show the cache model\n");
+	printf("cache <l1i|l1d|l2> <size> <ways> <line> <lru|plru> <wb|wt> <cycles>\t-- configure a cache level\n");
+	printf("cache memory <cycles>\t-- set the memory latency of the cache model\n");
+	printf("branch <on|off|reset|top <n>|json>\t-- control and show the branch predictors\n");
+	printf("branch <static|bimodal|gshare|tage> <table bits> <history bits> <btb bits> <ras depth>\t-- select a predictor\n");
 	printf("?\t-- display help menu\n");
 	printf("quit\t-- exit the simulator\n\n");
 	printf("------------------------------------------------------------------\n\n");
 }
 
+/***************************************************************/
+/* Status output meant for someone at the prompt; batch mode drops it so */
+/* that stdout carries only the program's own output and the results.   */
+/***************************************************************/
+void sim_log(const char *format, ...)
+{
+	va_list args;
+
+	if (BATCH_MODE)
+	{
+		return;
+	}
+	va_start(args, format);
+	vprintf(format, args);
+	va_end(args);
+}
+
 /***************************************************************/
 /* Turn a byte to a word                                                                          */
 /***************************************************************/
@@ -45,1107 +92,2723 @@ uint32_t half_to_word(uint16_t half)
 }
 
 /***************************************************************/
-/* Read a 32-bit word from memory                                                                            */
+/* Take a host page from the pool, or allocate one; contents undefined   */
 /***************************************************************/
-uint32_t mem_read_32(uint32_t address)
+static uint8_t *page_alloc(sim_t *sim)
 {
-	int i;
-	for (i = 0; i < NUM_MEM_REGION; i++)
+	uint8_t *page = sim->FREE_PAGES;
+
+	if (page != NULL)
 	{
-		if ((address >= MEM_REGIONS[i].begin) && (address <= MEM_REGIONS[i].end))
-		{
-			uint32_t offset = address - MEM_REGIONS[i].begin;
-			return (MEM_REGIONS[i].mem[offset + 3] << 24) |
-				   (MEM_REGIONS[i].mem[offset + 2] << 16) |
-				   (MEM_REGIONS[i].mem[offset + 1] << 8) |
-				   (MEM_REGIONS[i].mem[offset + 0] << 0);
-		}
+		sim->FREE_PAGES = *(uint8_t **)page;
+		sim->NUM_FREE_PAGES--;
+		return page;
+	}
+	page = malloc(PAGE_SIZE);
+	if (page == NULL)
+	{
+		printf("Error: Out of memory allocating a page\n");
+		exit(-1);
 	}
-	return 0;
+	return page;
 }
 
 /***************************************************************/
-/* Write a 32-bit word to memory                                                                                */
+/* Give a host page back to the pool, so the next program can reuse it  */
 /***************************************************************/
-void mem_write_32(uint32_t address, uint32_t value)
+static void page_release(sim_t *sim, uint8_t *page)
 {
-	int i;
-	uint32_t offset;
-	for (i = 0; i < NUM_MEM_REGION; i++)
+	if (page == NULL)
 	{
-		if ((address >= MEM_REGIONS[i].begin) && (address <= MEM_REGIONS[i].end))
-		{
-			offset = address - MEM_REGIONS[i].begin;
-
-			MEM_REGIONS[i].mem[offset + 3] = (value >> 24) & 0xFF;
-			MEM_REGIONS[i].mem[offset + 2] = (value >> 16) & 0xFF;
-			MEM_REGIONS[i].mem[offset + 1] = (value >> 8) & 0xFF;
-			MEM_REGIONS[i].mem[offset + 0] = (value >> 0) & 0xFF;
-		}
+		return;
+	}
+	if (sim->NUM_FREE_PAGES >= PAGE_POOL_MAX)
+	{
+		free(page);
+		return;
 	}
+	*(uint8_t **)page = sim->FREE_PAGES;
+	sim->FREE_PAGES = page;
+	sim->NUM_FREE_PAGES++;
 }
 
 /***************************************************************/
-/* Execute one cycle                                                                                                              */
+/* Find the page backing an address for reading                                    */
+/* Untouched pages read as zero through the shared ZERO_PAGE              */
 /***************************************************************/
-void cycle()
+uint8_t *mem_page_read(sim_t *sim, uint32_t address)
 {
-	handle_instruction();
-	CURRENT_STATE = NEXT_STATE;
-	INSTRUCTION_COUNT++;
+	/* another hart may be adding the table or page right now */
+	uint8_t **table = __atomic_load_n(&sim->MEMORY->PAGE_DIR[PAGE_DIR_INDEX(address)], __ATOMIC_ACQUIRE);
+	uint8_t *page;
+
+	if (table == NULL || (page = __atomic_load_n(&table[PAGE_TABLE_INDEX(address)], __ATOMIC_ACQUIRE)) == NULL)
+	{
+		return ZERO_PAGE;
+	}
+	return page;
 }
 
 /***************************************************************/
-/* Simulate RISCV for n cycles                                                                                       */
+/* Note that reset() has to put the page holding address back              */
 /***************************************************************/
-void run(int num_cycles)
+void mem_mark_dirty(sim_t *sim, uint32_t address)
 {
+	uint32_t page = address >> PAGE_SHIFT;
 
-	if (RUN_FLAG == FALSE)
+	sim = sim->MEMORY;
+
+	if (sim->DIRTY_BITMAP[page >> 3] & (1 << (page & 7)))
 	{
-		printf("Simulation Stopped\n\n");
 		return;
 	}
-
-	printf("Running simulator for %d cycles...\n\n", num_cycles);
-	int i;
-	for (i = 0; i < num_cycles; i++)
+	if (sim->NUM_DIRTY_PAGES == sim->DIRTY_CAPACITY)
 	{
-		if (RUN_FLAG == FALSE)
+		sim->DIRTY_CAPACITY = sim->DIRTY_CAPACITY ? 2 * sim->DIRTY_CAPACITY : 256;
+		sim->DIRTY_PAGES = realloc(sim->DIRTY_PAGES, sim->DIRTY_CAPACITY * sizeof(uint32_t));
+		if (sim->DIRTY_PAGES == NULL)
 		{
-			printf("Simulation Stopped.\n\n");
-			break;
+			printf("Error: Out of memory tracking dirty pages\n");
+			exit(-1);
 		}
-		cycle();
 	}
+	sim->DIRTY_BITMAP[page >> 3] |= 1 << (page & 7);
+	sim->DIRTY_PAGES[sim->NUM_DIRTY_PAGES++] = page;
 }
 
-/**************************************************************rdump*/
-/* simulate to completion                                                                                               */
 /***************************************************************/
-void runAll()
+/* Find the page backing an address for writing, allocating it on first use  */
+/* Returns NULL for addresses outside every memory region                       */
+/***************************************************************/
+static uint8_t *page_write(sim_t *sim, uint32_t address)
 {
-	if (RUN_FLAG == FALSE)
+	int i;
+	uint8_t **table = sim->MEMORY->PAGE_DIR[PAGE_DIR_INDEX(address)];
+
+	mem_mark_dirty(sim, address);
+	if (table != NULL && table[PAGE_TABLE_INDEX(address)] != NULL)
 	{
-		printf("Simulation Stopped.\n\n");
-		return;
+		return table[PAGE_TABLE_INDEX(address)];
+	}
+
+	for (i = 0; i < NUM_MEM_REGION; i++)
+	{
+		if ((address >= MEM_REGIONS[i].begin) && (address <= MEM_REGIONS[i].end))
+		{
+			break;
+		}
+	}
+	if (i == NUM_MEM_REGION)
+	{
+		return NULL;
 	}
+	return mem_page_map(sim, address, NULL);
+}
+
+uint8_t *mem_page_write(sim_t *sim, uint32_t address)
+{
+	sim_t *memory = sim->MEMORY;
+	uint8_t *page;
 
-	printf("Simulation Started...\n\n");
-	while (RUN_FLAG)
+	if (memory->NUM_HARTS == 1)
 	{
-		cycle();
+		return page_write(sim, address);
 	}
-	printf("Simulation Finished.\n\n");
+	pthread_mutex_lock(&memory->MEMORY_LOCK);
+	page = page_write(sim, address);
+	pthread_mutex_unlock(&memory->MEMORY_LOCK);
+	return page;
 }
 
 /***************************************************************/
-/* Dump a word-aligned region of memory to the terminal                              */
+/* Back the page holding address with the given host page, or with a new  */
+/* zeroed one if page is NULL. Ignores the memory regions; the loader uses */
+/* it to place segments wherever the program was linked.                        */
 /***************************************************************/
-void mdump(uint32_t start, uint32_t stop)
+uint8_t *mem_page_map(sim_t *sim, uint32_t address, uint8_t *page)
 {
-	uint32_t address;
+	sim_t *memory = sim->MEMORY;
+	uint8_t **table = memory->PAGE_DIR[PAGE_DIR_INDEX(address)];
 
-	printf("-------------------------------------------------------------\n");
-	printf("Memory content [0x%08x..0x%08x] :\n", start, stop);
-	printf("-------------------------------------------------------------\n");
-	printf("\t[Address in Hex (Dec) ]\t[Value]\n");
-	for (address = start; address <= stop; address += 4)
+	/* release: harts reading without the lock must see the contents first */
+	if (table == NULL)
+	{
+		table = calloc(PAGE_TABLE_ENTRIES, sizeof(uint8_t *));
+		if (table == NULL)
+		{
+			printf("Error: Out of memory allocating page table\n");
+			exit(-1);
+		}
+		__atomic_store_n(&memory->PAGE_DIR[PAGE_DIR_INDEX(address)], table, __ATOMIC_RELEASE);
+	}
+	if (page == NULL)
 	{
-		printf("\t0x%08x (%d) :\t0x%08x\n", address, address, mem_read_32(address));
+		page = page_alloc(memory);
+		memset(page, 0, PAGE_SIZE);
+		memory->PAGES_ALLOCATED++;
 	}
-	printf("\n");
+	__atomic_store_n(&table[PAGE_TABLE_INDEX(address)], page, __ATOMIC_RELEASE);
+
+	/* the read TLB may still map this page to ZERO_PAGE */
+	if (sim->TLB_READ[TLB_INDEX(address)].tag == (address & ~PAGE_OFFSET_MASK))
+	{
+		sim->TLB_READ[TLB_INDEX(address)].tag = TLB_INVALID;
+	}
+	return table[PAGE_TABLE_INDEX(address)];
 }
 
 /***************************************************************/
-/* Dump current values of registers to the teminal                                              */
+/* Remember every page as it is now as the state reset() goes back to.    */
+/* Pages of the mapped program file are restored from a read-only mapping */
+/* of it, other non-zero pages from a copy.                                         */
 /***************************************************************/
-void rdump()
+void mem_save_pristine(sim_t *sim)
 {
-	int i;
-	printf("-------------------------------------\n");
-	printf("Dumping Register Content\n");
-	printf("-------------------------------------\n");
-	printf("# Instructions Executed\t: %u\n", INSTRUCTION_COUNT);
-	printf("PC\t: 0x%08x\n", CURRENT_STATE.PC);
-	printf("-------------------------------------\n");
-	printf("[Register]\t[Value]\n");
-	printf("-------------------------------------\n");
-	for (i = 0; i < RISCV_REGS; i++)
+	int i, j;
+	uint8_t *page;
+	const uint8_t *pristine;
+	uint8_t *copy;
+
+	for (i = 0; i < PAGE_DIR_ENTRIES; i++)
+	{
+		if (sim->PAGE_DIR[i] == NULL)
+		{
+			continue;
+		}
+		for (j = 0; j < PAGE_TABLE_ENTRIES; j++)
+		{
+			page = sim->PAGE_DIR[i][j];
+			if (page == NULL)
+			{
+				continue;
+			}
+			pristine = image_pristine_page(sim, page);
+			if (pristine == NULL)
+			{
+				if (page[0] == 0 && memcmp(page, page + 1, PAGE_SIZE - 1) == 0)
+				{
+					continue;
+				}
+				copy = page_alloc(sim);
+				memcpy(copy, page, PAGE_SIZE);
+				pristine = copy;
+			}
+			if (sim->PRISTINE_DIR[i] == NULL)
+			{
+				sim->PRISTINE_DIR[i] = calloc(PAGE_TABLE_ENTRIES, sizeof(uint8_t *));
+				if (sim->PRISTINE_DIR[i] == NULL)
+				{
+					printf("Error: Out of memory saving the program image\n");
+					exit(-1);
+				}
+			}
+			sim->PRISTINE_DIR[i][j] = pristine;
+		}
+	}
+
+	/* what the loader wrote is not dirty */
+	for (i = 0; i < sim->NUM_DIRTY_PAGES; i++)
 	{
-		printf("[R%d]\t: 0x%08x\n", i, CURRENT_STATE.REGS[i]);
+		sim->DIRTY_BITMAP[sim->DIRTY_PAGES[i] >> 3] = 0;
 	}
-	printf("-------------------------------------\n");
-	printf("[HI]\t: 0x%08x\n", CURRENT_STATE.HI);
-	printf("[LO]\t: 0x%08x\n", CURRENT_STATE.LO);
-	printf("-------------------------------------\n");
+	sim->NUM_DIRTY_PAGES = 0;
+	tlb_flush(sim);
 }
 
 /***************************************************************/
-/* Read a command from standard input.                                                               */
+/* Is this decoded page one of the loaded image's, shared with other        */
+/* simulations and never written?                                                                       */
 /***************************************************************/
-void handle_command()
+static int decode_page_shared(sim_t *sim, const decoded_insn_t *page)
 {
-	char buffer[20];
-	uint32_t start, stop, cycles;
-	uint32_t register_no;
-	int register_value;
-	int hi_reg_value, lo_reg_value;
+	const program_image_t *image = sim->MEMORY->IMAGE;
 
-	printf("MU-RISCV SIM:> ");
+	return image != NULL && image->decoded != NULL && page >= image->decoded &&
+		page < image->decoded + (size_t)image->num_decoded * DECODE_PAGE_ENTRIES;
+}
+
+/***************************************************************/
+/* The loaded image's decoded page for address, or NULL if it has none        */
+/***************************************************************/
+static decoded_insn_t *decode_image_page(sim_t *sim, uint32_t address)
+{
+	const program_image_t *image = sim->MEMORY->IMAGE;
+	uint32_t page = (address >> PAGE_SHIFT) - ((image != NULL) ? image->decoded_first : 0);
 
-	if (scanf("%s", buffer) == EOF)
+	if (image == NULL || page >= image->num_decoded)
 	{
-		exit(0);
+		return NULL;
 	}
+	return image->decoded + (size_t)page * DECODE_PAGE_ENTRIES;
+}
 
-	switch (buffer[0])
+/***************************************************************/
+/* Put every page written since the last reset back the way the loader   */
+/* left it, and drop decoded instructions of the ones holding code.         */
+/***************************************************************/
+void mem_restore_dirty(sim_t *sim)
+{
+	uint32_t i, address;
+	uint8_t *page;
+	const uint8_t *pristine;
+	decoded_insn_t *decoded, *shared;
+	int code_changed = FALSE;
+
+	for (i = 0; i < sim->NUM_DIRTY_PAGES; i++)
 	{
-	case 'S':
-	case 's':
-		runAll();
-		break;
-	case 'M':
-	case 'm':
-		if (scanf("%x %x", &start, &stop) != 2)
-		{
-			break;
-		}
-		mdump(start, stop);
-		break;
-	case '?':
-		help();
-		break;
-	case 'Q':
-	case 'q':
-		printf("**************************\n");
-		printf("Exiting MU-RISCV! Good Bye...\n");
-		printf("**************************\n");
-		exit(0);
-	case 'R':
-	case 'r':
-		if (buffer[1] == 'd' || buffer[1] == 'D')
+		address = sim->DIRTY_PAGES[i] << PAGE_SHIFT;
+		sim->DIRTY_BITMAP[sim->DIRTY_PAGES[i] >> 3] = 0;
+		page = mem_page_read(sim, address);
+		pristine = (sim->PRISTINE_DIR[PAGE_DIR_INDEX(address)] != NULL) ?
+			sim->PRISTINE_DIR[PAGE_DIR_INDEX(address)][PAGE_TABLE_INDEX(address)] : NULL;
+		if (pristine != NULL)
 		{
-			rdump();
+			/* the page may have been dropped by a checkpoint restore */
+			if (page == ZERO_PAGE)
+			{
+				page = mem_page_map(sim, address, NULL);
+			}
+			memcpy(page, pristine, PAGE_SIZE);
 		}
-		else if (buffer[1] == 'e' || buffer[1] == 'E')
+		else if (page != ZERO_PAGE)
 		{
-			reset();
+			memset(page, 0, PAGE_SIZE);
 		}
-		else
+		decoded = decode_page_lookup(sim, address);
+		if (decoded != NULL && !decode_page_shared(sim, decoded))
 		{
-			if (scanf("%d", &cycles) != 1)
+			/* the page is the loaded one again, so its image's decoding fits */
+			shared = decode_image_page(sim, address);
+			if (shared != NULL)
 			{
-				break;
+				free(decoded);
+				sim->DECODE_DIR[PAGE_DIR_INDEX(address)][PAGE_TABLE_INDEX(address)] = shared;
 			}
-			run(cycles);
-		}
-		break;
-	case 'I':
-	case 'i':
-		if (scanf("%u %i", &register_no, &register_value) != 2)
-		{
-			break;
+			else
+			{
+				memset(decoded, 0, DECODE_PAGE_ENTRIES * sizeof(decoded_insn_t));
+			}
+			code_changed = TRUE;
 		}
-		CURRENT_STATE.REGS[register_no] = register_value;
-		NEXT_STATE.REGS[register_no] = register_value;
-		break;
-	case 'H':
-	case 'h':
-		if (scanf("%i", &hi_reg_value) != 1)
+	}
+	sim->NUM_DIRTY_PAGES = 0;
+	sim->DECODE_LAST_BASE = TLB_INVALID;
+	tlb_flush(sim);
+	if (code_changed)
+	{
+		block_flush(sim);
+	}
+}
+
+/***************************************************************/
+/* Drop every TLB entry                                                                                      */
+/***************************************************************/
+void tlb_flush(sim_t *sim)
+{
+	int i;
+	for (i = 0; i < TLB_ENTRIES; i++)
+	{
+		sim->TLB_READ[i].tag = TLB_INVALID;
+		sim->TLB_WRITE[i].tag = TLB_INVALID;
+	}
+}
+
+/***************************************************************/
+/* TLB miss path for reads: refill the entry, or go byte by byte when the   */
+/* access is misaligned                                                                                      */
+/***************************************************************/
+uint32_t mem_read_slow(sim_t *sim, uint32_t address, int width)
+{
+	int i;
+	uint32_t value = 0;
+	uint8_t *host;
+	tlb_entry_t *entry;
+
+	if ((address & (width - 1)) == 0)
+	{
+		host = mem_page_read(sim, address);
+		for (i = 0; i < width; i++)
 		{
-			break;
+			value |= host[(address & PAGE_OFFSET_MASK) + i] << (8 * i);
 		}
-		CURRENT_STATE.HI = hi_reg_value;
-		NEXT_STATE.HI = hi_reg_value;
-		break;
-	case 'L':
-	case 'l':
-		if (scanf("%i", &lo_reg_value) != 1)
+		/* with other harts about, an untouched page may get allocated at any time */
+		if (host != ZERO_PAGE || sim->MEMORY->NUM_HARTS == 1)
 		{
-			break;
+			entry = &sim->TLB_READ[TLB_INDEX(address)];
+			entry->tag = address & ~PAGE_OFFSET_MASK;
+			entry->host = host;
 		}
-		CURRENT_STATE.LO = lo_reg_value;
-		NEXT_STATE.LO = lo_reg_value;
-		break;
-	case 'P':
-	case 'p':
-		print_program();
-		break;
-	default:
-		printf("Invalid Command.\n");
-		break;
+		return value;
+	}
+
+	for (i = 0; i < width; i++)
+	{
+		value |= mem_page_read(sim, address + i)[(address + i) & PAGE_OFFSET_MASK] << (8 * i);
 	}
+	return value;
 }
 
 /***************************************************************/
-/* reset registers/memory and reload program                                                    */
+/* TLB miss path for writes                                                                                  */
 /***************************************************************/
-void reset()
+void mem_write_slow(sim_t *sim, uint32_t address, uint32_t value, int width)
 {
 	int i;
-	/*reset registers*/
-	for (i = 0; i < RISCV_REGS; i++)
+	uint8_t *page;
+	tlb_entry_t *entry;
+
+	if ((address & (width - 1)) == 0)
 	{
-		CURRENT_STATE.REGS[i] = 0;
+		page = mem_page_write(sim, address);
+		if (page == NULL)
+		{
+			return;
+		}
+		for (i = 0; i < width; i++)
+		{
+			page[(address & PAGE_OFFSET_MASK) + i] = (value >> (8 * i)) & 0xFF;
+		}
+		if (decode_page_lookup(sim, address) != NULL)
+		{
+			/* code page: stay off the fast path so later stores see the cache */
+			decode_invalidate(sim, address, width);
+			return;
+		}
+		entry = &sim->TLB_WRITE[TLB_INDEX(address)];
+		entry->tag = address & ~PAGE_OFFSET_MASK;
+		entry->host = page;
+		return;
 	}
-	CURRENT_STATE.HI = 0;
-	CURRENT_STATE.LO = 0;
 
-	for (i = 0; i < NUM_MEM_REGION; i++)
+	for (i = 0; i < width; i++)
 	{
-		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		memset(MEM_REGIONS[i].mem, 0, region_size);
+		page = mem_page_write(sim, address + i);
+		if (page != NULL)
+		{
+			page[(address + i) & PAGE_OFFSET_MASK] = (value >> (8 * i)) & 0xFF;
+		}
 	}
-
-	/*load program*/
-	load_program();
-
-	/*reset PC*/
-	INSTRUCTION_COUNT = 0;
-	CURRENT_STATE.PC = MEM_TEXT_BEGIN;
-	NEXT_STATE = CURRENT_STATE;
-	RUN_FLAG = TRUE;
+	decode_invalidate(sim, address, width);
 }
 
 /***************************************************************/
-/* Allocate and set memory to zero                                                                            */
+/* Read a 32-bit word from memory                                                                            */
 /***************************************************************/
-void init_memory()
+uint32_t mem_read_32(sim_t *sim, uint32_t address)
 {
-	int i;
-	for (i = 0; i < NUM_MEM_REGION; i++)
+	tlb_entry_t *entry = &sim->TLB_READ[TLB_INDEX(address)];
+	if ((address & TLB_TAG_MASK(4)) == entry->tag)
 	{
-		uint32_t region_size = MEM_REGIONS[i].end - MEM_REGIONS[i].begin + 1;
-		MEM_REGIONS[i].mem = malloc(region_size);
-		memset(MEM_REGIONS[i].mem, 0, region_size);
+		return *(uint32_t *)(entry->host + (address & PAGE_OFFSET_MASK));
 	}
+	return mem_read_slow(sim, address, 4);
 }
 
-/**************************************************************/
-/* load program into memory                                                                                      */
-/**************************************************************/
-void load_program()
+/***************************************************************/
+/* Read a 16-bit halfword from memory                                                                      */
+/***************************************************************/
+uint16_t mem_read_16(sim_t *sim, uint32_t address)
 {
-	FILE *fp;
-	int i, word;
-	uint32_t address;
-	/* Open program file. */
-	fp = fopen(prog_file, "r");
-	if (fp == NULL)
+	tlb_entry_t *entry = &sim->TLB_READ[TLB_INDEX(address)];
+	if ((address & TLB_TAG_MASK(2)) == entry->tag)
 	{
-		printf("Error: Can't open program file %s\n", prog_file);
-		exit(-1);
+		return *(uint16_t *)(entry->host + (address & PAGE_OFFSET_MASK));
 	}
+	return mem_read_slow(sim, address, 2);
+}
 
-	/* Read in the program. */
-
-	i = 0;
-	while (fscanf(fp, "%x\n", &word) != EOF)
+/***************************************************************/
+/* Read a byte from memory                                                                                          */
+/***************************************************************/
+uint8_t mem_read_8(sim_t *sim, uint32_t address)
+{
+	tlb_entry_t *entry = &sim->TLB_READ[TLB_INDEX(address)];
+	if ((address & TLB_TAG_MASK(1)) == entry->tag)
 	{
-		address = MEM_TEXT_BEGIN + i;
-		mem_write_32(address, word);
-		printf("writing 0x%08x into address 0x%08x (%d)\n", word, address, address);
-		i += 4;
+		return entry->host[address & PAGE_OFFSET_MASK];
 	}
-	PROGRAM_SIZE = i / 4;
-	printf("Program loaded into memory.\n%d words written into memory.\n\n", PROGRAM_SIZE);
-	fclose(fp);
+	return mem_read_slow(sim, address, 1);
 }
 
-// Convert 2's Complement to decimal
-int twosToDecimal(uint32_t num, uint32_t bits)
+/***************************************************************/
+/* Write a 32-bit word to memory                                                                                */
+/***************************************************************/
+void mem_write_32(sim_t *sim, uint32_t address, uint32_t value)
 {
-	if (num >> (bits - 1) == 1)
+	tlb_entry_t *entry = &sim->TLB_WRITE[TLB_INDEX(address)];
+	if ((address & TLB_TAG_MASK(4)) == entry->tag)
 	{
-		num -= pow(2, bits - 1);
-		num = -num;
+		*(uint32_t *)(entry->host + (address & PAGE_OFFSET_MASK)) = value;
+		return;
 	}
-
-	return num;
+	mem_write_slow(sim, address, value, 4);
 }
 
-void R_Processing(uint32_t rd, uint32_t f3, uint32_t rs1, uint32_t rs2, uint32_t f7)
+/***************************************************************/
+/* Write a 16-bit halfword to memory                                                                         */
+/***************************************************************/
+void mem_write_16(sim_t *sim, uint32_t address, uint16_t value)
 {
-	switch (f3)
+	tlb_entry_t *entry = &sim->TLB_WRITE[TLB_INDEX(address)];
+	if ((address & TLB_TAG_MASK(2)) == entry->tag)
 	{
-	case 0:
-		switch (f7)
-		{
-		case 0: // add
-			NEXT_STATE.REGS[rd] = NEXT_STATE.REGS[rs1] + NEXT_STATE.REGS[rs2];
-			break;
-		case 32: // sub
-			NEXT_STATE.REGS[rd] = NEXT_STATE.REGS[rs1] - NEXT_STATE.REGS[rs2];
-			break;
-		default:
-			RUN_FLAG = FALSE;
-			break;
-		}
-		break;
-	case 6: // or
-		NEXT_STATE.REGS[rd] = (NEXT_STATE.REGS[rs1] | NEXT_STATE.REGS[rs2]);
-		break;
-	case 7: // and
-		NEXT_STATE.REGS[rd] = (NEXT_STATE.REGS[rs1] & NEXT_STATE.REGS[rs2]);
-		break;
-	default:
-		RUN_FLAG = FALSE;
-		break;
+		*(uint16_t *)(entry->host + (address & PAGE_OFFSET_MASK)) = value;
+		return;
 	}
+	mem_write_slow(sim, address, value, 2);
 }
 
-void ILoad_Processing(uint32_t rd, uint32_t f3, uint32_t rs1, uint32_t imm)
+/***************************************************************/
+/* Write a byte to memory                                                                                             */
+/***************************************************************/
+void mem_write_8(sim_t *sim, uint32_t address, uint8_t value)
 {
-	switch (f3)
+	tlb_entry_t *entry = &sim->TLB_WRITE[TLB_INDEX(address)];
+	if ((address & TLB_TAG_MASK(1)) == entry->tag)
 	{
-	case 0: // lb
-		NEXT_STATE.REGS[rd] = byte_to_word((mem_read_32(NEXT_STATE.REGS[rs1] + imm)) & 0xFF);
-		break;
-
-	case 1: // lh
-		NEXT_STATE.REGS[rd] = half_to_word((mem_read_32(NEXT_STATE.REGS[rs1] + imm)) & 0xFFFF);
-		break;
-
-	case 2: // lw
-		NEXT_STATE.REGS[rd] = mem_read_32(NEXT_STATE.REGS[rs1] + imm);
-		break;
-
-	default:
-		printf("Invalid instruction");
-		RUN_FLAG = FALSE;
-		break;
+		entry->host[address & PAGE_OFFSET_MASK] = value;
+		return;
 	}
+	mem_write_slow(sim, address, value, 1);
 }
 
-void Iimm_Processing(uint32_t rd, uint32_t f3, uint32_t rs1, uint32_t imm)
+/***************************************************************/
+/* Find the decoded slots for a guest page, NULL if it was never executed  */
+/***************************************************************/
+decoded_insn_t *decode_page_lookup(sim_t *sim, uint32_t address)
 {
-	uint32_t imm0_4 = (imm << 7) >> 7;
-	uint32_t imm5_11 = imm >> 5;
-	switch (f3)
+	decoded_insn_t **table = sim->DECODE_DIR[PAGE_DIR_INDEX(address)];
+	if (table == NULL)
 	{
-	case 0: // addi
-		NEXT_STATE.REGS[rd] = NEXT_STATE.REGS[rs1] + imm;
-		break;
-
-	case 4: // xori
-		NEXT_STATE.REGS[rd] = NEXT_STATE.REGS[rs1] ^ imm;
-		break;
+		return NULL;
+	}
+	return table[PAGE_TABLE_INDEX(address)];
+}
 
-	case 6: // ori
-		NEXT_STATE.REGS[rd] = NEXT_STATE.REGS[rs1] | imm;
-		break;
+/***************************************************************/
+/* Find or create the decode table covering a guest page                            */
+/***************************************************************/
+static decoded_insn_t **decode_table_get(sim_t *sim, uint32_t address)
+{
+	decoded_insn_t **table = sim->DECODE_DIR[PAGE_DIR_INDEX(address)];
+	if (table == NULL)
+	{
+		table = calloc(PAGE_TABLE_ENTRIES, sizeof(decoded_insn_t *));
+		if (table == NULL)
+		{
+			printf("Error: Out of memory allocating decode table\n");
+			exit(-1);
+		}
+		sim->DECODE_DIR[PAGE_DIR_INDEX(address)] = table;
+	}
+	return table;
+}
 
-	case 7: // andi
-		NEXT_STATE.REGS[rd] = NEXT_STATE.REGS[rs1] & imm;
-		break;
+/***************************************************************/
+/* Find or create the decoded slots for a guest page                                  */
+/***************************************************************/
+decoded_insn_t *decode_page_get(sim_t *sim, uint32_t address)
+{
+	decoded_insn_t **table = decode_table_get(sim, address);
+	if (table[PAGE_TABLE_INDEX(address)] == NULL)
+	{
+		table[PAGE_TABLE_INDEX(address)] = calloc(DECODE_PAGE_ENTRIES, sizeof(decoded_insn_t));
+		if (table[PAGE_TABLE_INDEX(address)] == NULL)
+		{
+			printf("Error: Out of memory allocating decode page for 0x%08x\n", address);
+			exit(-1);
+		}
 
-	case 1: // slli
-		NEXT_STATE.REGS[rd] = NEXT_STATE.REGS[rs1] << imm0_4;
-		break;
+		/* stores to this page must now go through mem_write_slow */
+		if (sim->TLB_WRITE[TLB_INDEX(address)].tag == (address & ~PAGE_OFFSET_MASK))
+		{
+			sim->TLB_WRITE[TLB_INDEX(address)].tag = TLB_INVALID;
+		}
+	}
+	return table[PAGE_TABLE_INDEX(address)];
+}
+
+/***************************************************************/
+/* Use the loaded image's decoded pages, which every simulation of the      */
+/* program shares, for its text. A store into one gets the simulation a     */
+/* private copy first (see decode_invalidate).                                              */
+/***************************************************************/
+void decode_share_image(sim_t *sim)
+{
+	const program_image_t *image = sim->MEMORY->IMAGE;
+	decoded_insn_t **table;
+	uint32_t i, address;
 
-	case 5: // srli and srai
-		switch (imm5_11)
+	for (i = 0; image != NULL && i < image->num_decoded; i++)
+	{
+		address = (image->decoded_first + i) << PAGE_SHIFT;
+		table = decode_table_get(sim, address);
+		if (!decode_page_shared(sim, table[PAGE_TABLE_INDEX(address)]))
 		{
-		case 0: // srli
-			NEXT_STATE.REGS[rd] = NEXT_STATE.REGS[rs1] >> imm0_4;
-			break;
+			free(table[PAGE_TABLE_INDEX(address)]);
+		}
+		table[PAGE_TABLE_INDEX(address)] = image->decoded + (size_t)i * DECODE_PAGE_ENTRIES;
 
-		case 32: // srai
-			NEXT_STATE.REGS[rd] = NEXT_STATE.REGS[rs1] >> imm0_4;
-			break;
+		/* stores to this page must now go through mem_write_slow */
+		if (sim->TLB_WRITE[TLB_INDEX(address)].tag == address)
+		{
+			sim->TLB_WRITE[TLB_INDEX(address)].tag = TLB_INVALID;
+		}
+	}
+	sim->DECODE_LAST_BASE = TLB_INVALID;
+	sim->DECODE_LAST_PAGE = NULL;
+}
 
-		default:
-			RUN_FLAG = FALSE;
+static decoded_insn_t *decode_page_private(sim_t *sim, uint32_t address, decoded_insn_t *page);
+
+/***************************************************************/
+/* Return the decoded form of the instruction at pc, decoding it on first use */
+/***************************************************************/
+const decoded_insn_t *fetch_decoded(sim_t *sim, uint32_t pc)
+{
+	decoded_insn_t *insn;
+
+	if (pc & 3)
+	{
+		/* slots are per word, so a misaligned pc is never cached */
+		decode_instruction(mem_read_32(sim, pc), &sim->UNALIGNED_INSN);
+		return &sim->UNALIGNED_INSN;
+	}
+
+	if ((pc & ~PAGE_OFFSET_MASK) != sim->DECODE_LAST_BASE)
+	{
+		sim->DECODE_LAST_PAGE = decode_page_get(sim, pc);
+		sim->DECODE_LAST_BASE = pc & ~PAGE_OFFSET_MASK;
+	}
+
+	insn = &sim->DECODE_LAST_PAGE[DECODE_INDEX(pc)];
+	if (insn->handler == NULL)
+	{
+		/* the image only decoded the program's own words */
+		sim->DECODE_LAST_PAGE = decode_page_private(sim, pc, sim->DECODE_LAST_PAGE);
+		sim->DECODE_LAST_BASE = pc & ~PAGE_OFFSET_MASK;
+		insn = &sim->DECODE_LAST_PAGE[DECODE_INDEX(pc)];
+		decode_instruction(mem_read_32(sim, pc), insn);
+	}
+	return insn;
+}
+
+/***************************************************************/
+/* A decoded page this simulation may write: page itself, or a private copy */
+/* of it if it is shared with the other simulations of the program              */
+/***************************************************************/
+static decoded_insn_t *decode_page_private(sim_t *sim, uint32_t address, decoded_insn_t *page)
+{
+	decoded_insn_t *copy;
+
+	if (!decode_page_shared(sim, page))
+	{
+		return page;
+	}
+	copy = malloc(DECODE_PAGE_ENTRIES * sizeof(decoded_insn_t));
+	if (copy == NULL)
+	{
+		printf("Error: Out of memory allocating decode page for 0x%08x\n", address);
+		exit(-1);
+	}
+	memcpy(copy, page, DECODE_PAGE_ENTRIES * sizeof(decoded_insn_t));
+	sim->DECODE_DIR[PAGE_DIR_INDEX(address)][PAGE_TABLE_INDEX(address)] = copy;
+	sim->DECODE_LAST_BASE = TLB_INVALID;
+	return copy;
+}
+
+/***************************************************************/
+/* Forget decoded slots overlapped by a store of width bytes at address       */
+/***************************************************************/
+void decode_invalidate(sim_t *sim, uint32_t address, int width)
+{
+	decoded_insn_t *page = decode_page_lookup(sim, address);
+	if (page != NULL && page[DECODE_INDEX(address)].handler != NULL)
+	{
+		page = decode_page_private(sim, address, page);
+		page[DECODE_INDEX(address)].handler = NULL;
+		sim->BLOCK_FLUSH_PENDING = TRUE;
+	}
+
+	address += width - 1;
+	page = decode_page_lookup(sim, address);
+	if (page != NULL && page[DECODE_INDEX(address)].handler != NULL)
+	{
+		page = decode_page_private(sim, address, page);
+		page[DECODE_INDEX(address)].handler = NULL;
+		sim->BLOCK_FLUSH_PENDING = TRUE;
+	}
+}
+
+/***************************************************************/
+/* Drop the decoded slots of one guest page whose contents were replaced */
+/***************************************************************/
+void decode_forget_page(sim_t *sim, uint32_t address)
+{
+	decoded_insn_t *page = decode_page_lookup(sim, address);
+	if (page == NULL)
+	{
+		return;
+	}
+	if (!decode_page_shared(sim, page))
+	{
+		free(page);
+	}
+	sim->DECODE_DIR[PAGE_DIR_INDEX(address)][PAGE_TABLE_INDEX(address)] = NULL;
+	sim->DECODE_LAST_BASE = TLB_INVALID;
+	sim->DECODE_LAST_PAGE = NULL;
+	block_flush(sim);
+}
+
+/***************************************************************/
+/* Drop every decoded page                                                                                  */
+/***************************************************************/
+void decode_flush(sim_t *sim)
+{
+	int i, j;
+	for (i = 0; i < PAGE_DIR_ENTRIES; i++)
+	{
+		if (sim->DECODE_DIR[i] == NULL)
+		{
+			continue;
+		}
+		for (j = 0; j < PAGE_TABLE_ENTRIES; j++)
+		{
+			if (!decode_page_shared(sim, sim->DECODE_DIR[i][j]))
+			{
+				free(sim->DECODE_DIR[i][j]);
+			}
+		}
+		free(sim->DECODE_DIR[i]);
+		sim->DECODE_DIR[i] = NULL;
+	}
+	sim->DECODE_LAST_BASE = TLB_INVALID;
+	sim->DECODE_LAST_PAGE = NULL;
+	block_flush(sim);
+}
+
+/***************************************************************/
+/* Does this instruction end a basic block?                                                      */
+/***************************************************************/
+int op_ends_block(uint8_t op)
+{
+	switch (op)
+	{
+	case OP_beq:
+	case OP_bne:
+	case OP_blt:
+	case OP_bge:
+	case OP_bltu:
+	case OP_bgeu:
+	case OP_jal:
+	case OP_jalr:
+	case OP_ecall:
+	case OP_fence_i:
+	case OP_invalid:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/***************************************************************/
+/* Decode the basic block starting at pc and add it to the cache             */
+/***************************************************************/
+block_t *block_build(sim_t *sim, uint32_t pc)
+{
+	decoded_insn_t insns[BLOCK_MAX_INSNS];
+	uint32_t len = 0;
+	uint32_t address = pc;
+	block_t *block;
+
+	do
+	{
+		insns[len] = *fetch_decoded(sim, address);
+		if (op_ends_block(insns[len++].op))
+		{
 			break;
 		}
-		break;
+		address += 4;
+	} while (len < BLOCK_MAX_INSNS && (address & PAGE_OFFSET_MASK) != 0 &&
+			 (address - sim->PROGRAM_BASE) / 4 <= sim->PROGRAM_SIZE);
 
-	case 2:
-		break;
+	block = malloc(sizeof(block_t) + len * sizeof(decoded_insn_t));
+	if (block == NULL)
+	{
+		printf("Error: Out of memory allocating block for 0x%08x\n", pc);
+		exit(-1);
+	}
+	block->start_pc = pc;
+	block->len = len;
+	block->exit[0] = NULL;
+	block->exit[1] = NULL;
+	block->exec_count = 0;
+	block->jit = NULL;
+	memcpy(block->insns, insns, len * sizeof(decoded_insn_t));
+
+	block->hash_next = sim->BLOCK_HASH_TABLE[BLOCK_HASH(pc)];
+	sim->BLOCK_HASH_TABLE[BLOCK_HASH(pc)] = block;
+	return block;
+}
 
-	case 3:
-		break;
+/***************************************************************/
+/* Return the cached block starting at pc, building it on first use            */
+/***************************************************************/
+block_t *block_lookup(sim_t *sim, uint32_t pc)
+{
+	block_t *block;
+	for (block = sim->BLOCK_HASH_TABLE[BLOCK_HASH(pc)]; block != NULL; block = block->hash_next)
+	{
+		if (block->start_pc == pc)
+		{
+			return block;
+		}
+	}
+	return block_build(sim, pc);
+}
+
+/***************************************************************/
+/* Drop every cached block, and with them every chain between blocks     */
+/***************************************************************/
+void block_flush(sim_t *sim)
+{
+	int i;
+	block_t *block, *next;
+	for (i = 0; i < BLOCK_HASH_SIZE; i++)
+	{
+		for (block = sim->BLOCK_HASH_TABLE[i]; block != NULL; block = next)
+		{
+			next = block->hash_next;
+			free(block);
+		}
+		sim->BLOCK_HASH_TABLE[i] = NULL;
+	}
+	sim->BLOCK_FLUSH_PENDING = FALSE;
+	jit_reset(sim);
+}
+
+/***************************************************************/
+/* run_budget() on the selected core                                                             */
+/***************************************************************/
+static run_result_t run_core(sim_t *sim, uint32_t budget)
+{
+	run_result_t result;
+
+	/* only the classic core sees every instruction by itself */
+	if (sim->ENGINE != ENGINE_CLASSIC && sim->TRACE == NULL && sim->CACHE == NULL)
+	{
+		return run_threaded(sim, budget);
+	}
+
+	result.reason = (sim->RUN_FLAG == FALSE) ? RUN_HALTED : RUN_BUDGET;
+	result.executed = 0;
+	result.pc = sim->CURRENT_STATE.PC;
+	sim->RUN_EXIT = RUN_BUDGET;
+	while (result.reason == RUN_BUDGET && result.executed < budget)
+	{
+		result.pc = sim->CURRENT_STATE.PC;
+		handle_instruction(sim);
+		result.reason = sim->RUN_EXIT;
+		if (sim->RUN_EXIT != RUN_ILLEGAL)
+		{
+			result.executed++;
+		}
+	}
+	if (result.reason == RUN_BUDGET)
+	{
+		result.pc = sim->CURRENT_STATE.PC;
+	}
+	sim->INSTRUCTION_COUNT += result.executed;
+	return result;
+}
+
+/***************************************************************/
+/* Execute up to budget instructions on the selected core. Leaves only on */
+/* an ecall, ebreak or illegal instruction, at the end of the program or   */
+/* when the budget runs out, and says which through the result.            */
+/***************************************************************/
+run_result_t run_budget(sim_t *sim, uint32_t budget)
+{
+	run_result_t result;
+	struct timespec start, stop;
+
+	if (!SIM_STATS || !sim->STATS_ON)
+	{
+		return run_core(sim, budget);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	result = run_core(sim, budget);
+	clock_gettime(CLOCK_MONOTONIC, &stop);
+	sim->STATS.nanoseconds += (stop.tv_sec - start.tv_sec) * 1000000000LL + (stop.tv_nsec - start.tv_nsec);
+	return result;
+}
 
+/***************************************************************/
+/* Report or service whatever stopped run_budget(). Returns TRUE if the   */
+/* simulation can go on by itself.                                                   */
+/***************************************************************/
+int handle_run_exit(sim_t *sim, run_result_t result)
+{
+	switch (result.reason)
+	{
+	case RUN_ECALL:
+		SYSCALL_Processing(sim, sim->CURRENT_STATE.REGS[17]);
+		return sim->RUN_FLAG;
+	case RUN_BREAKPOINT:
+		sim_log("Breakpoint at 0x%08x.\n\n", result.pc);
+		return FALSE;
+	case RUN_ILLEGAL:
+		sim_log("Invalid instruction at 0x%08x.\n\n", result.pc);
+		sim->RUN_FLAG = FALSE;
+		return FALSE;
+	case RUN_HALTED:
+		SYSCALL_Processing(sim, 10);
+		return FALSE;
 	default:
-		printf("Invalid instruction");
-		RUN_FLAG = FALSE;
-		break;
+		return TRUE;
+	}
+}
+
+/***************************************************************/
+/* Simulate RISCV for n cycles                                                                                       */
+/***************************************************************/
+void run(sim_t *sim, int num_cycles)
+{
+	run_result_t result;
+	uint32_t remaining;
+
+	if (num_cycles <= 0)
+	{
+		printf("Invalid number of instructions.\n");
+		return;
+	}
+	remaining = num_cycles;
+	if (!harts_running(sim))
+	{
+		sim_log("Simulation Stopped\n\n");
+		return;
+	}
+
+	sim_log("Running simulator for %d cycles...\n\n", num_cycles);
+	if (sim->NUM_HARTS > 1)
+	{
+		/* every hart runs num_cycles instructions */
+		result = harts_run(sim, num_cycles);
+		if (result.reason != RUN_BUDGET && !harts_running(sim))
+		{
+			sim_log("Simulation Stopped.\n\n");
+		}
+		return;
+	}
+	while (remaining > 0)
+	{
+		result = run_budget(sim, remaining);
+		remaining -= result.executed;
+		if (!handle_run_exit(sim, result))
+		{
+			break;
+		}
+	}
+	if (remaining > 0 && sim->RUN_FLAG == FALSE)
+	{
+		sim_log("Simulation Stopped.\n\n");
+	}
+}
+
+/**************************************************************rdump*/
+/* simulate to completion                                                                                               */
+/***************************************************************/
+void runAll(sim_t *sim)
+{
+	if (!harts_running(sim))
+	{
+		sim_log("Simulation Stopped.\n\n");
+		return;
+	}
+
+	sim_log("Simulation Started...\n\n");
+	if (sim->NUM_HARTS > 1)
+	{
+		harts_run(sim, UINT64_MAX);
+	}
+	else
+	{
+		while (handle_run_exit(sim, run_budget(sim, UINT32_MAX)))
+		{
+		}
+	}
+	if (!harts_running(sim))
+	{
+		sim_log("Simulation Finished.\n\n");
+	}
+}
+
+/***************************************************************/
+/* Dump a word-aligned region of memory to the terminal                              */
+/***************************************************************/
+void mdump(sim_t *sim, uint32_t start, uint32_t stop)
+{
+	uint32_t address;
+
+	printf("-------------------------------------------------------------\n");
+	printf("Memory content [0x%08x..0x%08x] :\n", start, stop);
+	printf("-------------------------------------------------------------\n");
+	printf("\t[Address in Hex (Dec) ]\t[Value]\n");
+	for (address = start; address <= stop; address += 4)
+	{
+		printf("\t0x%08x (%d) :\t0x%08x\n", address, address, mem_read_32(sim, address));
+	}
+	printf("\n");
+}
+
+/***************************************************************/
+/* Dump current values of registers to the teminal                                              */
+/***************************************************************/
+void rdump(sim_t *sim)
+{
+	int i;
+	printf("-------------------------------------\n");
+	printf("Dumping Register Content\n");
+	printf("-------------------------------------\n");
+	if (sim->HART_ID != 0 || sim->NUM_HARTS > 1)
+	{
+		printf("Hart\t: %u\n", sim->HART_ID);
+	}
+	printf("# Instructions Executed\t: %llu\n", (unsigned long long)sim->INSTRUCTION_COUNT);
+	printf("PC\t: 0x%08x\n", sim->CURRENT_STATE.PC);
+	printf("-------------------------------------\n");
+	printf("[Register]\t[Value]\n");
+	printf("-------------------------------------\n");
+	for (i = 0; i < RISCV_REGS; i++)
+	{
+		printf("[R%d]\t: 0x%08x\n", i, sim->CURRENT_STATE.REGS[i]);
+	}
+	printf("-------------------------------------\n");
+	printf("[HI]\t: 0x%08x\n", sim->CURRENT_STATE.HI);
+	printf("[LO]\t: 0x%08x\n", sim->CURRENT_STATE.LO);
+	printf("-------------------------------------\n");
+	for (i = 1; i < sim->NUM_HARTS && sim->HARTS[i] != NULL; i++)
+	{
+		rdump(sim->HARTS[i]);
+	}
+}
+
+/***************************************************************/
+/* The stats command: switch counting on or off, zero it or show it            */
+/***************************************************************/
+static void execute_stats(sim_t *sim, const char *what)
+{
+	if (strcmp(what, "on") == 0 || strcmp(what, "off") == 0)
+	{
+		if (!SIM_STATS)
+		{
+			printf("Statistics are not built into this simulator.\n");
+			return;
+		}
+		sim->STATS_ON = (what[1] == 'n');
+		sim_log("Statistics %s.\n\n", sim->STATS_ON ? "on" : "off");
+	}
+	else if (strcmp(what, "reset") == 0)
+	{
+		stats_clear(sim);
+	}
+	else if (strcmp(what, "print") == 0)
+	{
+		stats_print(sim);
+	}
+	else if (strcmp(what, "json") == 0)
+	{
+		stats_json(sim, stdout);
+		printf("\n");
+	}
+	else
+	{
+		printf("Invalid stats command.\n");
+	}
+}
+
+/***************************************************************/
+/* The profile command: switch the profiler on or off, zero it, show the  */
+/* n hottest instructions and blocks, or write collapsed call stacks           */
+/***************************************************************/
+static void execute_profile(sim_t *sim, FILE *in)
+{
+	char what[20];
+	char path[256];
+	uint32_t top;
+
+	if (fscanf(in, "%19s", what) != 1)
+	{
+		return;
+	}
+	if (strcmp(what, "on") == 0)
+	{
+		if (profile_start(sim))
+		{
+			sim_log("Profiler on.\n\n");
+		}
+	}
+	else if (strcmp(what, "off") == 0)
+	{
+		profile_stop(sim);
+		sim_log("Profiler off.\n\n");
+	}
+	else if (strcmp(what, "reset") == 0)
+	{
+		profile_clear(sim);
+	}
+	else if (strcmp(what, "top") == 0)
+	{
+		if (fscanf(in, "%u", &top) != 1)
+		{
+			return;
+		}
+		profile_print(sim, top);
+	}
+	else if (strcmp(what, "flame") == 0)
+	{
+		if (fscanf(in, "%255s", path) != 1)
+		{
+			return;
+		}
+		if (profile_collapsed(sim, path))
+		{
+			sim_log("Call stacks written to %s.\n\n", path);
+		}
+	}
+	else
+	{
+		printf("Invalid profile command.\n");
+	}
+}
+
+/***************************************************************/
+/* The cache command: switch the model on or off, empty it, show it, or   */
+/* configure a level or the memory behind them                                         */
+/***************************************************************/
+static void execute_cache(sim_t *sim, FILE *in)
+{
+	char what[20], policy[8], write[8];
+	cache_config_t config;
+	uint32_t level, latency;
+
+	if (fscanf(in, "%19s", what) != 1)
+	{
+		return;
+	}
+	if (strcmp(what, "on") == 0)
+	{
+		if (cache_start(sim))
+		{
+			sim_log("Cache model on.\n\n");
+		}
+	}
+	else if (strcmp(what, "off") == 0)
+	{
+		cache_stop(sim);
+		sim_log("Cache model off.\n\n");
+	}
+	else if (strcmp(what, "reset") == 0)
+	{
+		cache_clear(sim);
+	}
+	else if (strcmp(what, "print") == 0)
+	{
+		cache_print(sim);
+	}
+	else if (strcmp(what, "json") == 0)
+	{
+		if (sim->CACHE == NULL)
+		{
+			printf("The cache model is off.\n");
+			return;
+		}
+		cache_json(sim, stdout);
+		printf("\n");
+	}
+	else if (strcmp(what, "memory") == 0)
+	{
+		if (fscanf(in, "%u", &latency) != 1)
+		{
+			return;
+		}
+		sim->CACHE_MEMORY_LATENCY = latency;
+		if (sim->CACHE != NULL)
+		{
+			sim->CACHE->memory_latency = latency;
+		}
+	}
+	else
+	{
+		for (level = 0; level < CACHE_LEVELS; level++)
+		{
+			if (strcmp(what, (level == CACHE_L1I) ? "l1i" : (level == CACHE_L1D) ? "l1d" : "l2") == 0)
+			{
+				break;
+			}
+		}
+		if (level == CACHE_LEVELS)
+		{
+			printf("Invalid cache command.\n");
+			return;
+		}
+		if (fscanf(in, "%u %u %u %7s %7s %u", &config.size, &config.ways, &config.line, policy, write,
+				   &config.latency) != 6)
+		{
+			return;
+		}
+		if ((strcmp(policy, "lru") != 0 && strcmp(policy, "plru") != 0) ||
+			(strcmp(write, "wb") != 0 && strcmp(write, "wt") != 0))
+		{
+			printf("Invalid cache policy.\n");
+			return;
+		}
+		config.policy = (policy[0] == 'l') ? CACHE_LRU : CACHE_PLRU;
+		config.write_back = (write[1] == 'b');
+		if (cache_configure(sim, level, &config) && sim->CACHE != NULL)
+		{
+			sim_log("Cache model restarted cold.\n\n");
+		}
+	}
+}
+
+/***************************************************************/
+/* The branch command: switch the predictors on or off, empty them, show  */
+/* the n most mispredicted transfers, or select the model and sizes         */
+/***************************************************************/
+static void execute_branch(sim_t *sim, FILE *in)
+{
+	static const char *const models[] = { "static", "bimodal", "gshare", "tage" };
+	char what[20];
+	bpred_config_t config;
+	uint32_t top, model;
+
+	if (fscanf(in, "%19s", what) != 1)
+	{
+		return;
+	}
+	if (strcmp(what, "on") == 0)
+	{
+		if (bpred_start(sim))
+		{
+			sim_log("Branch predictors on.\n\n");
+		}
+	}
+	else if (strcmp(what, "off") == 0)
+	{
+		bpred_stop(sim);
+		sim_log("Branch predictors off.\n\n");
+	}
+	else if (strcmp(what, "reset") == 0)
+	{
+		bpred_clear(sim);
+	}
+	else if (strcmp(what, "top") == 0)
+	{
+		if (fscanf(in, "%u", &top) != 1)
+		{
+			return;
+		}
+		bpred_print(sim, top);
+	}
+	else if (strcmp(what, "json") == 0)
+	{
+		if (sim->BPRED == NULL)
+		{
+			printf("The branch predictors are off.\n");
+			return;
+		}
+		bpred_json(sim, stdout, BPRED_TOP);
+		printf("\n");
+	}
+	else
+	{
+		for (model = BPRED_STATIC; model <= BPRED_TAGE; model++)
+		{
+			if (strcmp(what, models[model]) == 0)
+			{
+				break;
+			}
+		}
+		if (model > BPRED_TAGE)
+		{
+			printf("Invalid branch command.\n");
+			return;
+		}
+		if (fscanf(in, "%u %u %u %u", &config.table_bits, &config.history_bits, &config.btb_bits,
+				   &config.ras_depth) != 4)
+		{
+			return;
+		}
+		config.model = model;
+		if (bpred_configure(sim, &config) && sim->BPRED != NULL)
+		{
+			sim_log("Branch predictors restarted cold.\n\n");
+		}
+	}
+}
+
+/***************************************************************/
+/* Read one command from in and carry it out. Returns FALSE at the end of */
+/* the input or on quit.                                                                                */
+/***************************************************************/
+int execute_command(sim_t *sim, FILE *in)
+{
+	char buffer[20];
+	char path[256];
+	uint32_t start, stop, cycles;
+	uint32_t register_no;
+	int register_value;
+	int hi_reg_value, lo_reg_value;
+
+	if (fscanf(in, "%19s", buffer) != 1)
+	{
+		return FALSE;
+	}
+
+	switch (buffer[0])
+	{
+	case 'S':
+	case 's':
+		if (buffer[1] == 'a' || buffer[1] == 'A')
+		{
+			if (fscanf(in, "%255s", path) != 1)
+			{
+				break;
+			}
+			checkpoint_save(sim, path);
+			break;
+		}
+		if (buffer[1] == 't' || buffer[1] == 'T')
+		{
+			if (fscanf(in, "%19s", buffer) != 1)
+			{
+				break;
+			}
+			execute_stats(sim, buffer);
+			break;
+		}
+		runAll(sim);
+		break;
+	case 'M':
+	case 'm':
+		if (fscanf(in, "%x %x", &start, &stop) != 2)
+		{
+			break;
+		}
+		mdump(sim, start, stop);
+		break;
+	case 'C':
+	case 'c':
+		execute_cache(sim, in);
+		break;
+	case 'B':
+	case 'b':
+		execute_branch(sim, in);
+		break;
+	case '?':
+		help();
+		break;
+	case 'Q':
+	case 'q':
+		sim_log("**************************\n");
+		sim_log("Exiting MU-RISCV! Good Bye...\n");
+		sim_log("**************************\n");
+		return FALSE;
+	case 'R':
+	case 'r':
+		if (buffer[1] == 'd' || buffer[1] == 'D')
+		{
+			rdump(sim);
+		}
+		else if ((buffer[1] == 'e' || buffer[1] == 'E') && (buffer[3] == 't' || buffer[3] == 'T'))
+		{
+			if (fscanf(in, "%255s", path) != 1)
+			{
+				break;
+			}
+			checkpoint_restore(sim, path);
+		}
+		else if (buffer[1] == 'e' || buffer[1] == 'E')
+		{
+			reset(sim);
+		}
+		else
+		{
+			if (fscanf(in, "%d", &cycles) != 1)
+			{
+				break;
+			}
+			run(sim, cycles);
+		}
+		break;
+	case 'I':
+	case 'i':
+		if (fscanf(in, "%u %i", &register_no, &register_value) != 2)
+		{
+			break;
+		}
+		if (register_no == 0 || register_no >= RISCV_REGS)
+		{
+			printf("Invalid register.\n");
+			break;
+		}
+		sim->CURRENT_STATE.REGS[register_no] = register_value;
+		break;
+	case 'H':
+	case 'h':
+		if (fscanf(in, "%i", &hi_reg_value) != 1)
+		{
+			break;
+		}
+		sim->CURRENT_STATE.HI = hi_reg_value;
+		break;
+	case 'L':
+	case 'l':
+		if (fscanf(in, "%i", &lo_reg_value) != 1)
+		{
+			break;
+		}
+		sim->CURRENT_STATE.LO = lo_reg_value;
+		break;
+	case 'P':
+	case 'p':
+		if (buffer[2] == 'o' || buffer[2] == 'O')
+		{
+			execute_profile(sim, in);
+			break;
+		}
+		print_program(sim);
+		break;
+	case 'T':
+	case 't':
+		if (fscanf(in, "%255s", path) != 1)
+		{
+			break;
+		}
+		if (strcmp(path, "off") == 0)
+		{
+			trace_close(sim);
+		}
+		else
+		{
+			trace_open(sim, path);
+		}
+		break;
+	case 'E':
+	case 'e':
+		if (fscanf(in, "%19s", buffer) != 1)
+		{
+			break;
+		}
+		if (buffer[0] == 'c' || buffer[0] == 'C')
+		{
+			sim->ENGINE = ENGINE_CLASSIC;
+			sim_log("Using classic interpreter.\n\n");
+		}
+		else if (buffer[0] == 't' || buffer[0] == 'T')
+		{
+			sim->ENGINE = ENGINE_THREADED;
+			sim_log("Using threaded interpreter.\n\n");
+		}
+		else if ((buffer[0] == 'j' || buffer[0] == 'J') && jit_available())
+		{
+			sim->ENGINE = ENGINE_JIT;
+			sim_log("Using threaded interpreter with x86-64 JIT.\n\n");
+		}
+		else if (buffer[0] == 'j' || buffer[0] == 'J')
+		{
+			printf("JIT is not available on this host.\n");
+			break;
+		}
+		else
+		{
+			printf("Invalid engine.\n");
+			break;
+		}
+		/* drop translations made under the previous engine */
+		block_flush(sim);
+		break;
+	default:
+		printf("Invalid Command.\n");
+		break;
+	}
+	return TRUE;
+}
+
+/***************************************************************/
+/* Prompt for a command and carry it out; exits the simulator on quit or  */
+/* at the end of standard input.                                                                */
+/***************************************************************/
+void handle_command(sim_t *sim)
+{
+	printf("MU-RISCV SIM:> ");
+	if (!execute_command(sim, stdin))
+	{
+		trace_close(sim);
+		exit(0);
+	}
+}
+
+/***************************************************************/
+/* reset registers/memory and reload program                                                    */
+/***************************************************************/
+void reset(sim_t *sim)
+{
+	uint32_t restored = sim->NUM_DIRTY_PAGES;
+
+	/*registers and PC as the loader left them*/
+	sim->CURRENT_STATE = sim->PRISTINE_STATE;
+
+	/*restore only the pages the program wrote*/
+	mem_restore_dirty(sim);
+
+	sim->INSTRUCTION_COUNT = 0;
+	sim->RUN_FLAG = TRUE;
+	sim->RESERVATION = TLB_INVALID;
+	memset(&sim->STATS, 0, sizeof(sim->STATS));
+	profile_clear(sim);
+	cache_clear(sim);
+	bpred_clear(sim);
+	harts_start(sim);
+	sim_log("Simulator reset, %d pages restored.\n\n", restored);
+}
+
+/***************************************************************/
+/* Start with an empty page table; pages are allocated on first write      */
+/***************************************************************/
+void init_memory(sim_t *sim)
+{
+	memset(sim->PAGE_DIR, 0, sizeof(sim->PAGE_DIR));
+	memset(ZERO_PAGE, 0, sizeof(ZERO_PAGE));
+	sim->PAGES_ALLOCATED = 0;
+	tlb_flush(sim);
+	memset(sim->DECODE_DIR, 0, sizeof(sim->DECODE_DIR));
+	sim->DECODE_LAST_BASE = TLB_INVALID;
+	sim->DECODE_LAST_PAGE = NULL;
+}
+
+/***************************************************************/
+/* Drop every guest page so memory reads as zero, marking each dirty so   */
+/* that reset() brings back what the loader put there                          */
+/***************************************************************/
+void mem_discard_pages(sim_t *sim)
+{
+	int i, j;
+	uint8_t *page;
+
+	for (i = 0; i < PAGE_DIR_ENTRIES; i++)
+	{
+		if (sim->PAGE_DIR[i] == NULL)
+		{
+			continue;
+		}
+		for (j = 0; j < PAGE_TABLE_ENTRIES; j++)
+		{
+			page = sim->PAGE_DIR[i][j];
+			if (page == NULL)
+			{
+				continue;
+			}
+			mem_mark_dirty(sim, ((uint32_t)i << (PAGE_SHIFT + PAGE_TABLE_BITS)) | ((uint32_t)j << PAGE_SHIFT));
+			if (!image_owns_page(sim, page) && !checkpoint_owns_page(sim, page))
+			{
+				page_release(sim, page);
+			}
+		}
+		free(sim->PAGE_DIR[i]);
+		sim->PAGE_DIR[i] = NULL;
+	}
+	sim->PAGES_ALLOCATED = 0;
+	tlb_flush(sim);
+}
+
+/***************************************************************/
+/* Free every allocated page so memory reads as zero again                      */
+/***************************************************************/
+void free_memory(sim_t *sim)
+{
+	int i, j;
+
+	harts_stop(sim);
+	trace_close(sim);
+	profile_stop(sim);
+	cache_stop(sim);
+	bpred_stop(sim);
+	mem_discard_pages(sim);
+	for (i = 0; i < PAGE_DIR_ENTRIES; i++)
+	{
+		if (sim->PRISTINE_DIR[i] == NULL)
+		{
+			continue;
+		}
+		for (j = 0; j < PAGE_TABLE_ENTRIES; j++)
+		{
+			if (!image_owns_page(sim, sim->PRISTINE_DIR[i][j]))
+			{
+				page_release(sim, (uint8_t *)sim->PRISTINE_DIR[i][j]);
+			}
+		}
+		free(sim->PRISTINE_DIR[i]);
+		sim->PRISTINE_DIR[i] = NULL;
+	}
+	for (i = 0; i < sim->NUM_DIRTY_PAGES; i++)
+	{
+		sim->DIRTY_BITMAP[sim->DIRTY_PAGES[i] >> 3] = 0;
+	}
+	sim->NUM_DIRTY_PAGES = 0;
+	decode_flush(sim);
+	image_unload(sim);
+	checkpoint_unload(sim);
+}
+
+/**************************************************************/
+/* load program into memory; FALSE, with LOAD_ERROR set, if it can't be   */
+/**************************************************************/
+int load_program(sim_t *sim)
+{
+	if (!image_load(sim))
+	{
+		return FALSE;
+	}
+
+	/* this is what reset() goes back to */
+	mem_save_pristine(sim);
+	sim->PRISTINE_STATE = sim->CURRENT_STATE;
+	harts_start(sim);
+	return TRUE;
+}
+
+/************************************************************/
+/* Instruction handlers, one per decoded instruction                                        */
+/************************************************************/
+void exec_nop(sim_t *sim, const decoded_insn_t *insn)
+{
+}
+
+void exec_invalid(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->NEXT_PC = sim->CURRENT_STATE.PC;
+	sim->RUN_EXIT = RUN_ILLEGAL;
+}
+
+void exec_ecall(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->RUN_EXIT = (insn->imm == FUNCT12_EBREAK) ? RUN_BREAKPOINT : RUN_ECALL;
+}
+
+void exec_add(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = sim->CURRENT_STATE.REGS[insn->rs1] + sim->CURRENT_STATE.REGS[insn->rs2];
+}
+
+void exec_sub(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = sim->CURRENT_STATE.REGS[insn->rs1] - sim->CURRENT_STATE.REGS[insn->rs2];
+}
+
+void exec_or(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = sim->CURRENT_STATE.REGS[insn->rs1] | sim->CURRENT_STATE.REGS[insn->rs2];
+}
+
+void exec_and(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = sim->CURRENT_STATE.REGS[insn->rs1] & sim->CURRENT_STATE.REGS[insn->rs2];
+}
+
+void exec_xor(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = sim->CURRENT_STATE.REGS[insn->rs1] ^ sim->CURRENT_STATE.REGS[insn->rs2];
+}
+
+void exec_sll(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = sim->CURRENT_STATE.REGS[insn->rs1] << (sim->CURRENT_STATE.REGS[insn->rs2] & 0x1F);
+}
+
+void exec_srl(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = sim->CURRENT_STATE.REGS[insn->rs1] >> (sim->CURRENT_STATE.REGS[insn->rs2] & 0x1F);
+}
+
+void exec_sra(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = (int32_t)sim->CURRENT_STATE.REGS[insn->rs1] >> (sim->CURRENT_STATE.REGS[insn->rs2] & 0x1F);
+}
+
+void exec_slt(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = (int32_t)sim->CURRENT_STATE.REGS[insn->rs1] < (int32_t)sim->CURRENT_STATE.REGS[insn->rs2];
+}
+
+void exec_sltu(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = sim->CURRENT_STATE.REGS[insn->rs1] < sim->CURRENT_STATE.REGS[insn->rs2];
+}
+
+void exec_lb(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = byte_to_word(mem_read_8(sim, sim->CURRENT_STATE.REGS[insn->rs1] + insn->imm));
+}
+
+void exec_lh(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = half_to_word(mem_read_16(sim, sim->CURRENT_STATE.REGS[insn->rs1] + insn->imm));
+}
+
+void exec_lw(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = mem_read_32(sim, sim->CURRENT_STATE.REGS[insn->rs1] + insn->imm);
+}
+
+void exec_lbu(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = mem_read_8(sim, sim->CURRENT_STATE.REGS[insn->rs1] + insn->imm);
+}
+
+void exec_lhu(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = mem_read_16(sim, sim->CURRENT_STATE.REGS[insn->rs1] + insn->imm);
+}
+
+void exec_addi(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = sim->CURRENT_STATE.REGS[insn->rs1] + insn->imm;
+}
+
+void exec_slti(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = (int32_t)sim->CURRENT_STATE.REGS[insn->rs1] < (int32_t)insn->imm;
+}
+
+void exec_sltiu(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = sim->CURRENT_STATE.REGS[insn->rs1] < insn->imm;
+}
+
+void exec_xori(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = sim->CURRENT_STATE.REGS[insn->rs1] ^ insn->imm;
+}
+
+void exec_ori(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = sim->CURRENT_STATE.REGS[insn->rs1] | insn->imm;
+}
+
+void exec_andi(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = sim->CURRENT_STATE.REGS[insn->rs1] & insn->imm;
+}
+
+void exec_slli(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = sim->CURRENT_STATE.REGS[insn->rs1] << insn->imm;
+}
+
+void exec_srli(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = sim->CURRENT_STATE.REGS[insn->rs1] >> insn->imm;
+}
+
+void exec_srai(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = (int32_t)sim->CURRENT_STATE.REGS[insn->rs1] >> insn->imm;
+}
+
+void exec_jalr(sim_t *sim, const decoded_insn_t *insn)
+{
+	/* the target's low bit is dropped, not trapped on */
+	sim->NEXT_PC = (sim->CURRENT_STATE.REGS[insn->rs1] + insn->imm) & ~1u;
+	sim->CURRENT_STATE.REGS[insn->rd] = sim->CURRENT_STATE.PC + 4;
+}
+
+void exec_sb(sim_t *sim, const decoded_insn_t *insn)
+{
+	mem_write_8(sim, sim->CURRENT_STATE.REGS[insn->rs1] + insn->imm, sim->CURRENT_STATE.REGS[insn->rs2]);
+}
+
+void exec_sh(sim_t *sim, const decoded_insn_t *insn)
+{
+	mem_write_16(sim, sim->CURRENT_STATE.REGS[insn->rs1] + insn->imm, sim->CURRENT_STATE.REGS[insn->rs2]);
+}
+
+void exec_sw(sim_t *sim, const decoded_insn_t *insn)
+{
+	mem_write_32(sim, sim->CURRENT_STATE.REGS[insn->rs1] + insn->imm, sim->CURRENT_STATE.REGS[insn->rs2]);
+}
+
+void exec_beq(sim_t *sim, const decoded_insn_t *insn)
+{
+	if (sim->CURRENT_STATE.REGS[insn->rs1] == sim->CURRENT_STATE.REGS[insn->rs2])
+	{
+		sim->NEXT_PC = sim->CURRENT_STATE.PC + insn->imm;
+	}
+}
+
+void exec_bne(sim_t *sim, const decoded_insn_t *insn)
+{
+	if (sim->CURRENT_STATE.REGS[insn->rs1] != sim->CURRENT_STATE.REGS[insn->rs2])
+	{
+		sim->NEXT_PC = sim->CURRENT_STATE.PC + insn->imm;
+	}
+}
+
+void exec_blt(sim_t *sim, const decoded_insn_t *insn)
+{
+	if ((int32_t)sim->CURRENT_STATE.REGS[insn->rs1] < (int32_t)sim->CURRENT_STATE.REGS[insn->rs2])
+	{
+		sim->NEXT_PC = sim->CURRENT_STATE.PC + insn->imm;
+	}
+}
+
+void exec_bge(sim_t *sim, const decoded_insn_t *insn)
+{
+	if ((int32_t)sim->CURRENT_STATE.REGS[insn->rs1] >= (int32_t)sim->CURRENT_STATE.REGS[insn->rs2])
+	{
+		sim->NEXT_PC = sim->CURRENT_STATE.PC + insn->imm;
+	}
+}
+
+void exec_bltu(sim_t *sim, const decoded_insn_t *insn)
+{
+	if (sim->CURRENT_STATE.REGS[insn->rs1] < sim->CURRENT_STATE.REGS[insn->rs2])
+	{
+		sim->NEXT_PC = sim->CURRENT_STATE.PC + insn->imm;
+	}
+}
+
+void exec_bgeu(sim_t *sim, const decoded_insn_t *insn)
+{
+	if (sim->CURRENT_STATE.REGS[insn->rs1] >= sim->CURRENT_STATE.REGS[insn->rs2])
+	{
+		sim->NEXT_PC = sim->CURRENT_STATE.PC + insn->imm;
+	}
+}
+
+void exec_jal(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = sim->CURRENT_STATE.PC + 4;
+	sim->NEXT_PC = sim->CURRENT_STATE.PC + insn->imm;
+}
+
+void exec_lui(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = insn->imm;
+}
+
+void exec_auipc(sim_t *sim, const decoded_insn_t *insn)
+{
+	sim->CURRENT_STATE.REGS[insn->rd] = sim->CURRENT_STATE.PC + insn->imm;
+}
+
+void exec_fence(sim_t *sim, const decoded_insn_t *insn)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void exec_fence_i(sim_t *sim, const decoded_insn_t *insn)
+{
+	/* pick up code written by this hart's stores or by other harts */
+	decode_flush(sim);
+}
+
+/************************************************************/
+/* The host word an atomic works on. A misaligned address or one outside  */
+/* every region stops the hart like an invalid instruction and gives NULL. */
+/************************************************************/
+static uint32_t *amo_word(sim_t *sim, uint32_t address)
+{
+	tlb_entry_t *entry = &sim->TLB_WRITE[TLB_INDEX(address)];
+	uint8_t *page;
+
+	if ((address & TLB_TAG_MASK(4)) == entry->tag)
+	{
+		return (uint32_t *)(entry->host + (address & PAGE_OFFSET_MASK));
+	}
+	page = ((address & 3) == 0) ? mem_page_write(sim, address) : NULL;
+	if (page == NULL)
+	{
+		sim->NEXT_PC = sim->CURRENT_STATE.PC;
+		sim->RUN_EXIT = RUN_ILLEGAL;
+		return NULL;
+	}
+	if (decode_page_lookup(sim, address) != NULL)
+	{
+		/* same as a store to a code page */
+		decode_invalidate(sim, address, 4);
+	}
+	else
+	{
+		entry->tag = address & ~PAGE_OFFSET_MASK;
+		entry->host = page;
+	}
+	return (uint32_t *)(page + (address & PAGE_OFFSET_MASK));
+}
+
+void exec_lr_w(sim_t *sim, const decoded_insn_t *insn)
+{
+	uint32_t address = sim->CURRENT_STATE.REGS[insn->rs1];
+	uint32_t *word = amo_word(sim, address);
+
+	if (word != NULL)
+	{
+		sim->CURRENT_STATE.REGS[insn->rd] = __atomic_load_n(word, __ATOMIC_SEQ_CST);
+		sim->RESERVATION = address;
+		sim->RESERVED_VALUE = sim->CURRENT_STATE.REGS[insn->rd];
+	}
+}
+
+void exec_sc_w(sim_t *sim, const decoded_insn_t *insn)
+{
+	uint32_t address = sim->CURRENT_STATE.REGS[insn->rs1];
+	uint32_t *word = amo_word(sim, address);
+	uint32_t expected = sim->RESERVED_VALUE;
+
+	if (word != NULL)
+	{
+		/* 0 on success, 1 on failure */
+		sim->CURRENT_STATE.REGS[insn->rd] = !(sim->RESERVATION == address &&
+			__atomic_compare_exchange_n(word, &expected, sim->CURRENT_STATE.REGS[insn->rs2], FALSE,
+										__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST));
+		sim->RESERVATION = TLB_INVALID;
+	}
+}
+
+void exec_amoswap_w(sim_t *sim, const decoded_insn_t *insn)
+{
+	uint32_t *word = amo_word(sim, sim->CURRENT_STATE.REGS[insn->rs1]);
+	if (word != NULL)
+	{
+		sim->CURRENT_STATE.REGS[insn->rd] = __atomic_exchange_n(word, sim->CURRENT_STATE.REGS[insn->rs2], __ATOMIC_SEQ_CST);
 	}
 }
 
-void JALR_Processing(uint32_t rd, uint32_t f3, uint32_t rs1, uint32_t imm)
+void exec_amoadd_w(sim_t *sim, const decoded_insn_t *insn)
 {
-	switch (f3)
+	uint32_t *word = amo_word(sim, sim->CURRENT_STATE.REGS[insn->rs1]);
+	if (word != NULL)
 	{
-		case 0:	// JALR
-			NEXT_STATE.REGS[rd] = NEXT_STATE.PC + 4;
-			CURRENT_STATE.PC = NEXT_STATE.REGS[rs1] + imm - 4;
-			break;
-		default:
-			printf("Invalid instruction");
-			RUN_FLAG = FALSE;
-			break;
+		sim->CURRENT_STATE.REGS[insn->rd] = __atomic_fetch_add(word, sim->CURRENT_STATE.REGS[insn->rs2], __ATOMIC_SEQ_CST);
 	}
 }
 
-void S_Processing(uint32_t imm4, uint32_t f3, uint32_t rs1, uint32_t rs2, uint32_t imm11)
+void exec_amoxor_w(sim_t *sim, const decoded_insn_t *insn)
 {
-	// Recombine immediate
-	uint32_t imm = (imm11 << 5) + imm4;
-	imm = twosToDecimal(imm, 12);
-
-	switch (f3)
+	uint32_t *word = amo_word(sim, sim->CURRENT_STATE.REGS[insn->rs1]);
+	if (word != NULL)
 	{
-	case 0: // sb
-		mem_write_32((NEXT_STATE.REGS[rs1] + imm), NEXT_STATE.REGS[rs2]);
-		break;
-
-	case 1: // sh
-		mem_write_32((NEXT_STATE.REGS[rs1] + imm), NEXT_STATE.REGS[rs2]);
-		break;
+		sim->CURRENT_STATE.REGS[insn->rd] = __atomic_fetch_xor(word, sim->CURRENT_STATE.REGS[insn->rs2], __ATOMIC_SEQ_CST);
+	}
+}
 
-	case 2: // sw
-		mem_write_32((NEXT_STATE.REGS[rs1] + imm), NEXT_STATE.REGS[rs2]);
-		break;
+void exec_amoand_w(sim_t *sim, const decoded_insn_t *insn)
+{
+	uint32_t *word = amo_word(sim, sim->CURRENT_STATE.REGS[insn->rs1]);
+	if (word != NULL)
+	{
+		sim->CURRENT_STATE.REGS[insn->rd] = __atomic_fetch_and(word, sim->CURRENT_STATE.REGS[insn->rs2], __ATOMIC_SEQ_CST);
+	}
+}
 
-	default:
-		printf("Invalid instruction");
-		RUN_FLAG = FALSE;
-		break;
+void exec_amoor_w(sim_t *sim, const decoded_insn_t *insn)
+{
+	uint32_t *word = amo_word(sim, sim->CURRENT_STATE.REGS[insn->rs1]);
+	if (word != NULL)
+	{
+		sim->CURRENT_STATE.REGS[insn->rd] = __atomic_fetch_or(word, sim->CURRENT_STATE.REGS[insn->rs2], __ATOMIC_SEQ_CST);
 	}
 }
 
-void B_Processing(uint32_t imm4, uint32_t f3, uint32_t rs1, uint32_t rs2, uint32_t imm11)
+/************************************************************/
+/* amomin/amomax: the host has no such atomic, so retry a compare-and-swap */
+/************************************************************/
+static void amo_minmax(sim_t *sim, const decoded_insn_t *insn)
 {
-	// Recombine immediate
-	uint32_t imm = (imm11 << 5) + imm4;
-	imm = twosToDecimal(imm, 12);
+	uint32_t *word = amo_word(sim, sim->CURRENT_STATE.REGS[insn->rs1]);
+	uint32_t value = sim->CURRENT_STATE.REGS[insn->rs2];
+	uint32_t old, new;
 
-	// Modification of CURRENT_STATE and the subtraction of 4 handles potential complications
-	// of Program Counter increment instruction
-	switch (f3)
+	if (word == NULL)
 	{
-		case 0:	// beq
-			if (NEXT_STATE.REGS[rs1] == NEXT_STATE.REGS[rs2])
-			{
-				CURRENT_STATE.PC += imm - 4;
-			}
+		return;
+	}
+	old = __atomic_load_n(word, __ATOMIC_RELAXED);
+	do
+	{
+		switch (insn->op)
+		{
+		case OP_amomin_w:
+			new = ((int32_t)value < (int32_t)old) ? value : old;
 			break;
-		case 1:	// bne
-			if (NEXT_STATE.REGS[rs1] != NEXT_STATE.REGS[rs2])
-			{
-				CURRENT_STATE.PC += imm - 4;
-			}
+		case OP_amomax_w:
+			new = ((int32_t)value > (int32_t)old) ? value : old;
 			break;
-		case 4:	// blt
-			if (NEXT_STATE.REGS[rs1] < NEXT_STATE.REGS[rs2])
-			{
-				CURRENT_STATE.PC += imm - 4;
-			}
+		case OP_amominu_w:
+			new = (value < old) ? value : old;
 			break;
-		case 5:	// bge
-			if (NEXT_STATE.REGS[rs1] >= NEXT_STATE.REGS[rs2])
-			{
-				CURRENT_STATE.PC += imm - 4;
-			}
-			break;	
 		default:
-			RUN_FLAG = FALSE;
+			new = (value > old) ? value : old;
 			break;
-	}
+		}
+	} while (!__atomic_compare_exchange_n(word, &old, new, TRUE, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+	sim->CURRENT_STATE.REGS[insn->rd] = old;
 }
 
-void J_Processing(uint32_t rd, uint32_t imm)
+void exec_amomin_w(sim_t *sim, const decoded_insn_t *insn)
 {
-	NEXT_STATE.REGS[rd] = CURRENT_STATE.PC + 4;
-	CURRENT_STATE.PC += imm - 4;
+	amo_minmax(sim, insn);
 }
 
-void U_Processing(uint32_t rd, uint32_t imm)
+void exec_amomax_w(sim_t *sim, const decoded_insn_t *insn)
 {
-	// Move imm to fill word length
-	imm = imm << 12;
+	amo_minmax(sim, insn);
+}
 
-	// Place imm in rd
-	NEXT_STATE.REGS[rd] = imm;
+void exec_amominu_w(sim_t *sim, const decoded_insn_t *insn)
+{
+	amo_minmax(sim, insn);
 }
 
-void SYSCALL_Processing()
+void exec_amomaxu_w(sim_t *sim, const decoded_insn_t *insn)
 {
-	switch(CURRENT_STATE.REGS[2])
-	{
-		case 10:
-			printf("Terminating Execution of Program.\n\n");
-			RUN_FLAG = FALSE;
-		default:
-			break;
-	}
+	amo_minmax(sim, insn);
 }
 
+#define ISA_ENTRY(name, opcode, f3, f7, format) { opcode, f3, f7, FMT_##format, exec_##name, #name },
+const isa_entry_t ISA_TABLE[NUM_OPS] = { INSTRUCTION_LIST(ISA_ENTRY) };
+#undef ISA_ENTRY
+
 /************************************************************/
-/* decode and execute instruction                                                                     */
+/* Environment calls, numbered as in RARS; a0 carries the argument         */
 /************************************************************/
-void handle_instruction()
+void SYSCALL_Processing(sim_t *sim, uint32_t code)
 {
-	// Generate SYSCALL if end of program reached
-	if ((CURRENT_STATE.PC - MEM_TEXT_BEGIN) / 4 > PROGRAM_SIZE)
+	uint32_t a0 = sim->CURRENT_STATE.REGS[10];
+	uint8_t c;
+
+	switch(code)
 	{
-		CURRENT_STATE.REGS[2] = 10;
-		SYSCALL_Processing();
-		return;
+		case 1:	// print integer
+			fprintf(sim->OUTPUT, "%d", (int32_t)a0);
+			break;
+		case 4:	// print string, in one piece even if other harts print too
+			flockfile(sim->OUTPUT);
+			while ((c = mem_read_8(sim, a0++)) != 0)
+			{
+				putc_unlocked(c, sim->OUTPUT);
+			}
+			funlockfile(sim->OUTPUT);
+			break;
+		case 11:	// print character
+			fputc(a0 & 0xFF, sim->OUTPUT);
+			break;
+		case 10:
+		case 93:	// exit, as Linux numbers it
+			sim_log("Terminating Execution of Program.\n\n");
+			sim->RUN_FLAG = FALSE;
+		default:
+			break;
 	}
-
-	// Get instruction from address pointed to by PC
-	uint32_t instruction = mem_read_32(CURRENT_STATE.PC);
-
-	// Isolate instruction's opcode and match to format
-	uint32_t maskopcode = 0x7F;
-	uint32_t opcode = instruction & maskopcode;
-	// Separate variables, then use to call appropriate processing function
-	if (opcode == 51)
-	{ // R-type
-		uint32_t maskrd = 0xF80;
-		uint32_t rd = instruction & maskrd;
-		rd = rd >> 7;
-		uint32_t maskf3 = 0x7000;
-		uint32_t f3 = instruction & maskf3;
-		f3 = f3 >> 12;
-		uint32_t maskrs1 = 0xF8000;
-		uint32_t rs1 = instruction & maskrs1;
-		rs1 = rs1 >> 15;
-		uint32_t maskrs2 = 0x1F00000;
-		uint32_t rs2 = instruction & maskrs2;
-		rs2 = rs2 >> 20;
-		uint32_t maskf7 = 0xFE000000;
-		uint32_t f7 = instruction & maskf7;
-		f7 = f7 >> 25;
-		R_Processing(rd, f3, rs1, rs2, f7);
-	}
-	else if (opcode == 3)
-	{ // I-Type Loading
-		uint32_t maskrd = 0xF80;
-		uint32_t rd = instruction & maskrd;
-		rd = rd >> 7;
-		uint32_t maskf3 = 0x7000;
-		uint32_t f3 = instruction & maskf3;
-		f3 = f3 >> 12;
-		uint32_t maskrs1 = 0xF8000;
-		uint32_t rs1 = instruction & maskrs1;
-		rs1 = rs1 >> 15;
-		uint32_t maskimm = 0xFFF00000;
-		uint32_t imm = instruction & maskimm;
-		imm = imm >> 20;
-		imm = twosToDecimal(imm, 12);
-		ILoad_Processing(rd, f3, rs1, imm);
-	}
-	else if (opcode == 19)
-	{ // I-Type IMM
-		uint32_t maskrd = 0xF80;
-		uint32_t rd = instruction & maskrd;
-		rd = rd >> 7;
-		uint32_t maskf3 = 0x7000;
-		uint32_t f3 = instruction & maskf3;
-		f3 = f3 >> 12;
-		uint32_t maskrs1 = 0xF8000;
-		uint32_t rs1 = instruction & maskrs1;
-		rs1 = rs1 >> 15;
-		uint32_t maskimm = 0xFFF00000;
-		uint32_t imm = instruction & maskimm;
-		imm = imm >> 20;
-		imm = twosToDecimal(imm, 12);
-		Iimm_Processing(rd, f3, rs1, imm);
-	}
-	else if (opcode == 103)
-	{ // JALR
-		uint32_t maskrd = 0xF80;
-		uint32_t rd = instruction & maskrd;
-		rd = rd >> 7;
-		uint32_t maskf3 = 0x7000;
-		uint32_t f3 = instruction & maskf3;
-		f3 = f3 >> 12;
-		uint32_t maskrs1 = 0xF8000;
-		uint32_t rs1 = instruction & maskrs1;
-		rs1 = rs1 >> 15;
-		uint32_t maskimm = 0xFFF00000;
-		uint32_t imm = instruction & maskimm;
-		imm = imm >> 20;
-		imm = twosToDecimal(imm, 12);
-		JALR_Processing(rd, f3, rs1, imm);
-	}
-	else if (opcode == 35)
-	{ // S-Type
-		uint32_t maskimm4 = 0xF80;
-		uint32_t imm4 = instruction & maskimm4;
-		imm4 = imm4 >> 7;
-		uint32_t maskf3 = 0x7000;
-		uint32_t f3 = instruction & maskf3;
-		f3 = f3 >> 12;
-		uint32_t maskrs1 = 0xF8000;
-		uint32_t rs1 = instruction & maskrs1;
-		rs1 = rs1 >> 15;
-		uint32_t maskrs2 = 0x1F00000;
-		uint32_t rs2 = instruction & maskrs2;
-		rs2 = rs2 >> 20;
-		uint32_t maskimm11 = 0xFE000000;
-		uint32_t imm11 = instruction & maskimm11;
-		imm11 = imm11 >> 25;
-		S_Processing(imm4, f3, rs1, rs2, imm11);
-	}
-	else if (opcode == 99)
-	{ // B-Type
-		uint32_t maskimm1 = 0xF80;
-		uint32_t imm1 = instruction & maskimm1;
-		imm1 = imm1 >> 7;
-		uint32_t maskf3 = 0x7000;
-		uint32_t f3 = instruction & maskf3;
-		f3 = f3 >> 12;
-		uint32_t maskrs1 = 0xF8000;
-		uint32_t rs1 = instruction & maskrs1;
-		rs1 = rs1 >> 15;
-		uint32_t maskrs2 = 0x1F00000;
-		uint32_t rs2 = instruction & maskrs2;
-		rs2 = rs2 >> 20;
-		uint32_t maskimm2 = 0xFE000000;
-		uint32_t imm2 = instruction & maskimm2;
-		imm2 = imm2 >> 25;
-		B_Processing(imm1,f3,rs1,rs2,imm2);
-	}
-	else if (opcode == 111)
-	{ // J-Type
-		uint32_t maskrd = 0xF80;
-		uint32_t rd = instruction & maskrd;
-		rd = rd >> 7;
-		uint32_t maskimm = 0xFFFFF000;
-		uint32_t imm = instruction & maskimm;
-		imm = imm >> 12;
-		imm = twosToDecimal(imm, 20);
-		J_Processing(rd, imm);
-	}
-	else if (opcode == 55)
-	{ // U-Type
-		uint32_t maskrd = 0xF80;
-		uint32_t rd = instruction & maskrd;
-		rd = rd >> 7;
-		uint32_t maskimm = 0xFFFFF000;
-		uint32_t imm = instruction & maskimm;
-		imm = imm >> 12;
-		imm = twosToDecimal(imm, 20);
-		U_Processing(rd, imm);
-	}
-	else if (opcode != 0)
-	{
-		printf("instruction processing not yet created\n");
-	}
-
-	NEXT_STATE.PC = CURRENT_STATE.PC + 4;
 }
 
 /************************************************************/
-/* Initialize Memory                                                                                                    */
+/* Build the decoder tables from ISA_TABLE                                                    */
 /************************************************************/
-void initialize()
+void isa_init()
 {
-	init_memory();
-	CURRENT_STATE.PC = MEM_TEXT_BEGIN;
-	CURRENT_STATE.REGS[2] = MEM_STACK_BEGIN;
-	NEXT_STATE = CURRENT_STATE;
-	RUN_FLAG = TRUE;
-}
-
-/************************************************************/
-/* Print the program loaded into memory (in RISCV assembly format)    */
-/************************************************************/
+	uint32_t op, opcode, f3, minor, ordering;
+	uint32_t minor_tables = 0;
+	const isa_entry_t *entry;
 
-void R_Print(uint32_t rd, uint32_t f3, uint32_t rs1, uint32_t rs2, uint32_t f7)
-{
-	switch (f3)
+	memset(DECODE_MAJOR, OP_invalid, sizeof(DECODE_MAJOR));
+	memset(DECODE_MINOR, OP_invalid, sizeof(DECODE_MINOR));
+	for (op = 0; op < NUM_OPS; op++)
 	{
-	case 0:
-		switch (f7)
-		{
-		case 0: // ADD
-			printf("add x%d, x%d, x%d\n", rd, rs1, rs2);
-			break;
-		case 1: // MULT
-			printf("mult x%d, x%d, x%d\n", rd, rs1, rs2);
-			break;
-		case 32: // SUB
-			printf("sub x%d, x%d, x%d\n", rd, rs1, rs2);
-			break;
-		}
-		break;
-	case 1: // SLL
-		printf("sll x%d, x%d, x%d\n", rd, rs1, rs2);
-		break;
-	case 2: // SLT
-		printf("slt x%d, x%d, x%d\n", rd, rs1, rs2);
-		break;
-	case 3: // MULTU
-		printf("multu x%d, x%d, x%d\n", rd, rs1, rs2);
-		break;
-	case 4:
-		switch (f7)
+		entry = &ISA_TABLE[op];
+		opcode = entry->opcode;
+		if (opcode == ISA_INTERNAL)
 		{
-		case 0: // XOR
-			printf("xor x%d, x%d, x%d\n", rd, rs1, rs2);
-			break;
-		case 1: // DIV
-			printf("div x%d, x%d, x%d\n", rd, rs1, rs2);
-			break;
+			continue;
 		}
-	case 5:
-		switch (f7)
+		for (f3 = 0; f3 < 8; f3++)
 		{
-		case 0: // SRL
-			printf("srl x%d, x%d, x%d\n", rd, rs1, rs2);
-			break;
-		case 1: // DIVU
-			printf("divu x%d, x%d, x%d\n", rd, rs1, rs2);
-			break;
-		case 32: // SRA
-			printf("sra x%d, x%d, x%d\n", rd, rs1, rs2);
-			break;
+			if (entry->f3 != ISA_ANY && entry->f3 != f3)
+			{
+				continue;
+			}
+			if (entry->f7 == ISA_ANY)
+			{
+				DECODE_MAJOR[opcode][f3] = op;
+				continue;
+			}
+			if (!(DECODE_MAJOR[opcode][f3] & DECODE_MINOR_FLAG))
+			{
+				assert(minor_tables < DECODE_MINOR_TABLES);
+				DECODE_MAJOR[opcode][f3] = DECODE_MINOR_FLAG | minor_tables++;
+			}
+			minor = DECODE_MAJOR[opcode][f3] & ~DECODE_MINOR_FLAG;
+			for (ordering = 0; ordering <= ((entry->format == FMT_AMO) ? AMO_ORDERING_BITS : 0); ordering++)
+			{
+				DECODE_MINOR[minor][entry->f7 | ordering] = op;
+			}
 		}
-	case 6: // OR
-		printf("or x%d, x%d, x%d\n", rd, rs1, rs2);
-		break;
-	case 7: // AND
-		printf("and x%d, x%d, x%d\n", rd, rs1, rs2);
-		break;
 	}
 }
 
-void S_Print(uint32_t imm4, uint32_t f3, uint32_t rs1, uint32_t rs2, uint32_t imm11)
+/************************************************************/
+/* Which instruction is this word?                                                                     */
+/************************************************************/
+uint8_t isa_decode_op(uint32_t instruction)
 {
-	uint32_t imm = (imm11 << 5) + imm4;
-	imm = twosToDecimal(imm, 12);
+	uint8_t op = DECODE_MAJOR[INSN_OPCODE(instruction)][INSN_F3(instruction)];
 
-	switch (f3)
+	if (op & DECODE_MINOR_FLAG)
 	{
-	case 0:
-		printf("sb x%d, %d(x%d)\n", rs1, imm, rs2);
-		break;
-	case 1:
-		printf("sh x%d, %d(x%d)\n", rs1, imm, rs2);
-		break;
-	case 2:
-		printf("sw x%d, %d(x%d)\n", rs1, imm, rs2);
-		break;
+		op = DECODE_MINOR[op & ~DECODE_MINOR_FLAG][INSN_F7(instruction)];
+	}
+	/* ecall and ebreak are the only SYSTEM words; mret, csr* etc. are not implemented */
+	if (op == OP_ecall && (instruction >> 7) != 0 && (instruction >> 7) != (FUNCT12_EBREAK << 13))
+	{
+		op = OP_invalid;
 	}
+	return op;
 }
 
-void ILoad_Print(uint32_t rd, uint32_t f3, uint32_t rs1, uint32_t imm)
+/************************************************************/
+/* The sign-extended immediate of an instruction in the given format      */
+/************************************************************/
+uint32_t isa_immediate(uint32_t instruction, uint8_t format)
 {
-	switch (f3)
+	switch (format)
 	{
-		case 0:
-			printf("lb x%d, %d(x%d)\n", rd, imm, rs1);
-			break;
-		case 1:
-			printf("lh x%d, %d(x%d)\n", rd, imm, rs1);
-			break;
-		case 2:
-			printf("lw x%d, %d(x%d)\n", rd, imm, rs1);
-			break;
+	case FMT_I:
+	case FMT_LOAD:
+	case FMT_JALR:
+		return IMM_I(instruction);
+	case FMT_SHIFT:
+		return INSN_RS2(instruction);
+	case FMT_S:
+		return IMM_S(instruction);
+	case FMT_B:
+		return IMM_B(instruction);
+	case FMT_U:
+		return IMM_U(instruction);
+	case FMT_J:
+		return IMM_J(instruction);
+	case FMT_SYSTEM:
+		return instruction >> 20;
+	default:
+		return 0;
 	}
 }
 
-void Iimm_Print(uint32_t rd, uint32_t f3, uint32_t rs1, uint32_t imm)
+/************************************************************/
+/* decode an instruction word into its handler and operands                        */
+/************************************************************/
+void decode_instruction(uint32_t instruction, decoded_insn_t *insn)
+{
+	uint8_t op = isa_decode_op(instruction);
+	uint32_t rd = INSN_RD(instruction);
+
+	insn->op = op;
+	insn->handler = ISA_TABLE[op].exec;
+	insn->rd = (rd == 0) ? REG_SINK : rd;
+	insn->rs1 = INSN_RS1(instruction);
+	insn->rs2 = INSN_RS2(instruction);
+	insn->imm = isa_immediate(instruction, ISA_TABLE[op].format);
+}
+
+/************************************************************/
+/* Is anything watching retired instructions a block at a time?               */
+/************************************************************/
+static int observing(sim_t *sim)
 {
-	// Separate imm section sometimes used as f7
-	uint32_t imm0_4 = (imm << 7) >> 7;
-	uint32_t imm5_11 = imm >> 5;
+	return (SIM_STATS && sim->STATS_ON) || sim->PROFILE != NULL || sim->BPRED != NULL;
+}
 
-	switch(f3)
+/************************************************************/
+/* Hand count instructions that retired from pc on to whatever is watching; */
+/* control went on to next_pc after the last of them                             */
+/************************************************************/
+static void observe_retire(sim_t *sim, const decoded_insn_t *insns, uint32_t count, uint32_t pc, uint32_t next_pc)
+{
+	if (SIM_STATS && sim->STATS_ON)
 	{
-		case 0:
-			printf("addi x%d, x%d, %d\n", rd, rs1, imm);
-			break;
-		case 4:
-			printf("xori x%d, x%d, %d\n", rd, rs1, imm);
-			break;
-		case 6:
-			printf("ori x%d, x%d, %d\n", rd, rs1, imm);
-			break;
-		case 7:
-			printf("andi x%d, x%d, %d\n", rd, rs1, imm);
-			break;
-		case 1:
-			printf("slli x%d, x%d, %d\n", rd, rs1, imm0_4);
-			break;
-		case 5:
-			switch(imm5_11)
-			{
-				case 0:
-					printf("srli x%d, x%d, %d\n", rd, rs1, imm0_4);
-					break;
-				case 32:
-					printf("srai x%d, x%d, %d\n", rd, rs1, imm0_4);
-					break;
-			}
+		stats_retire(sim, insns, count, pc, next_pc);
+	}
+	if (sim->PROFILE != NULL)
+	{
+		profile_retire(sim, insns, count, pc, next_pc);
+	}
+	if (sim->BPRED != NULL)
+	{
+		bpred_retire(sim, insns, count, pc, next_pc);
 	}
 }
 
-void JALR_Print(uint32_t rd, uint32_t f3, uint32_t rs1, uint32_t imm)
+/************************************************************/
+/* Execute insn for handle_instruction() with statistics, the profiler,   */
+/* the branch predictors, a trace or the cache model on, and hand it to   */
+/* them if it retires                                                     */
+/************************************************************/
+static void handle_observed(sim_t *sim, const decoded_insn_t *insn)
 {
-	switch (f3)
+	// fence.i frees the page insn points into
+	decoded_insn_t counted = *insn;
+	uint32_t pc = sim->CURRENT_STATE.PC;
+	uint32_t address = sim->CURRENT_STATE.REGS[insn->rs1] + insn->imm;
+	uint32_t instruction = (sim->TRACE != NULL) ? mem_read_32(sim, pc) : 0;
+
+	insn->handler(sim, insn);
+	if (sim->RUN_EXIT == RUN_ILLEGAL)
 	{
-		case 0:	// JALR
-			if (rd == 0 && imm == 0)	// JR
-			{
-				printf("jr x%d\n", rs1);
-			}
-			else	// JALR
-			{
-				printf("jalr x%d, x%d, %d\n", rd, rs1, imm);
-			}
-			break;
+		return;
+	}
+	observe_retire(sim, &counted, 1, pc, sim->NEXT_PC);
+	if (sim->TRACE != NULL)
+	{
+		trace_record(sim, pc, instruction, sim->CURRENT_STATE.REGS[counted.rd], address);
+	}
+	if (sim->CACHE != NULL)
+	{
+		cache_retire(sim, &counted, pc, address);
 	}
 }
 
-void B_Print(uint32_t imm1, uint32_t f3, uint32_t rs1, uint32_t rs2, uint32_t imm2)
+/************************************************************/
+/* execute the (pre)decoded instruction at the PC                                             */
+/************************************************************/
+void handle_instruction(sim_t *sim)
 {
-	// Recombine immediate
-	uint32_t imm = (imm2 << 5) + imm1;
-	imm = twosToDecimal(imm, 12);
+	// Stop once the end of the program is reached
+	if ((sim->CURRENT_STATE.PC - sim->PROGRAM_BASE) / 4 > sim->PROGRAM_SIZE)
+	{
+		sim->RUN_FLAG = FALSE;
+		sim->RUN_EXIT = RUN_HALTED;
+		return;
+	}
 
-	switch (f3)
+	// Handlers update CURRENT_STATE in place; control transfers overwrite NEXT_PC
+	const decoded_insn_t *insn = fetch_decoded(sim, sim->CURRENT_STATE.PC);
+	sim->NEXT_PC = sim->CURRENT_STATE.PC + 4;
+	if (observing(sim) || sim->TRACE != NULL || sim->CACHE != NULL)
 	{
-		case 0:	// beq
-			printf("beq x%d, x%d, %d\n", rs1, rs2, imm);
-			break;
-		case 1:	// bne
-			printf("bne x%d, x%d, %d\n", rs1, rs2, imm);
-			break;
-		case 4:	// blt and connotative uses
-			if (rs1 == 0)	// bgtz
-			{
-				printf("bgtz x%d, %d\n", rs2, imm);
-			}
-			else if (rs2 == 0)	// bltz
-			{
-				printf("bltz x%d, %d\n", rs1, imm);
-			}
-			else	// blt
-			{
-				printf("blt x%d, x%d, %d\n", rs1, rs2, imm);
-			}
-			break;	
-		case 5:	// bge and connotative uses
-			if (rs1 == 0)	// blez
-			{
-				printf("blez x%d, %d\n", rs2, imm);
-			}
-			else if (rs2 == 0)	// bgez
-			{
-				printf("bgez x%d, %d\n", rs1, imm);
-			}
-			else	// bge
-			{
-				printf("bge x%d, x%d, %d\n", rs1, rs2, imm);
-			}
-			break;	
+		handle_observed(sim, insn);
+	}
+	else
+	{
+		insn->handler(sim, insn);
 	}
+	sim->CURRENT_STATE.PC = sim->NEXT_PC;
 }
 
-void J_Print(uint32_t rd, uint32_t imm){
-	if (rd == 0)	// J
+/************************************************************/
+/* Threaded interpreter: run_budget() for the threaded and JIT engines.    */
+/* Executes in place on CURRENT_STATE, one cached basic block at a time.  */
+/* Inside a block each instruction jumps straight to the next through a   */
+/* computed goto; the budget and end of program are only checked between */
+/* blocks.                                                                                               */
+/************************************************************/
+run_result_t run_threaded(sim_t *sim, uint32_t budget)
+{
+#define LABEL_ENTRY(name, opcode, f3, f7, format) &&do_##name,
+	static void *const dispatch[NUM_OPS] = { INSTRUCTION_LIST(LABEL_ENTRY) };
+#undef LABEL_ENTRY
+	uint32_t *regs = sim->CURRENT_STATE.REGS;
+	uint32_t pc = sim->CURRENT_STATE.PC;
+	uint32_t executed = 0;
+	uint32_t target, retired;
+	run_result_t result;
+	block_t *blk;
+	block_t **link = NULL;	/* exit slot of the block that led to pc */
+	const decoded_insn_t *insn, *end;
+	int observed = observing(sim);
+	const decoded_insn_t *counted = NULL;	/* when observed, the block control is in */
+	uint32_t counted_pc = 0, counted_base = 0;	/* its address, and executed when it was entered */
+
+	// Address of the instruction being executed
+#define INSN_PC() (blk->start_pc + 4 * (uint32_t)(insn - blk->insns))
+#define EXIT_TO(next_pc, slot) \
+	do { pc = (next_pc); link = &blk->exit[slot]; goto block_entry; } while (0)
+#define NEXT() \
+	do { \
+		if (++insn == end) EXIT_TO(INSN_PC(), 0); \
+		goto *dispatch[insn->op]; \
+	} while (0)
+#define BRANCH(cond) \
+	do { \
+		if (cond) EXIT_TO(INSN_PC() + insn->imm, 1); \
+		EXIT_TO(INSN_PC() + 4, 0); \
+	} while (0)
+	// A store that overwrote cached code ends the block early
+#define STORE_DONE() \
+	do { \
+		if (sim->BLOCK_FLUSH_PENDING) \
+		{ \
+			executed -= end - insn - 1; \
+			pc = INSN_PC() + 4; \
+			goto block_entry; \
+		} \
+		NEXT(); \
+	} while (0)
+	// Atomics share their handlers with the classic core
+#define ATOMIC(name) \
+	do { \
+		sim->RUN_EXIT = RUN_BUDGET; \
+		exec_##name(sim, insn); \
+		if (sim->RUN_EXIT == RUN_ILLEGAL) \
+		{ \
+			executed -= end - insn - 1; \
+			goto do_invalid; \
+		} \
+		STORE_DONE(); \
+	} while (0)
+	// When observed, report what the block retired once control has left it for pc
+#define OBSERVE_RETIRE() \
+	do { \
+		if (counted != NULL) \
+		{ \
+			observe_retire(sim, counted, executed - counted_base, counted_pc, pc); \
+			counted = NULL; \
+		} \
+	} while (0)
+#define OBSERVE_ENTER() \
+	do { \
+		if (observed) \
+		{ \
+			counted = blk->insns; \
+			counted_pc = blk->start_pc; \
+			counted_base = executed; \
+		} \
+	} while (0)
+
+	result.reason = RUN_BUDGET;
+	if (sim->RUN_FLAG == FALSE)
+	{
+		result.reason = RUN_HALTED;
+		goto done;
+	}
+
+block_entry:
+	OBSERVE_RETIRE();
+	if (executed == budget)
+	{
+		goto done;
+	}
+	// Same end-of-program check as handle_instruction
+	if ((pc - sim->PROGRAM_BASE) / 4 > sim->PROGRAM_SIZE)
+	{
+		executed++;
+		goto end_of_program;
+	}
+	if (sim->BLOCK_FLUSH_PENDING)
+	{
+		block_flush(sim);
+		link = NULL;
+	}
+	if (link != NULL && *link != NULL && (*link)->start_pc == pc)
+	{
+		blk = *link;
+	}
+	else
+	{
+		blk = block_lookup(sim, pc);
+		if (link != NULL)
+		{
+			*link = blk;
+		}
+	}
+	link = NULL;
+	if (blk->jit != NULL && blk->len <= budget - executed)
+	{
+		OBSERVE_ENTER();
+		retired = blk->jit(sim);
+		executed += retired;
+		pc = sim->CURRENT_STATE.PC;
+		if (retired == blk->len)
+		{
+			link = &blk->exit[pc != blk->start_pc + 4 * blk->len];
+		}
+		goto block_entry;
+	}
+	if (sim->ENGINE == ENGINE_JIT && ++blk->exec_count == JIT_THRESHOLD)
 	{
-		printf("j %d\n", imm);
+		blk->jit = jit_compile(sim, blk);
 	}
-	else	// JAL
+	insn = blk->insns;
+	end = insn + blk->len;
+	if (blk->len > budget - executed)
 	{
-		printf("jal x%d, %d\n", rd, imm);
+		end = insn + (budget - executed);
 	}
+	OBSERVE_ENTER();
+	executed += end - insn;
+	goto *dispatch[insn->op];
+
+do_nop:
+	NEXT();
+do_invalid:
+	// Not retired: leave the PC on it
+	executed--;
+	pc = INSN_PC();
+	result.reason = RUN_ILLEGAL;
+	result.pc = pc;
+	goto done;
+do_add:
+	regs[insn->rd] = regs[insn->rs1] + regs[insn->rs2];
+	NEXT();
+do_sub:
+	regs[insn->rd] = regs[insn->rs1] - regs[insn->rs2];
+	NEXT();
+do_or:
+	regs[insn->rd] = regs[insn->rs1] | regs[insn->rs2];
+	NEXT();
+do_and:
+	regs[insn->rd] = regs[insn->rs1] & regs[insn->rs2];
+	NEXT();
+do_xor:
+	regs[insn->rd] = regs[insn->rs1] ^ regs[insn->rs2];
+	NEXT();
+do_sll:
+	regs[insn->rd] = regs[insn->rs1] << (regs[insn->rs2] & 0x1F);
+	NEXT();
+do_srl:
+	regs[insn->rd] = regs[insn->rs1] >> (regs[insn->rs2] & 0x1F);
+	NEXT();
+do_sra:
+	regs[insn->rd] = (int32_t)regs[insn->rs1] >> (regs[insn->rs2] & 0x1F);
+	NEXT();
+do_slt:
+	regs[insn->rd] = (int32_t)regs[insn->rs1] < (int32_t)regs[insn->rs2];
+	NEXT();
+do_sltu:
+	regs[insn->rd] = regs[insn->rs1] < regs[insn->rs2];
+	NEXT();
+do_lb:
+	regs[insn->rd] = byte_to_word(mem_read_8(sim, regs[insn->rs1] + insn->imm));
+	NEXT();
+do_lh:
+	regs[insn->rd] = half_to_word(mem_read_16(sim, regs[insn->rs1] + insn->imm));
+	NEXT();
+do_lw:
+	regs[insn->rd] = mem_read_32(sim, regs[insn->rs1] + insn->imm);
+	NEXT();
+do_lbu:
+	regs[insn->rd] = mem_read_8(sim, regs[insn->rs1] + insn->imm);
+	NEXT();
+do_lhu:
+	regs[insn->rd] = mem_read_16(sim, regs[insn->rs1] + insn->imm);
+	NEXT();
+do_addi:
+	regs[insn->rd] = regs[insn->rs1] + insn->imm;
+	NEXT();
+do_slti:
+	regs[insn->rd] = (int32_t)regs[insn->rs1] < (int32_t)insn->imm;
+	NEXT();
+do_sltiu:
+	regs[insn->rd] = regs[insn->rs1] < insn->imm;
+	NEXT();
+do_xori:
+	regs[insn->rd] = regs[insn->rs1] ^ insn->imm;
+	NEXT();
+do_ori:
+	regs[insn->rd] = regs[insn->rs1] | insn->imm;
+	NEXT();
+do_andi:
+	regs[insn->rd] = regs[insn->rs1] & insn->imm;
+	NEXT();
+do_slli:
+	regs[insn->rd] = regs[insn->rs1] << insn->imm;
+	NEXT();
+do_srli:
+	regs[insn->rd] = regs[insn->rs1] >> insn->imm;
+	NEXT();
+do_srai:
+	regs[insn->rd] = (int32_t)regs[insn->rs1] >> insn->imm;
+	NEXT();
+do_jalr:
+	target = (regs[insn->rs1] + insn->imm) & ~1u;
+	regs[insn->rd] = INSN_PC() + 4;
+	EXIT_TO(target, 0);
+do_sb:
+	mem_write_8(sim, regs[insn->rs1] + insn->imm, regs[insn->rs2]);
+	STORE_DONE();
+do_sh:
+	mem_write_16(sim, regs[insn->rs1] + insn->imm, regs[insn->rs2]);
+	STORE_DONE();
+do_sw:
+	mem_write_32(sim, regs[insn->rs1] + insn->imm, regs[insn->rs2]);
+	STORE_DONE();
+do_beq:
+	BRANCH(regs[insn->rs1] == regs[insn->rs2]);
+do_bne:
+	BRANCH(regs[insn->rs1] != regs[insn->rs2]);
+do_blt:
+	BRANCH((int32_t)regs[insn->rs1] < (int32_t)regs[insn->rs2]);
+do_bge:
+	BRANCH((int32_t)regs[insn->rs1] >= (int32_t)regs[insn->rs2]);
+do_bltu:
+	BRANCH(regs[insn->rs1] < regs[insn->rs2]);
+do_bgeu:
+	BRANCH(regs[insn->rs1] >= regs[insn->rs2]);
+do_jal:
+	regs[insn->rd] = INSN_PC() + 4;
+	EXIT_TO(INSN_PC() + insn->imm, 1);
+do_lui:
+	regs[insn->rd] = insn->imm;
+	NEXT();
+do_auipc:
+	regs[insn->rd] = INSN_PC() + insn->imm;
+	NEXT();
+do_fence:
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	NEXT();
+do_fence_i:
+	// Ends its block, so nothing below still uses blk
+	pc = INSN_PC() + 4;
+	OBSERVE_RETIRE();
+	decode_flush(sim);
+	link = NULL;
+	goto block_entry;
+do_lr_w:
+	ATOMIC(lr_w);
+do_sc_w:
+	ATOMIC(sc_w);
+do_amoswap_w:
+	ATOMIC(amoswap_w);
+do_amoadd_w:
+	ATOMIC(amoadd_w);
+do_amoxor_w:
+	ATOMIC(amoxor_w);
+do_amoand_w:
+	ATOMIC(amoand_w);
+do_amoor_w:
+	ATOMIC(amoor_w);
+do_amomin_w:
+	ATOMIC(amomin_w);
+do_amomax_w:
+	ATOMIC(amomax_w);
+do_amominu_w:
+	ATOMIC(amominu_w);
+do_amomaxu_w:
+	ATOMIC(amomaxu_w);
+do_ecall:
+	result.reason = (insn->imm == FUNCT12_EBREAK) ? RUN_BREAKPOINT : RUN_ECALL;
+	result.pc = INSN_PC();
+	pc = result.pc + 4;
+	goto done;
+
+end_of_program:
+	sim->RUN_FLAG = FALSE;
+	result.reason = RUN_HALTED;
+
+done:
+	OBSERVE_RETIRE();
+#undef INSN_PC
+#undef EXIT_TO
+#undef NEXT
+#undef BRANCH
+#undef STORE_DONE
+#undef ATOMIC
+#undef OBSERVE_RETIRE
+#undef OBSERVE_ENTER
+	sim->CURRENT_STATE.PC = pc;
+	sim->INSTRUCTION_COUNT += executed;
+	result.executed = executed;
+	if (result.reason == RUN_BUDGET || result.reason == RUN_HALTED)
+	{
+		result.pc = pc;
+	}
+	return result;
 }
 
-void U_Print(uint32_t rd, uint32_t imm) // LUI
+/************************************************************/
+/* Initialize Memory                                                                                                    */
+/************************************************************/
+void initialize(sim_t *sim)
 {
-	printf("lui x%d, %d\n", rd, imm);
+	static pthread_once_t isa_ready = PTHREAD_ONCE_INIT;
+
+	/* the decoder tables are shared by every simulation and thread */
+	pthread_once(&isa_ready, isa_init);
+	init_memory(sim);
+	sim->CURRENT_STATE.PC = MEM_TEXT_BEGIN;
+	sim->CURRENT_STATE.REGS[2] = MEM_STACK_BEGIN;
+	sim->RUN_FLAG = TRUE;
 }
 
-void print_program()
+/************************************************************/
+/* Allocate a simulation with empty memory and no program loaded           */
+/************************************************************/
+sim_t *sim_create()
 {
-	printf("\n");
-
-	for (int i = 0; i < PROGRAM_SIZE; i++)
+	sim_t *sim = calloc(1, sizeof(sim_t));
+	if (sim == NULL)
 	{
-		print_instruction(MEM_TEXT_BEGIN + (i * 4));
+		printf("Error: Out of memory allocating a simulator\n");
+		exit(-1);
 	}
-
-	printf("\n");
+	sim->ENGINE = ENGINE_THREADED;
+	sim->PROGRAM_BASE = MEM_TEXT_BEGIN;
+	sim->OUTPUT = stdout;
+	sim->RESERVATION = TLB_INVALID;
+	sim->MEMORY = sim;
+	sim->NUM_HARTS = 1;
+	sim->HARTS[0] = sim;
+	pthread_mutex_init(&sim->MEMORY_LOCK, NULL);
+	initialize(sim);
+	return sim;
 }
 
 /************************************************************/
-/* Print the instruction at given memory address (in RISCV assembly format)    */
+/* Release a simulation and everything it mapped or allocated               */
 /************************************************************/
-void print_instruction(uint32_t addr)
-{
-
-	uint32_t instruction = mem_read_32(addr);
-	uint32_t maskopcode = 0x7F;
-	uint32_t opcode = instruction & maskopcode;
-	if (opcode == 51)
-	{ // R-type
-		uint32_t maskrd = 0xF80;
-		uint32_t rd = instruction & maskrd;
-		rd = rd >> 7;
-		uint32_t maskf3 = 0x7000;
-		uint32_t f3 = instruction & maskf3;
-		f3 = f3 >> 12;
-		uint32_t maskrs1 = 0xF8000;
-		uint32_t rs1 = instruction & maskrs1;
-		rs1 = rs1 >> 15;
-		uint32_t maskrs2 = 0x1F00000;
-		uint32_t rs2 = instruction & maskrs2;
-		rs2 = rs2 >> 20;
-		uint32_t maskf7 = 0xFE000000;
-		uint32_t f7 = instruction & maskf7;
-		f7 = f7 >> 25;
-		R_Print(rd, f3, rs1, rs2, f7);
-	}
-	else if (opcode == 3)
-	{ // ILoad-Type
-		uint32_t maskrd = 0xF80;
-		uint32_t rd = instruction & maskrd;
-		rd = rd >> 7;
-		uint32_t maskf3 = 0x7000;
-		uint32_t f3 = instruction & maskf3;
-		f3 = f3 >> 12;
-		uint32_t maskrs1 = 0xF8000;
-		uint32_t rs1 = instruction & maskrs1;
-		rs1 = rs1 >> 15;
-		uint32_t maskimm = 0xFFF00000;
-		uint32_t imm = instruction & maskimm;
-		imm = imm >> 20;
-		imm = twosToDecimal(imm, 12);
-		ILoad_Print(rd,f3,rs1,imm);
-	}
-	else if (opcode == 19)
-	{ // Iimm-Type
-		uint32_t maskrd = 0xF80;
-		uint32_t rd = instruction & maskrd;
-		rd = rd >> 7;
-		uint32_t maskf3 = 0x7000;
-		uint32_t f3 = instruction & maskf3;
-		f3 = f3 >> 12;
-		uint32_t maskrs1 = 0xF8000;
-		uint32_t rs1 = instruction & maskrs1;
-		rs1 = rs1 >> 15;
-		uint32_t maskimm = 0xFFF00000;
-		uint32_t imm = instruction & maskimm;
-		imm = imm >> 20;
-		imm = twosToDecimal(imm, 12);
-		Iimm_Print(rd,f3,rs1,imm);
-	}
-	else if (opcode == 103)
-	{ // JALR
-		uint32_t maskrd = 0xF80;
-		uint32_t rd = instruction & maskrd;
-		rd = rd >> 7;
-		uint32_t maskf3 = 0x7000;
-		uint32_t f3 = instruction & maskf3;
-		f3 = f3 >> 12;
-		uint32_t maskrs1 = 0xF8000;
-		uint32_t rs1 = instruction & maskrs1;
-		rs1 = rs1 >> 15;
-		uint32_t maskimm = 0xFFF00000;
-		uint32_t imm = instruction & maskimm;
-		imm = imm >> 20;
-		imm = twosToDecimal(imm, 12);
-		JALR_Print(rd, f3, rs1, imm);
-	}
-	else if (opcode == 35)
-	{ // S-Type
-		uint32_t maskimm4 = 0xF80;
-		uint32_t imm4 = instruction & maskimm4;
-		imm4 = imm4 >> 7;
-		uint32_t maskf3 = 0x7000;
-		uint32_t f3 = instruction & maskf3;
-		f3 = f3 >> 12;
-		uint32_t maskrs1 = 0xF8000;
-		uint32_t rs1 = instruction & maskrs1;
-		rs1 = rs1 >> 15;
-		uint32_t maskrs2 = 0x1F00000;
-		uint32_t rs2 = instruction & maskrs2;
-		rs2 = rs2 >> 20;
-		uint32_t maskimm11 = 0xFE000000;
-		uint32_t imm11 = instruction & maskimm11;
-		imm11 = imm11 >> 25;
-		S_Print(imm4, f3, rs1, rs2, imm11);
-	}
-	else if (opcode == 99)
-	{ // B-Type
-		uint32_t maskimm1 = 0xF80;
-		uint32_t imm1 = instruction & maskimm1;
-		imm1 = imm1 >> 7;
-		uint32_t maskf3 = 0x7000;
-		uint32_t f3 = instruction & maskf3;
-		f3 = f3 >> 12;
-		uint32_t maskrs1 = 0xF8000;
-		uint32_t rs1 = instruction & maskrs1;
-		rs1 = rs1 >> 15;
-		uint32_t maskrs2 = 0x1F00000;
-		uint32_t rs2 = instruction & maskrs2;
-		rs2 = rs2 >> 20;
-		uint32_t maskimm2 = 0xFE000000;
-		uint32_t imm2 = instruction & maskimm2;
-		imm2 = imm2 >> 25;
-		B_Print(imm1,f3,rs1,rs2,imm2);
-	}
-	else if (opcode == 111)
-	{ // J-Type
-		uint32_t maskrd = 0xF80;
-		uint32_t rd = instruction & maskrd;
-		rd = rd >> 7;
-		uint32_t maskimm = 0xFFFFF000;
-		uint32_t imm = instruction & maskimm;
-		imm = imm >> 12;
-		imm = twosToDecimal(imm, 20);
-		J_Print(rd, imm);
-	}
-	else if (opcode == 55)
-	{ // U-Type
-		uint32_t maskrd = 0xF80;
-		uint32_t rd = instruction & maskrd;
-		rd = rd >> 7;
-		uint32_t maskimm = 0xFFFFF000;
-		uint32_t imm = instruction & maskimm;
-		imm = imm >> 12;
-		imm = twosToDecimal(imm, 20);
-		U_Print(rd, imm);
-	}
-	else
+void sim_destroy(sim_t *sim)
+{
+	uint8_t *page;
+
+	free_memory(sim);
+	jit_free(sim);
+	while ((page = sim->FREE_PAGES) != NULL)
 	{
-		printf("instruction print not yet created\n");
+		sim->FREE_PAGES = *(uint8_t **)page;
+		free(page);
 	}
-	CURRENT_STATE = NEXT_STATE;
-	return;
+	free(sim->DIRTY_PAGES);
+	pthread_mutex_destroy(&sim->MEMORY_LOCK);
+	free(sim);
 }
 
-/***************************************************************/
-/* main                                                                                                                                   */
-/***************************************************************/
-int main(int argc, char *argv[])
+/************************************************************/
+/* Print the program loaded into memory (in RISCV assembly format)    */
+/************************************************************/
+void print_program(sim_t *sim)
 {
-	printf("\n**************************\n");
-	printf("Welcome to MU-RISCV SIM...\n");
-	printf("**************************\n\n");
+	printf("\n");
+
+	for (int i = 0; i < sim->PROGRAM_SIZE; i++)
+	{
+		uint32_t addr = sim->PROGRAM_BASE + (i * 4);
+		const symbol_t *sym = symbol_lookup(sim, addr);
+		if (sym != NULL && sym->address == addr)
+		{
+			printf("%s:\n", sym->name);
+		}
+		print_instruction(sim, addr);
+	}
 
-	if (argc < 2)
+	printf("\n");
+}
+
+/************************************************************/
+/* Write an instruction word in RISCV assembly format to buf                    */
+/************************************************************/
+void disassemble(uint32_t instruction, char *buf, size_t size)
+{
+	uint8_t op = isa_decode_op(instruction);
+	const isa_entry_t *entry = &ISA_TABLE[op];
+	const char *name = entry->mnemonic;
+	uint32_t rd = INSN_RD(instruction);
+	uint32_t rs1 = INSN_RS1(instruction);
+	uint32_t rs2 = INSN_RS2(instruction);
+	int32_t imm = isa_immediate(instruction, entry->format);
+
+	if (op == OP_invalid)
 	{
-		printf("Error: You should provide input file.\nUsage: %s <input program> \n\n", argv[0]);
-		exit(1);
+		snprintf(buf, size, ".word 0x%08x", instruction);
+		return;
 	}
 
-	strcpy(prog_file, argv[1]);
-	initialize();
-	load_program();
-	help();
-	while (1)
+	switch (entry->format)
 	{
-		handle_command();
+	case FMT_R:
+		snprintf(buf, size, "%s x%d, x%d, x%d", name, rd, rs1, rs2);
+		break;
+	case FMT_I:
+	case FMT_SHIFT:
+		snprintf(buf, size, "%s x%d, x%d, %d", name, rd, rs1, imm);
+		break;
+	case FMT_LOAD:
+		snprintf(buf, size, "%s x%d, %d(x%d)", name, rd, imm, rs1);
+		break;
+	case FMT_JALR:
+		if (rd == 0 && imm == 0)	// JR
+		{
+			snprintf(buf, size, "jr x%d", rs1);
+		}
+		else
+		{
+			snprintf(buf, size, "%s x%d, x%d, %d", name, rd, rs1, imm);
+		}
+		break;
+	case FMT_S:
+		snprintf(buf, size, "%s x%d, %d(x%d)", name, rs2, imm, rs1);
+		break;
+	case FMT_B:
+		// Comparisons against x0 print as their connotative forms
+		if (op == OP_blt && rs1 == 0)
+		{
+			snprintf(buf, size, "bgtz x%d, %d", rs2, imm);
+		}
+		else if (op == OP_blt && rs2 == 0)
+		{
+			snprintf(buf, size, "bltz x%d, %d", rs1, imm);
+		}
+		else if (op == OP_bge && rs1 == 0)
+		{
+			snprintf(buf, size, "blez x%d, %d", rs2, imm);
+		}
+		else if (op == OP_bge && rs2 == 0)
+		{
+			snprintf(buf, size, "bgez x%d, %d", rs1, imm);
+		}
+		else
+		{
+			snprintf(buf, size, "%s x%d, x%d, %d", name, rs1, rs2, imm);
+		}
+		break;
+	case FMT_U:
+		snprintf(buf, size, "%s x%d, 0x%x", name, rd, (uint32_t)imm >> 12);
+		break;
+	case FMT_SYSTEM:
+		snprintf(buf, size, "%s", (imm == FUNCT12_EBREAK) ? "ebreak" : name);
+		break;
+	case FMT_AMO:
+		// Mnemonics end in _w for .w
+		if (op == OP_lr_w)
+		{
+			snprintf(buf, size, "lr.w x%d, (x%d)", rd, rs1);
+		}
+		else
+		{
+			snprintf(buf, size, "%.*s.w x%d, x%d, (x%d)", (int)strlen(name) - 2, name, rd, rs2, rs1);
+		}
+		break;
+	case FMT_J:
+		if (rd == 0)	// J
+		{
+			snprintf(buf, size, "j %d", imm);
+		}
+		else
+		{
+			snprintf(buf, size, "%s x%d, %d", name, rd, imm);
+		}
+		break;
+	default:
+		snprintf(buf, size, "%s", (op == OP_fence_i) ? "fence.i" : name);
+		break;
 	}
-	return 0;
+}
+
+/************************************************************/
+/* Print the instruction at given memory address (in RISCV assembly format)    */
+/************************************************************/
+void print_instruction(sim_t *sim, uint32_t addr)
+{
+	char text[64];
+
+	disassemble(mem_read_32(sim, addr), text, sizeof(text));
+	printf("%s\n", text);
 }
@@ -1,4 +1,10 @@
+#ifndef MU_RISCV_H
+#define MU_RISCV_H
+
+#include <stdio.h>
 #include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
 
 #define FALSE 0
 #define TRUE  1
@@ -24,56 +30,875 @@
 
 typedef struct {
 	uint32_t begin, end;
-	uint8_t *mem;
 } mem_region_t;
 
-/* memory will be dynamically allocated at initialization */
-mem_region_t MEM_REGIONS[] = {
-	{ MEM_TEXT_BEGIN, MEM_TEXT_END, NULL },
-	{ MEM_DATA_BEGIN, MEM_DATA_END, NULL },
-	{ MEM_KDATA_BEGIN, MEM_KDATA_END, NULL },
-	{ MEM_KTEXT_BEGIN, MEM_KTEXT_END, NULL }
-};
-
+/* regions only describe the address map; backing pages are allocated on demand */
 #define NUM_MEM_REGION 4
+extern mem_region_t MEM_REGIONS[NUM_MEM_REGION];
+
+/******************************************************************************/
+/* Guest memory page table                                                    */
+/******************************************************************************/
+/* Two-level table: bits 31..22 select a directory entry, bits 21..12 a page. */
+/* A page is allocated the first time it is written; reads of untouched pages */
+/* are served from ZERO_PAGE.                                                 */
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1 << PAGE_SHIFT)
+#define PAGE_OFFSET_MASK (PAGE_SIZE - 1)
+#define PAGE_TABLE_BITS 10
+#define PAGE_TABLE_ENTRIES (1 << PAGE_TABLE_BITS)
+#define PAGE_DIR_ENTRIES (1 << (32 - PAGE_SHIFT - PAGE_TABLE_BITS))
+
+#define PAGE_DIR_INDEX(addr) ((addr) >> (PAGE_SHIFT + PAGE_TABLE_BITS))
+#define PAGE_TABLE_INDEX(addr) (((addr) >> PAGE_SHIFT) & (PAGE_TABLE_ENTRIES - 1))
+
+extern uint8_t ZERO_PAGE[PAGE_SIZE];
+
+/* Host pages a simulation frees are kept, up to PAGE_POOL_MAX of them, for */
+/* the next program it loads.                                                */
+#define PAGE_POOL_MAX 4096
+
+/* reset() restores only the pages written since the last reset. Every     */
+/* first write to a page goes through mem_page_write(), which records it in */
+/* DIRTY_PAGES. PRISTINE_DIR, indexed like PAGE_DIR, holds each page as the */
+/* loader left it; dirty pages without an entry go back to zero.            */
+#define NUM_GUEST_PAGES (1u << (32 - PAGE_SHIFT))
+
+/******************************************************************************/
+/* Software TLB                                                               */
+/******************************************************************************/
+/* Direct-mapped cache of guest page -> host page. The tag is the guest page  */
+/* base, so masking the address with TLB_TAG_MASK(width) keeps the low bits   */
+/* that must be zero for an aligned access: one compare checks both the page  */
+/* and the alignment. Read entries may point at ZERO_PAGE, write entries only */
+/* ever point at allocated pages.                                             */
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "the TLB fast path loads guest words natively and needs a little-endian host"
+#endif
+
+#define TLB_BITS 8
+#define TLB_ENTRIES (1 << TLB_BITS)
+#define TLB_INVALID 0xFFFFFFFF
+#define TLB_INDEX(addr) (((addr) >> PAGE_SHIFT) & (TLB_ENTRIES - 1))
+#define TLB_TAG_MASK(width) (~(uint32_t)PAGE_OFFSET_MASK | ((width) - 1))
+
+typedef struct {
+	uint32_t tag;	/* guest page base, TLB_INVALID when empty */
+	uint8_t *host;	/* host page backing it */
+} tlb_entry_t;
+
+
+/******************************************************************************/
+/* Program loading                                                            */
+/******************************************************************************/
+/* ELF and raw binary programs are mapped private and the pages a segment   */
+/* covers completely become guest pages in place, so the host copies a page */
+/* only once the guest writes it. Everything else is copied into ordinary   */
+/* pages. Hex word files are parsed once and copied a page at a time.       */
+typedef struct {
+	uint32_t address, size;
+	char *name;
+} symbol_t;
+
+/******************************************************************************/
+/* Checkpoints                                                                */
+/******************************************************************************/
+/* A checkpoint file is a header with the CPU state, INSTRUCTION_COUNT,      */
+/* RUN_FLAG and the program bounds, then the numbers of the non-zero guest  */
+/* pages, then those pages, each at a PAGE_SIZE-aligned file offset. A       */
+/* restore maps the file private and uses its pages as guest pages in place, */
+/* so a page is only read from disk when the guest touches it.               */
+#define CHECKPOINT_MAGIC "MURVCKPT"
+#define CHECKPOINT_VERSION 1
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t num_pages;
+	uint32_t data_offset;	/* file offset of the first page */
+	uint32_t pc;
+	uint32_t regs[32];
+	uint32_t hi, lo;
+	uint64_t instruction_count;
+	uint32_t run_flag;
+	uint32_t program_base, program_size;
+} checkpoint_header_t;
+
+/******************************************************************************/
+/* Decoded instruction cache                                                  */
+/******************************************************************************/
+/* Each guest page that has been executed gets an array of decoded slots, one */
+/* per word, found through DECODE_DIR with the same indexing as PAGE_DIR. A   */
+/* slot with a NULL handler has not been decoded yet. Pages with decoded      */
+/* slots are kept out of TLB_WRITE so that stores to them take the slow path, */
+/* which clears the slots they overwrite.                                     */
+#define DECODE_PAGE_ENTRIES (PAGE_SIZE / 4)
+#define DECODE_INDEX(addr) (((addr) & PAGE_OFFSET_MASK) >> 2)
+
+/* Instruction formats: where the immediate bits are and how the operands */
+/* are printed.                                                            */
+typedef enum {
+	FMT_NONE,	/* no operands */
+	FMT_R,	/* rd, rs1, rs2 */
+	FMT_I,	/* rd, rs1, imm */
+	FMT_SHIFT,	/* rd, rs1, shamt; funct7 is imm[11:5] */
+	FMT_LOAD,	/* rd, imm(rs1) */
+	FMT_JALR,	/* rd, rs1, imm */
+	FMT_S,	/* rs2, imm(rs1) */
+	FMT_B,	/* rs1, rs2, pc offset */
+	FMT_U,	/* rd, imm[31:12] */
+	FMT_J,	/* rd, pc offset */
+	FMT_SYSTEM,	/* funct12 in imm */
+	FMT_AMO	/* rd, rs2, (rs1); funct7 is funct5 plus the aq and rl bits */
+} isa_format_t;
+
+#define ISA_ANY 0xFF	/* funct3/funct7 not part of the match */
+#define ISA_INTERNAL 0xFF	/* opcode of an entry no encoding decodes to */
+
+/* The instruction set, one line per instruction. opcode, funct3 and funct7 */
+/* select it and format says where its operands are; the name gives its OP_ */
+/* number, exec_ handler, threaded-interpreter label and mnemonic. Adding an */
+/* instruction is one line here plus its handler and label.                 */
+#define INSTRUCTION_LIST(X) \
+	/* name          opcode        funct3   funct7   format */ \
+	X(invalid,       ISA_INTERNAL, ISA_ANY, ISA_ANY, NONE) \
+	X(nop,           0x00,         ISA_ANY, ISA_ANY, NONE) \
+	X(lui,           0x37,         ISA_ANY, ISA_ANY, U) \
+	X(auipc,         0x17,         ISA_ANY, ISA_ANY, U) \
+	X(jal,           0x6F,         ISA_ANY, ISA_ANY, J) \
+	X(jalr,          0x67,         0,       ISA_ANY, JALR) \
+	X(beq,           0x63,         0,       ISA_ANY, B) \
+	X(bne,           0x63,         1,       ISA_ANY, B) \
+	X(blt,           0x63,         4,       ISA_ANY, B) \
+	X(bge,           0x63,         5,       ISA_ANY, B) \
+	X(bltu,          0x63,         6,       ISA_ANY, B) \
+	X(bgeu,          0x63,         7,       ISA_ANY, B) \
+	X(lb,            0x03,         0,       ISA_ANY, LOAD) \
+	X(lh,            0x03,         1,       ISA_ANY, LOAD) \
+	X(lw,            0x03,         2,       ISA_ANY, LOAD) \
+	X(lbu,           0x03,         4,       ISA_ANY, LOAD) \
+	X(lhu,           0x03,         5,       ISA_ANY, LOAD) \
+	X(sb,            0x23,         0,       ISA_ANY, S) \
+	X(sh,            0x23,         1,       ISA_ANY, S) \
+	X(sw,            0x23,         2,       ISA_ANY, S) \
+	X(addi,          0x13,         0,       ISA_ANY, I) \
+	X(slti,          0x13,         2,       ISA_ANY, I) \
+	X(sltiu,         0x13,         3,       ISA_ANY, I) \
+	X(xori,          0x13,         4,       ISA_ANY, I) \
+	X(ori,           0x13,         6,       ISA_ANY, I) \
+	X(andi,          0x13,         7,       ISA_ANY, I) \
+	X(slli,          0x13,         1,       0x00,    SHIFT) \
+	X(srli,          0x13,         5,       0x00,    SHIFT) \
+	X(srai,          0x13,         5,       0x20,    SHIFT) \
+	X(add,           0x33,         0,       0x00,    R) \
+	X(sub,           0x33,         0,       0x20,    R) \
+	X(sll,           0x33,         1,       0x00,    R) \
+	X(slt,           0x33,         2,       0x00,    R) \
+	X(sltu,          0x33,         3,       0x00,    R) \
+	X(xor,           0x33,         4,       0x00,    R) \
+	X(srl,           0x33,         5,       0x00,    R) \
+	X(sra,           0x33,         5,       0x20,    R) \
+	X(or,            0x33,         6,       0x00,    R) \
+	X(and,           0x33,         7,       0x00,    R) \
+	X(fence,         0x0F,         0,       ISA_ANY, NONE) \
+	X(fence_i,       0x0F,         1,       ISA_ANY, NONE) \
+	X(lr_w,          0x2F,         2,       0x08,    AMO) \
+	X(sc_w,          0x2F,         2,       0x0C,    AMO) \
+	X(amoswap_w,     0x2F,         2,       0x04,    AMO) \
+	X(amoadd_w,      0x2F,         2,       0x00,    AMO) \
+	X(amoxor_w,      0x2F,         2,       0x10,    AMO) \
+	X(amoand_w,      0x2F,         2,       0x30,    AMO) \
+	X(amoor_w,       0x2F,         2,       0x20,    AMO) \
+	X(amomin_w,      0x2F,         2,       0x40,    AMO) \
+	X(amomax_w,      0x2F,         2,       0x50,    AMO) \
+	X(amominu_w,     0x2F,         2,       0x60,    AMO) \
+	X(amomaxu_w,     0x2F,         2,       0x70,    AMO) \
+	X(ecall,         0x73,         0,       ISA_ANY, SYSTEM)	/* ebreak too; isa_decode_op rejects the rest */
+
+#define OP_ENUM(name, opcode, f3, f7, format) OP_##name,
+typedef enum { INSTRUCTION_LIST(OP_ENUM) NUM_OPS } op_t;
+#undef OP_ENUM
+
+struct sim;
+
+typedef struct decoded_insn {
+	void (*handler)(struct sim *sim, const struct decoded_insn *);
+	uint8_t op;	/* op_t, used by the threaded interpreter */
+	uint8_t rd, rs1, rs2;
+	uint32_t imm;	/* sign-extended, or the shift amount for shifts */
+} decoded_insn_t;
+
+typedef struct {
+	uint8_t opcode, f3, f7;
+	uint8_t format;	/* isa_format_t */
+	void (*exec)(struct sim *sim, const decoded_insn_t *);
+	const char *mnemonic;
+} isa_entry_t;
+
+/* INSTRUCTION_LIST as data, indexed by op */
+extern const isa_entry_t ISA_TABLE[NUM_OPS];
+
+/* funct12 of ebreak; it shares opcode, funct3 and funct7 with ecall */
+#define FUNCT12_EBREAK 1
+
+/* the aq and rl bits at the bottom of an atomic's funct7 do not select it */
+#define AMO_ORDERING_BITS 0x03
+
+/* Decoder tables built from ISA_TABLE by isa_init(). DECODE_MAJOR maps    */
+/* opcode and funct3 to an op, or, for instructions that also need funct7, */
+/* to DECODE_MINOR_FLAG plus the DECODE_MINOR table keyed by funct7.       */
+#define DECODE_MINOR_FLAG 0x80
+#define DECODE_MINOR_TABLES 16
+extern uint8_t DECODE_MAJOR[128][8];
+extern uint8_t DECODE_MINOR[DECODE_MINOR_TABLES][128];
+
+/* Instruction fields and immediates, sign-extended with shifts */
+#define SIGN_EXTEND(value, bits) ((uint32_t)((int32_t)((uint32_t)(value) << (32 - (bits))) >> (32 - (bits))))
+#define INSN_OPCODE(w) ((w) & 0x7F)
+#define INSN_RD(w) (((w) >> 7) & 0x1F)
+#define INSN_F3(w) (((w) >> 12) & 0x7)
+#define INSN_RS1(w) (((w) >> 15) & 0x1F)
+#define INSN_RS2(w) (((w) >> 20) & 0x1F)
+#define INSN_F7(w) ((w) >> 25)
+#define IMM_I(w) SIGN_EXTEND((w) >> 20, 12)
+#define IMM_S(w) SIGN_EXTEND((((w) >> 20) & 0xFE0) | (((w) >> 7) & 0x1F), 12)
+#define IMM_B(w) SIGN_EXTEND((((w) >> 19) & 0x1000) | (((w) << 4) & 0x800) | \
+	(((w) >> 20) & 0x7E0) | (((w) >> 7) & 0x1E), 13)
+#define IMM_U(w) ((w) & 0xFFFFF000)
+#define IMM_J(w) SIGN_EXTEND((((w) >> 11) & 0x100000) | ((w) & 0xFF000) | \
+	(((w) >> 9) & 0x800) | (((w) >> 20) & 0x7FE), 21)
+
+/******************************************************************************/
+/* Basic-block cache                                                          */
+/******************************************************************************/
+/* A block is a straight run of decoded instructions ending at a branch, jal, */
+/* jalr or an instruction that stops the simulation. It never crosses a page  */
+/* or the end of the program, so the threaded core checks for the end of the  */
+/* program once per block. Each block remembers the blocks it last exited to, */
+/* so hot loops go from block to block without a hash lookup.                 */
+/* Blocks hold copies of decoded slots: when a store clears a slot,           */
+/* BLOCK_FLUSH_PENDING is raised and the cache is dropped at the next block   */
+/* boundary.                                                                  */
+#define BLOCK_MAX_INSNS 64
+#define BLOCK_HASH_BITS 12
+#define BLOCK_HASH_SIZE (1 << BLOCK_HASH_BITS)
+#define BLOCK_HASH(pc) (((pc) >> 2) & (BLOCK_HASH_SIZE - 1))
+
+typedef uint32_t (*jit_fn_t)(struct sim *sim);
+
+typedef struct block {
+	uint32_t start_pc;
+	uint32_t len;	/* instructions, including the one that ends the block */
+	struct block *hash_next;
+	struct block *exit[2];	/* [0] fall-through or last jalr target, [1] taken */
+	uint32_t exec_count;	/* entries so far, counted under ENGINE_JIT */
+	jit_fn_t jit;	/* host translation, NULL until the block gets hot */
+	decoded_insn_t insns[];
+} block_t;
+
+
+/******************************************************************************/
+/* x86-64 block translator (jit.c)                                            */
+/******************************************************************************/
+/* Under ENGINE_JIT the threaded core counts how often each block is entered  */
+/* and translates it to host code on the JIT_THRESHOLD-th entry. Translated   */
+/* code works on sim->CURRENT_STATE in place and calls the mem_read/mem_write fast */
+/* paths. It stops in front of anything it does not translate (ecall, ebreak, */
+/* invalid encodings) and lets the interpreter run it.                        */
+/* Each simulation's translations live in its own mmap'd buffer, which is   */
+/* emptied together with its block cache.                                    */
+#define JIT_THRESHOLD 32
+#define JIT_CODE_SIZE (16 << 20)
+
 #define RISCV_REGS 32
 
+/* x0 is hardwired to zero without any test: the decoder turns rd == 0 into */
+/* REG_SINK, an extra slot past the register file that absorbs those writes */
+#define REG_SINK RISCV_REGS
+
+/* x1 (ra) and x5 (t0) hold return addresses by convention */
+#define REG_IS_LINK(r) ((r) == 1 || (r) == 5)
+
 typedef struct CPU_State_Struct {
 
   uint32_t PC;		                   /* program counter */
-  uint32_t REGS[RISCV_REGS]; /* register file. */
+  uint32_t REGS[RISCV_REGS + 1]; /* register file, plus the REG_SINK slot. */
   uint32_t HI, LO;                          /* special regs for mult/div. */
 } CPU_State;
 
+/******************************************************************************/
+/* Shared program images                                                      */
+/******************************************************************************/
+/* A program is loaded once per process. The first load_program() of a file */
+/* runs the loader as usual and keeps every non-zero page it produced: the  */
+/* ones it used in place stay pages of the program file, the rest are       */
+/* copied into a memfd. It also decodes the program's words. Later loads of */
+/* the same file, from any simulation or thread, skip the loader. The pages */
+/* are mapped private into each simulation, back to back, and become guest  */
+/* pages in place, so a simulation only gets its own copy of the pages it   */
+/* writes. reset() restores pages from one read-only mapping shared by      */
+/* every simulation. The decoded text pages are read-only and shared too;   */
+/* only the program's own words are decoded, so data sharing a page with    */
+/* the text is never taken for code. DECODE_DIR points at them until a      */
+/* store or reset changes the code on a page, or a word past the program    */
+/* is fetched from one; the simulation then gets a private copy of that     */
+/* decoded page.                                                             */
+/* Images nobody uses are kept, up to IMAGE_CACHE_MAX of them, for the next */
+/* load. A file is the same if its device, inode, size and modification     */
+/* time are.                                                                 */
+#define IMAGE_CACHE_MAX 8
+#define IMAGE_FROM_FILE (1ULL << 63)
+
+typedef struct program_image {
+	struct program_image *next;	/* cache list, most recently loaded first */
+	uint64_t dev, ino, size, mtime;	/* the file it was loaded from */
+	int raw;	/* loaded with RAW_BINARY */
+	uint32_t users;	/* simulations it is loaded into */
+
+	int fd;	/* memfd with the pages the loader copied, back to back */
+	int file_fd;	/* the program file, if the loader used pages of it in place, else -1 */
+	uint32_t num_pages;
+	uint32_t *pages;	/* guest page number of each */
+	uint64_t *offsets;	/* where each comes from: in file_fd with IMAGE_FROM_FILE, else in fd */
+	const uint8_t *pristine;	/* all of them mapped read-only */
+
+	struct decoded_insn *decoded;	/* text pages, decoded, DECODE_PAGE_ENTRIES slots each */
+	uint32_t decoded_first;	/* guest page number of the first text page */
+	uint32_t num_decoded;
+
+	CPU_State state;	/* registers and PC the loader set */
+	uint32_t program_base, program_size;
+	symbol_t *symbols;
+	uint32_t num_symbols;
+} program_image_t;
+
+/******************************************************************************/
+/* Interval checkpoints                                                       */
+/******************************************************************************/
+/* Interval checkpoints are kept in memory while a program fast-forwards    */
+/* (mu-riscv-sample). Each holds the CPU state and a copy of every page      */
+/* written since the program was loaded. A page that has not changed since */
+/* the previous interval checkpoint is shared with it, so taking one costs  */
+/* copies of only the pages that changed. Pages are reference counted and   */
+/* go away with the last checkpoint holding them.                           */
+typedef struct {
+	uint32_t refs;	/* interval checkpoints holding it, updated atomically */
+	uint8_t data[PAGE_SIZE];
+} interval_page_t;
+
+typedef struct {
+	uint32_t refs;	/* holders, 1 when taken; updated atomically */
+	uint64_t start;	/* instructions retired before the interval */
+	CPU_State state;
+	uint32_t num_pages;
+	uint32_t *pages;	/* guest page numbers, ascending */
+	interval_page_t **data;	/* contents of each */
+} interval_t;
+
+/******************************************************************************/
+/* Execution statistics                                                       */
+/******************************************************************************/
+/* With STATS_ON set, every core counts the instructions it retires per op, */
+/* which is per opcode and funct, and the conditional branches it takes.    */
+/* The threaded core counts a block at a time when control leaves it, and  */
+/* translated blocks are counted the same way, so the JIT runs unchanged.  */
+/* Load and store widths follow from the ops. run_budget() also adds up the */
+/* host time it spends, for simulated MIPS. Switched off, the counters cost */
+/* one test per block; build with -DSIM_STATS=0 to leave them out.          */
+#ifndef SIM_STATS
+#define SIM_STATS 1
+#endif
+
+typedef struct {
+	uint64_t ops[NUM_OPS];	/* retired, per op */
+	uint64_t taken;	/* conditional branches that went to their target */
+	uint64_t nanoseconds;	/* host time spent in run_budget() */
+} stats_t;
+
+/******************************************************************************/
+/* Instruction trace                                                          */
+/******************************************************************************/
+/* While a trace is open, run_budget() steps the classic core and every     */
+/* retired instruction leaves a trace_record_t in a single-producer ring.   */
+/* A writer thread drains the ring and encodes the records to the file, so  */
+/* the simulation only waits if the ring is full. Instructions that do not  */
+/* retire (invalid ones, atomics that fault) are not traced.                */
+/*                                                                          */
+/* The file is a trace_header_t followed by one entry per instruction: a    */
+/* flags byte, then, each only when needed, the PC, the instruction word,   */
+/* the value written to rd and the memory address. Numbers are LEB128       */
+/* varints of zigzag-encoded deltas:                                        */
+/*   TRACE_JUMP  PC, as a delta from the previous PC + 4                    */
+/*   TRACE_WORD  the word, 4 bytes little-endian; otherwise it is the word  */
+/*               the last entry in its TRACE_WORD_CACHE slot had, a slot    */
+/*               being picked by PC                                         */
+/*   rd value    if the word writes an rd other than x0, as a delta from    */
+/*               the last value traced for that register (0 at the start)   */
+/*   address     for loads, stores and atomics, as a delta from the last    */
+/*               traced address                                             */
+/* The decoder keeps the same state and so needs no more than this.         */
+#define TRACE_MAGIC "MURVTRCE"
+#define TRACE_VERSION 1
+#define TRACE_RING_BITS 16
+#define TRACE_RING_SIZE (1 << TRACE_RING_BITS)
+#define TRACE_WORD_CACHE 4096
+#define TRACE_JUMP 0x01
+#define TRACE_WORD 0x02
+
+typedef struct {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+} trace_header_t;
+
+typedef struct {
+	uint32_t pc;
+	uint32_t instruction;
+	uint32_t value;	/* rd after the instruction */
+	uint32_t address;	/* rs1 + imm before it */
+} trace_record_t;
+
+/******************************************************************************/
+/* Profiler                                                                   */
+/******************************************************************************/
+/* The profiler sees retired instructions when statistics do (see above)   */
+/* and counts them per PC, through a page directory like DECODE_DIR. A      */
+/* basic block starts after any control transfer; each start counts how    */
+/* often it was entered and how many instructions ran from it until the    */
+/* next one.                                                                 */
+/*                                                                          */
+/* It also follows the guest call stack, the way a return-address stack    */
+/* would: a jal or jalr writing ra or t0 is a call, a jalr through ra or t0 */
+/* that doesn't write one is a return, and one that does both is a return  */
+/* and a call unless it reads and writes the same one. The stacks seen are */
+/* kept as a calling-context tree rooted at the program entry, every node  */
+/* counting the instructions retired with exactly that stack. Calls      */
+/* deeper than PROFILE_MAX_DEPTH are counted in the deepest node.           */
+#define PROFILE_MAX_DEPTH 256
+#define PROFILE_TOP 20	/* rows in the hot tables */
+
+typedef struct {
+	uint64_t insns[DECODE_PAGE_ENTRIES];	/* retired, per instruction */
+	uint64_t entries[DECODE_PAGE_ENTRIES];	/* blocks started here */
+	uint64_t block_insns[DECODE_PAGE_ENTRIES];	/* retired by the blocks started here */
+} profile_page_t;
+
+typedef struct profile_node {
+	uint32_t function;	/* address called, or the program entry at the root */
+	uint64_t count;	/* instructions retired with this call stack */
+	struct profile_node *parent, *child, *sibling;
+} profile_node_t;
+
+typedef struct {
+	profile_page_t **dir[PAGE_DIR_ENTRIES];
+	profile_node_t root;
+	profile_node_t *current;	/* the call stack now */
+	uint32_t depth;	/* of current */
+	uint32_t lost;	/* calls made past PROFILE_MAX_DEPTH and not yet returned from */
+	uint32_t block_pc;	/* start of the block running now */
+	int block_start;	/* the next instruction starts a block */
+	uint64_t total;
+} profile_t;
+
+typedef struct trace {
+	uint64_t head;	/* records produced; written by the simulation only */
+	uint64_t tail_seen;	/* the simulation's last look at tail */
+	char pad0[64 - 2 * sizeof(uint64_t)];	/* keep the two ends on separate cache lines */
+	uint64_t tail;	/* records written out; written by the writer only */
+	int stop;	/* no more records are coming */
+	char pad1[64 - sizeof(uint64_t) - sizeof(int)];
+	trace_record_t ring[TRACE_RING_SIZE];
+	FILE *out;
+	pthread_t writer;
+} trace_t;
+
+/******************************************************************************/
+/* Cache model                                                                */
+/******************************************************************************/
+/* While the cache model is on, run_budget() steps the classic core and     */
+/* every retired instruction is looked up in the L1 instruction cache, and  */
+/* its load, store or atomic in the L1 data cache. Both miss into a shared  */
+/* L2, which misses into memory. Only timing is modelled: the caches hold   */
+/* tags, never data, so turning the model on changes no results.            */
+/*                                                                          */
+/* Each level has its own size, associativity and line size (powers of     */
+/* two), replacement policy and write policy. Write-back levels allocate on */
+/* a write miss and write dirty victims to the next level; write-through    */
+/* levels pass every write on and do not allocate. Writes never stall, as   */
+/* if buffered. A fetch or data access stalls for the latency of every      */
+/* level it misses past, up to memory, and the stalls and the hits and      */
+/* misses of each level are counted per region of the address space.      */
+#define CACHE_L1I 0
+#define CACHE_L1D 1
+#define CACHE_L2 2
+#define CACHE_LEVELS 3
+#define CACHE_MAX_WAYS 64	/* the PLRU tree of a set fits in a uint64_t */
+#define CACHE_LRU 0
+#define CACHE_PLRU 1
+#define CACHE_VALID 0x01
+#define CACHE_DIRTY 0x02
+
+/* where an access went, for the reports */
+#define CACHE_TEXT 0
+#define CACHE_DATA 1	/* static data and heap, below the stack pointer */
+#define CACHE_STACK 2	/* from the stack pointer up */
+#define CACHE_OTHER 3
+#define CACHE_REGIONS 4
+
+typedef struct {
+	uint32_t size, ways, line;	/* bytes, lines per set, bytes */
+	uint32_t latency;	/* cycles to hit */
+	uint8_t policy;	/* CACHE_LRU or CACHE_PLRU */
+	uint8_t write_back;
+} cache_config_t;
+
+typedef struct cache_level {
+	cache_config_t config;
+	uint32_t sets, line_shift;
+	uint32_t *tags;	/* line address, per way of each set */
+	uint8_t *state;	/* CACHE_VALID and CACHE_DIRTY, per way */
+	uint64_t *stamps;	/* LRU: when each way was last used */
+	uint64_t *plru;	/* PLRU: the tree bits of each set */
+	uint64_t clock;
+	uint64_t accesses[CACHE_REGIONS], misses[CACHE_REGIONS];
+	uint64_t writebacks;	/* dirty lines written to the next level */
+	struct cache_level *next;	/* NULL: memory */
+} cache_level_t;
+
+typedef struct {
+	cache_level_t levels[CACHE_LEVELS];
+	uint32_t memory_latency;
+	uint64_t memory_reads, memory_writes;	/* lines or words past the L2 */
+	uint64_t stalls[CACHE_REGIONS];	/* cycles beyond an L1 hit */
+} cache_t;
+
+/******************************************************************************/
+/* Branch prediction                                                          */
+/******************************************************************************/
+/* The predictors see retired instructions when statistics do (see above). */
+/* Every conditional branch is predicted by the selected direction model   */
+/* and then trains it:                                                      */
+/*   static   backward taken, forward not taken                            */
+/*   bimodal  2-bit counters indexed by PC                                  */
+/*   gshare   2-bit counters indexed by PC xor the global branch history    */
+/*   tage     a bimodal base plus BPRED_TAGE_TABLES tagged tables over     */
+/*            geometrically longer histories; the longest match predicts   */
+/* Returns (the jalrs the profiler takes as returns) are predicted by a     */
+/* return-address stack that calls push, and other jalrs by the BTB, which  */
+/* also records the target of every taken transfer. A conditional branch   */
+/* is mispredicted if its direction was, a jalr if its target was; jal      */
+/* never is. Counts are kept per PC through a page directory, for MPKI.     */
+#define BPRED_STATIC 0
+#define BPRED_BIMODAL 1
+#define BPRED_GSHARE 2
+#define BPRED_TAGE 3
+#define BPRED_TAGE_TABLES 4
+#define BPRED_TAGE_TAG_BITS 8
+#define BPRED_TAGE_AGING (1 << 18)	/* updates between halvings of the useful bits */
+#define BPRED_TOP 20	/* rows in the per-PC table */
+
+typedef struct {
+	uint8_t model;	/* BPRED_STATIC ... BPRED_TAGE */
+	uint32_t table_bits;	/* log2 of the counters; each tagged table has a quarter */
+	uint32_t history_bits;	/* global history gshare uses; the longest TAGE history */
+	uint32_t btb_bits;	/* log2 of the BTB entries */
+	uint32_t ras_depth;
+} bpred_config_t;
+
+typedef struct {
+	int8_t counter;	/* -4..3, taken from 0 up */
+	uint8_t useful;	/* 0..3 */
+	uint16_t tag;
+} bpred_tagged_t;
+
+typedef struct {
+	uint32_t pc, target;
+	int valid;
+} bpred_btb_t;
+
+typedef struct {
+	uint64_t executed[DECODE_PAGE_ENTRIES];
+	uint64_t taken[DECODE_PAGE_ENTRIES];
+	uint64_t mispredicted[DECODE_PAGE_ENTRIES];
+} bpred_page_t;
+
+typedef struct {
+	bpred_config_t config;
+	uint8_t *counters;	/* 0..3, taken from 2 up; the TAGE base */
+	bpred_tagged_t *tagged[BPRED_TAGE_TABLES];
+	uint32_t lengths[BPRED_TAGE_TABLES];	/* history bits of each tagged table */
+	uint64_t history;	/* conditional branch outcomes, newest in bit 0 */
+	uint64_t updates;
+	bpred_btb_t *btb;
+	uint32_t *ras;
+	uint32_t ras_top, ras_count;	/* ras_top is the next free slot */
+	bpred_page_t **dir[PAGE_DIR_ENTRIES];
+	uint64_t instructions;
+	uint64_t branches, taken, mispredicted;	/* conditional branches */
+	uint64_t returns, returns_mispredicted;
+	uint64_t indirect, indirect_mispredicted;	/* jalrs that aren't returns */
+	uint64_t btb_lookups, btb_hits;
+} bpred_t;
+
 
 /***************************************************************/
 /* CPU State info.                                                                                                               */
 /***************************************************************/
 
-CPU_State CURRENT_STATE, NEXT_STATE;
-int RUN_FLAG;	/* run flag*/
-uint32_t INSTRUCTION_COUNT;
-uint32_t PROGRAM_SIZE; /*in words*/
+/* Why run_budget() returned */
+typedef enum {
+	RUN_BUDGET,	/* executed the whole budget */
+	RUN_ECALL,	/* retired an ecall; the call number is in a7 */
+	RUN_BREAKPOINT,	/* retired an ebreak */
+	RUN_ILLEGAL,	/* PC is at an instruction that does not decode */
+	RUN_HALTED	/* the program ran off the end of its text, or already had */
+} run_exit_t;
+
+typedef struct {
+	run_exit_t reason;
+	uint32_t executed;	/* instructions retired by this call */
+	uint32_t pc;	/* the instruction that caused the exit, or the next PC */
+	uint32_t hart;	/* under harts_run(), the hart that caused the exit */
+} run_result_t;
+
+/* interpreter cores for sim->ENGINE */
+#define ENGINE_CLASSIC 0	/* handle_instruction() per cycle, kept for reference */
+#define ENGINE_THREADED 1	/* computed-goto dispatch, see run_threaded() */
+#define ENGINE_JIT 2	/* threaded, plus host code for hot blocks */
 
-char prog_file[32];
+/******************************************************************************/
+/* Work-stealing job deques                                                   */
+/******************************************************************************/
+/* mu-riscv-batch deals job numbers out to one deque per worker. The owner  */
+/* pops from the bottom and other workers steal from the top, as in the     */
+/* Chase-Lev deque; jobs are only ever taken, never pushed, so a deque is  */
+/* just the range [top, bottom). Each job is handed out exactly once.       */
+typedef struct {
+	_Atomic int64_t top;	/* next job a thief takes */
+	_Atomic int64_t bottom;	/* one past the next job the owner takes */
+	char pad[64 - 2 * sizeof(int64_t)];	/* keep deques on separate cache lines */
+} job_deque_t;
+
+/******************************************************************************/
+/* Harts                                                                      */
+/******************************************************************************/
+/* A machine with NUM_HARTS > 1 is one sim_t per hart. Hart 0 is the sim the  */
+/* program is loaded into: it owns guest memory and keeps the others in     */
+/* HARTS. The other harts are created by harts_start() whenever the program */
+/* is loaded or reset. They reach guest memory through MEMORY and have      */
+/* their own CPU state, TLBs, decoded pages, blocks and JIT buffer.         */
+/* They start where hart 0 does, with their hart id in a0 and tp and sp     */
+/* HART_STACK_SIZE below the previous hart's.                               */
+/*                                                                          */
+/* Without LOCKSTEP every hart runs on its own host thread and pages are    */
+/* allocated under MEMORY_LOCK; a hart notices that another one stopped the */
+/* machine within HART_SLICE instructions. With LOCKSTEP set, the harts     */
+/* take turns on the calling thread, LOCKSTEP instructions at a time, so   */
+/* every run of a program interleaves the same way.                         */
+/*                                                                          */
+/* Atomics work on host memory with host atomics. sc.w succeeds if the word */
+/* still holds the value lr.w read. A hart sees code another hart wrote     */
+/* once it executes fence.i.                                                */
+#define MAX_HARTS 64
+#define HART_STACK_SIZE 0x10000
+#define HART_SLICE 100000
+
+/******************************************************************************/
+/* Simulator context                                                          */
+/******************************************************************************/
+/* Everything one simulation owns: CPU state, guest memory, caches and the  */
+/* loaded program. Every core function takes the sim_t it works on, so one  */
+/* process can host any number of independent simulations; only the        */
+/* read-only decoder tables, ZERO_PAGE and the output policy are shared.    */
+/* Create one with sim_create(), which also does initialize().              */
+typedef struct sim {
+	/* Every core updates CURRENT_STATE in place. Handlers of the classic    */
+	/* core find NEXT_PC set to PC + 4 and overwrite it to transfer control. */
+	CPU_State CURRENT_STATE;
+	CPU_State PRISTINE_STATE;	/* registers and PC right after loading */
+	uint32_t NEXT_PC;
+	run_exit_t RUN_EXIT;	/* set by classic handlers that end a run_budget() */
+	int RUN_FLAG;	/* run flag*/
+	uint64_t INSTRUCTION_COUNT;
+	uint32_t PROGRAM_SIZE; /*in words*/
+	uint32_t PROGRAM_BASE;	/* address of the first program word */
+	int ENGINE;	/* interpreter core used by run/sim */
+	uint32_t RESERVATION;	/* address lr.w reserved, TLB_INVALID if none */
+	uint32_t RESERVED_VALUE;	/* what lr.w read there */
+
+	/* the machine this hart belongs to */
+	struct sim *MEMORY;	/* hart 0, which owns guest memory; itself for hart 0 */
+	uint32_t HART_ID;
+	uint32_t NUM_HARTS;	/* -H: harts of the machine, set on hart 0 */
+	uint32_t LOCKSTEP;	/* -L: instructions per turn, 0 for a thread per hart */
+	struct sim *HARTS[MAX_HARTS];	/* on hart 0, every hart including itself */
+	pthread_mutex_t MEMORY_LOCK;	/* on hart 0, taken to add pages when NUM_HARTS > 1 */
+
+	char prog_file[256];
+	int QUIET_LOAD;	/* -q: no per-word or per-segment logging */
+	int RAW_BINARY;	/* -b: the program is a flat image for MEM_TEXT_BEGIN */
+	char LOAD_ERROR[256];	/* why the last load_program() failed */
+	FILE *OUTPUT;	/* where the program's ecalls print, stdout by default */
+	int CAPTURE_OUTPUT;	/* batch_run() reports that output in the JSON instead */
+	int STATS_ON;	/* count into STATS */
+	stats_t STATS;
+	trace_t *TRACE;	/* open instruction trace, or NULL */
+	profile_t *PROFILE;	/* profiler, or NULL when it is off */
+	cache_t *CACHE;	/* cache model, or NULL when it is off */
+	cache_config_t CACHE_CONFIG[CACHE_LEVELS];	/* for the next cache_start(); zero: the default */
+	uint32_t CACHE_MEMORY_LATENCY;	/* zero: the default */
+	bpred_t *BPRED;	/* branch predictors, or NULL when they are off */
+	bpred_config_t BPRED_CONFIG;	/* for the next bpred_start(); table_bits zero: the default */
+
+	/* guest memory and the state reset() goes back to */
+	uint8_t **PAGE_DIR[PAGE_DIR_ENTRIES];
+	uint32_t PAGES_ALLOCATED;
+	uint8_t DIRTY_BITMAP[NUM_GUEST_PAGES / 8];
+	uint32_t *DIRTY_PAGES;	/* page numbers, in the order first written */
+	uint32_t NUM_DIRTY_PAGES;
+	uint32_t DIRTY_CAPACITY;
+	const uint8_t **PRISTINE_DIR[PAGE_DIR_ENTRIES];
+	tlb_entry_t TLB_READ[TLB_ENTRIES];
+	tlb_entry_t TLB_WRITE[TLB_ENTRIES];
+	uint8_t *FREE_PAGES;	/* released host pages, linked through their first word */
+	uint32_t NUM_FREE_PAGES;
+
+	/* decoded instructions and basic blocks */
+	decoded_insn_t **DECODE_DIR[PAGE_DIR_ENTRIES];
+	uint32_t DECODE_LAST_BASE;	/* page the last fetch came from, so straight-line code skips the walk */
+	decoded_insn_t *DECODE_LAST_PAGE;
+	decoded_insn_t UNALIGNED_INSN;	/* decoded form of a fetch from a misaligned pc */
+	block_t *BLOCK_HASH_TABLE[BLOCK_HASH_SIZE];
+	int BLOCK_FLUSH_PENDING;
+	uint8_t *JIT_CODE;	/* RWX translation buffer, mapped on first use */
+	size_t JIT_USED;
+
+	/* program file, symbols and the last restored checkpoint */
+	program_image_t *IMAGE;	/* shared image of the loaded program */
+	uint8_t *PROGRAM_IMAGE;	/* the loader's program file, or IMAGE's pages, mapped private */
+	const uint8_t *PROGRAM_PRISTINE;	/* the same mapped read-only, for reset() */
+	size_t PROGRAM_IMAGE_SIZE;
+	symbol_t *SYMBOLS;	/* symbols of the loaded ELF program, sorted by address; IMAGE's once loaded */
+	uint32_t NUM_SYMBOLS;
+	uint8_t *CHECKPOINT_IMAGE;	/* last restored checkpoint, mapped private */
+	size_t CHECKPOINT_IMAGE_SIZE;
+} sim_t;
+
+extern int BATCH_MODE;	/* -n/-s: no prompt, banners or status messages */
 
 
 /***************************************************************/
 /* Function Declerations.                                                                                                */
 /***************************************************************/
+sim_t *sim_create();
+void sim_destroy(sim_t *sim);
 void help();
-uint32_t mem_read_32(uint32_t address);
-void mem_write_32(uint32_t address, uint32_t value);
-void cycle();
-void run(int num_cycles);
-void runAll();
-void mdump(uint32_t start, uint32_t stop) ;
-void rdump();
-void handle_command();
-void reset();
-void init_memory();
-void load_program();
-void handle_instruction(); /*IMPLEMENT THIS*/
-void initialize();
-void print_program(); /*IMPLEMENT THIS*/
-void print_instruction(uint32_t);
\ No newline at end of file
+void sim_log(const char *format, ...) __attribute__((format(printf, 1, 2)));
+uint32_t mem_read_32(sim_t *sim, uint32_t address);
+uint16_t mem_read_16(sim_t *sim, uint32_t address);
+uint8_t mem_read_8(sim_t *sim, uint32_t address);
+void mem_write_32(sim_t *sim, uint32_t address, uint32_t value);
+void mem_write_16(sim_t *sim, uint32_t address, uint16_t value);
+void mem_write_8(sim_t *sim, uint32_t address, uint8_t value);
+void run(sim_t *sim, int num_cycles);
+void runAll(sim_t *sim);
+void mdump(sim_t *sim, uint32_t start, uint32_t stop) ;
+void rdump(sim_t *sim);
+void handle_command(sim_t *sim);
+int execute_command(sim_t *sim, FILE *in);
+void reset(sim_t *sim);
+void init_memory(sim_t *sim);
+void free_memory(sim_t *sim);
+uint8_t *mem_page_read(sim_t *sim, uint32_t address);
+uint8_t *mem_page_write(sim_t *sim, uint32_t address);
+uint8_t *mem_page_map(sim_t *sim, uint32_t address, uint8_t *page);
+void tlb_flush(sim_t *sim);
+void mem_mark_dirty(sim_t *sim, uint32_t address);
+void mem_discard_pages(sim_t *sim);
+void mem_save_pristine(sim_t *sim);
+void mem_restore_dirty(sim_t *sim);
+decoded_insn_t *decode_page_lookup(sim_t *sim, uint32_t address);
+const decoded_insn_t *fetch_decoded(sim_t *sim, uint32_t pc);
+void isa_init();
+uint8_t isa_decode_op(uint32_t instruction);
+uint32_t isa_immediate(uint32_t instruction, uint8_t format);
+void decode_instruction(uint32_t instruction, decoded_insn_t *insn);
+void decode_invalidate(sim_t *sim, uint32_t address, int width);
+void decode_flush(sim_t *sim);
+void decode_share_image(sim_t *sim);
+void decode_forget_page(sim_t *sim, uint32_t address);
+block_t *block_lookup(sim_t *sim, uint32_t pc);
+void block_flush(sim_t *sim);
+int op_ends_block(uint8_t op);
+int jit_available();
+jit_fn_t jit_compile(sim_t *sim, const block_t *block);
+void jit_reset(sim_t *sim);
+void jit_free(sim_t *sim);
+int load_program(sim_t *sim);
+int is_elf_file(const char *path);
+int load_elf(sim_t *sim, const char *path);
+int load_binary(sim_t *sim, const char *path);
+int load_hex(sim_t *sim, const char *path);
+void image_unload(sim_t *sim);
+int image_load(sim_t *sim);
+void image_release(program_image_t *image);
+int image_owns_page(sim_t *sim, const uint8_t *page);
+const uint8_t *image_pristine_page(sim_t *sim, const uint8_t *page);
+int checkpoint_save(sim_t *sim, const char *path);
+int checkpoint_restore(sim_t *sim, const char *path);
+int checkpoint_owns_page(sim_t *sim, const uint8_t *page);
+void checkpoint_unload(sim_t *sim);
+interval_t *interval_take(sim_t *sim, const interval_t *prev, uint64_t start);
+void interval_restore(sim_t *sim, const interval_t *interval);
+void interval_release(interval_t *interval);
+const symbol_t *symbol_lookup(sim_t *sim, uint32_t address);
+int symbol_address(sim_t *sim, const char *name, uint32_t *address);
+void handle_instruction(sim_t *sim); /*IMPLEMENT THIS*/
+run_result_t run_budget(sim_t *sim, uint32_t budget);
+int handle_run_exit(sim_t *sim, run_result_t result);
+void SYSCALL_Processing(sim_t *sim, uint32_t code);
+run_result_t run_threaded(sim_t *sim, uint32_t budget);
+void initialize(sim_t *sim);
+void batch_run(sim_t *sim, const char *script, uint64_t limit, FILE *out);
+void deque_init(job_deque_t *deque, int64_t top, int64_t bottom);
+int64_t deque_pop(job_deque_t *deque);
+int64_t deque_steal(job_deque_t *deque);
+void json_string(FILE *out, const char *s, size_t len);
+void stats_retire(sim_t *sim, const decoded_insn_t *insns, uint32_t count, uint32_t pc, uint32_t next_pc);
+void stats_clear(sim_t *sim);
+void stats_print(sim_t *sim);
+void stats_json(sim_t *sim, FILE *out);
+int trace_open(sim_t *sim, const char *path);
+void trace_close(sim_t *sim);
+void trace_record(sim_t *sim, uint32_t pc, uint32_t instruction, uint32_t value, uint32_t address);
+int trace_decode(FILE *in, FILE *out, uint64_t limit);
+int profile_start(sim_t *sim);
+void profile_stop(sim_t *sim);
+void profile_clear(sim_t *sim);
+void profile_retire(sim_t *sim, const decoded_insn_t *insns, uint32_t count, uint32_t pc, uint32_t next_pc);
+void profile_print(sim_t *sim, uint32_t top);
+int profile_collapsed(sim_t *sim, const char *path);
+void profile_json(sim_t *sim, FILE *out, uint32_t top);
+int cache_start(sim_t *sim);
+void cache_stop(sim_t *sim);
+void cache_clear(sim_t *sim);
+int cache_configure(sim_t *sim, uint32_t level, const cache_config_t *config);
+void cache_retire(sim_t *sim, const decoded_insn_t *insn, uint32_t pc, uint32_t address);
+void cache_print(sim_t *sim);
+void cache_json(sim_t *sim, FILE *out);
+int bpred_start(sim_t *sim);
+void bpred_stop(sim_t *sim);
+void bpred_clear(sim_t *sim);
+int bpred_configure(sim_t *sim, const bpred_config_t *config);
+void bpred_retire(sim_t *sim, const decoded_insn_t *insns, uint32_t count, uint32_t pc, uint32_t next_pc);
+void bpred_print(sim_t *sim, uint32_t top);
+void bpred_json(sim_t *sim, FILE *out, uint32_t top);
+void harts_start(sim_t *sim);
+void harts_stop(sim_t *sim);
+int harts_running(sim_t *sim);
+run_result_t harts_run(sim_t *sim, uint64_t cycles);
+void print_program(sim_t *sim); /*IMPLEMENT THIS*/
+void print_instruction(sim_t *sim, uint32_t);
+void disassemble(uint32_t instruction, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,458 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mu-riscv.h"
+
+typedef struct {
+	uint32_t pc;
+	uint64_t count, insns;
+} profile_row_t;
+
+/***************************************************************/
+/* Find or create the counters for the page holding pc                               */
+/***************************************************************/
+static profile_page_t *profile_page(profile_t *profile, uint32_t pc)
+{
+	profile_page_t **table = profile->dir[PAGE_DIR_INDEX(pc)];
+
+	if (table == NULL)
+	{
+		table = calloc(PAGE_TABLE_ENTRIES, sizeof(profile_page_t *));
+		if (table == NULL)
+		{
+			printf("Error: Out of memory allocating profile table\n");
+			exit(-1);
+		}
+		profile->dir[PAGE_DIR_INDEX(pc)] = table;
+	}
+	if (table[PAGE_TABLE_INDEX(pc)] == NULL)
+	{
+		table[PAGE_TABLE_INDEX(pc)] = calloc(1, sizeof(profile_page_t));
+		if (table[PAGE_TABLE_INDEX(pc)] == NULL)
+		{
+			printf("Error: Out of memory allocating profile page for 0x%08x\n", pc);
+			exit(-1);
+		}
+	}
+	return table[PAGE_TABLE_INDEX(pc)];
+}
+
+static void profile_free_nodes(profile_node_t *node)
+{
+	profile_node_t *child, *next;
+
+	for (child = node->child; child != NULL; child = next)
+	{
+		next = child->sibling;
+		profile_free_nodes(child);
+		free(child);
+	}
+	node->child = NULL;
+}
+
+/***************************************************************/
+/* Drop every count and start again with an empty stack at the entry         */
+/***************************************************************/
+void profile_clear(sim_t *sim)
+{
+	profile_t *profile = sim->PROFILE;
+	int i, j;
+
+	if (profile == NULL)
+	{
+		return;
+	}
+	for (i = 0; i < PAGE_DIR_ENTRIES; i++)
+	{
+		if (profile->dir[i] == NULL)
+		{
+			continue;
+		}
+		for (j = 0; j < PAGE_TABLE_ENTRIES; j++)
+		{
+			free(profile->dir[i][j]);
+		}
+		free(profile->dir[i]);
+		profile->dir[i] = NULL;
+	}
+	profile_free_nodes(&profile->root);
+	memset(&profile->root, 0, sizeof(profile->root));
+	profile->root.function = sim->PRISTINE_STATE.PC;
+	profile->current = &profile->root;
+	profile->depth = 0;
+	profile->lost = 0;
+	profile->block_start = TRUE;
+	profile->total = 0;
+}
+
+/***************************************************************/
+/* Switch the profiler on. Returns FALSE if it can't be.                             */
+/***************************************************************/
+int profile_start(sim_t *sim)
+{
+	if (sim->NUM_HARTS > 1)
+	{
+		printf("Error: Profiles follow a single hart\n\n");
+		return FALSE;
+	}
+	if (sim->PROFILE != NULL)
+	{
+		return TRUE;
+	}
+	sim->PROFILE = calloc(1, sizeof(profile_t));
+	if (sim->PROFILE == NULL)
+	{
+		printf("Error: Out of memory starting the profiler\n\n");
+		return FALSE;
+	}
+	profile_clear(sim);
+	return TRUE;
+}
+
+/***************************************************************/
+/* Switch the profiler off and forget what it counted                                */
+/***************************************************************/
+void profile_stop(sim_t *sim)
+{
+	if (sim->PROFILE == NULL)
+	{
+		return;
+	}
+	profile_clear(sim);
+	free(sim->PROFILE);
+	sim->PROFILE = NULL;
+}
+
+/***************************************************************/
+/* Enter the function at target from the current call stack                        */
+/***************************************************************/
+static void profile_call(profile_t *profile, uint32_t target)
+{
+	profile_node_t *node, **link;
+
+	if (profile->depth == PROFILE_MAX_DEPTH)
+	{
+		profile->lost++;
+		return;
+	}
+	for (link = &profile->current->child; (node = *link) != NULL; link = &node->sibling)
+	{
+		if (node->function == target)
+		{
+			/* to the front, so hot callees are found first */
+			*link = node->sibling;
+			break;
+		}
+	}
+	if (node == NULL)
+	{
+		node = calloc(1, sizeof(profile_node_t));
+		if (node == NULL)
+		{
+			printf("Error: Out of memory growing the call tree\n");
+			exit(-1);
+		}
+		node->function = target;
+		node->parent = profile->current;
+	}
+	node->sibling = profile->current->child;
+	profile->current->child = node;
+	profile->current = node;
+	profile->depth++;
+}
+
+static void profile_return(profile_t *profile)
+{
+	if (profile->lost > 0)
+	{
+		profile->lost--;
+	}
+	else if (profile->current->parent != NULL)
+	{
+		profile->current = profile->current->parent;
+		profile->depth--;
+	}
+}
+
+/***************************************************************/
+/* Count count retired instructions that started at pc; control went on to */
+/* next_pc after the last of them. They never cross a page, and only the  */
+/* last can transfer control.                                                                       */
+/***************************************************************/
+void profile_retire(sim_t *sim, const decoded_insn_t *insns, uint32_t count, uint32_t pc, uint32_t next_pc)
+{
+	profile_t *profile = sim->PROFILE;
+	profile_page_t *page;
+	const decoded_insn_t *last;
+	uint32_t i, index = DECODE_INDEX(pc);
+	uint32_t rd, rs1;
+
+	if (count == 0)
+	{
+		return;
+	}
+	page = profile_page(profile, pc);
+	if (profile->block_start)
+	{
+		profile->block_pc = pc;
+		page->entries[index]++;
+	}
+	for (i = 0; i < count; i++)
+	{
+		page->insns[index + i]++;
+	}
+	if ((profile->block_pc & ~PAGE_OFFSET_MASK) != (pc & ~PAGE_OFFSET_MASK))
+	{
+		page = profile_page(profile, profile->block_pc);
+	}
+	page->block_insns[DECODE_INDEX(profile->block_pc)] += count;
+	profile->current->count += count;
+	profile->total += count;
+
+	/* the transfer at the end belongs to the caller's stack */
+	last = &insns[count - 1];
+	rd = (last->rd == REG_SINK) ? 0 : last->rd;
+	rs1 = last->rs1;
+	if (last->op == OP_jal && REG_IS_LINK(rd))
+	{
+		profile_call(profile, next_pc);
+	}
+	else if (last->op == OP_jalr)
+	{
+		if (REG_IS_LINK(rs1) && (!REG_IS_LINK(rd) || rs1 != rd))
+		{
+			profile_return(profile);
+		}
+		if (REG_IS_LINK(rd))
+		{
+			profile_call(profile, next_pc);
+		}
+	}
+	profile->block_start = op_ends_block(last->op) || next_pc != pc + 4 * count;
+}
+
+/***************************************************************/
+/* Name the code at address: its symbol, plus an offset if it is not at    */
+/* the start, or the bare address if the program has no symbols                  */
+/***************************************************************/
+static void profile_name(sim_t *sim, uint32_t address, char *buf, size_t size)
+{
+	const symbol_t *sym = symbol_lookup(sim, address);
+
+	if (sym == NULL)
+	{
+		snprintf(buf, size, "0x%08x", address);
+	}
+	else if (sym->address == address)
+	{
+		snprintf(buf, size, "%s", sym->name);
+	}
+	else
+	{
+		snprintf(buf, size, "%s+0x%x", sym->name, address - sym->address);
+	}
+}
+
+static int row_compare(const void *a, const void *b)
+{
+	const profile_row_t *x = a, *y = b;
+
+	if (x->insns != y->insns)
+	{
+		return (x->insns < y->insns) ? 1 : -1;
+	}
+	return (x->pc > y->pc) - (x->pc < y->pc);
+}
+
+/***************************************************************/
+/* The hottest PCs, or with blocks set the hottest block starts, most     */
+/* instructions first. Returns how many rows there are; free them after. */
+/***************************************************************/
+static uint32_t profile_rows(profile_t *profile, int blocks, profile_row_t **rows)
+{
+	uint32_t n = 0, capacity = 0;
+	uint32_t i, j, k;
+	profile_page_t *page;
+
+	*rows = NULL;
+	for (i = 0; i < PAGE_DIR_ENTRIES; i++)
+	{
+		for (j = 0; profile->dir[i] != NULL && j < PAGE_TABLE_ENTRIES; j++)
+		{
+			page = profile->dir[i][j];
+			for (k = 0; page != NULL && k < DECODE_PAGE_ENTRIES; k++)
+			{
+				if ((blocks ? page->entries[k] : page->insns[k]) == 0)
+				{
+					continue;
+				}
+				if (n == capacity)
+				{
+					capacity = capacity ? 2 * capacity : 1024;
+					*rows = realloc(*rows, capacity * sizeof(profile_row_t));
+					if (*rows == NULL)
+					{
+						printf("Error: Out of memory sorting the profile\n");
+						exit(-1);
+					}
+				}
+				(*rows)[n].pc = (i << (PAGE_SHIFT + PAGE_TABLE_BITS)) | (j << PAGE_SHIFT) | (k << 2);
+				(*rows)[n].count = blocks ? page->entries[k] : page->insns[k];
+				(*rows)[n].insns = blocks ? page->block_insns[k] : page->insns[k];
+				n++;
+			}
+		}
+	}
+	qsort(*rows, n, sizeof(profile_row_t), row_compare);
+	return n;
+}
+
+/***************************************************************/
+/* Print the top hottest instructions and blocks, with disassembly           */
+/***************************************************************/
+void profile_print(sim_t *sim, uint32_t top)
+{
+	profile_t *profile = sim->PROFILE;
+	profile_row_t *rows;
+	uint32_t n, i;
+	char name[96], text[64];
+
+	if (profile == NULL)
+	{
+		printf("The profiler is off.\n");
+		return;
+	}
+	printf("-------------------------------------\n");
+	printf("Hot Instructions (%llu profiled)\n", (unsigned long long)profile->total);
+	printf("-------------------------------------\n");
+	printf("[Address]\t[Count]\t[%%]\t[Instruction]\t[Function]\n");
+	n = profile_rows(profile, FALSE, &rows);
+	for (i = 0; i < n && i < top; i++)
+	{
+		disassemble(mem_read_32(sim, rows[i].pc), text, sizeof(text));
+		profile_name(sim, rows[i].pc, name, sizeof(name));
+		printf("0x%08x\t%llu\t%.2f\t%s\t<%s>\n", rows[i].pc, (unsigned long long)rows[i].insns,
+			   100.0 * rows[i].insns / profile->total, text, name);
+	}
+	free(rows);
+	printf("-------------------------------------\n");
+	printf("Hot Blocks\n");
+	printf("-------------------------------------\n");
+	printf("[Address]\t[Entries]\t[Instructions]\t[%%]\t[Function]\n");
+	n = profile_rows(profile, TRUE, &rows);
+	for (i = 0; i < n && i < top; i++)
+	{
+		profile_name(sim, rows[i].pc, name, sizeof(name));
+		printf("0x%08x\t%llu\t%llu\t%.2f\t<%s>\n", rows[i].pc, (unsigned long long)rows[i].count,
+			   (unsigned long long)rows[i].insns, 100.0 * rows[i].insns / profile->total, name);
+	}
+	free(rows);
+	printf("-------------------------------------\n");
+}
+
+/***************************************************************/
+/* Write the stacks below node in collapsed form, one "a;b;c count" line   */
+/* per stack that retired anything                                                               */
+/***************************************************************/
+static void profile_collapse(sim_t *sim, const profile_node_t *node, char *stack, size_t len, size_t size, FILE *out)
+{
+	const profile_node_t *child;
+
+	/* a stack deeper than the buffer is cut off here, with room for ';', */
+	/* one character and the terminator                                    */
+	if (len + 2 >= size)
+	{
+		return;
+	}
+	if (len > 0)
+	{
+		stack[len++] = ';';
+	}
+	profile_name(sim, node->function, stack + len, size - len);
+	len += strlen(stack + len);
+	if (node->count > 0)
+	{
+		fprintf(out, "%s %llu\n", stack, (unsigned long long)node->count);
+	}
+	for (child = node->child; child != NULL; child = child->sibling)
+	{
+		profile_collapse(sim, child, stack, len, size, out);
+	}
+}
+
+/***************************************************************/
+/* Write the call stacks to path in the collapsed format flame graph tools */
+/* read. Returns FALSE if the file could not be written.                           */
+/***************************************************************/
+int profile_collapsed(sim_t *sim, const char *path)
+{
+	size_t size = PROFILE_MAX_DEPTH * 64;
+	char *stack;
+	FILE *out;
+	int ok;
+
+	if (sim->PROFILE == NULL)
+	{
+		printf("The profiler is off.\n");
+		return FALSE;
+	}
+	out = fopen(path, "w");
+	stack = malloc(size);
+	if (out == NULL || stack == NULL)
+	{
+		printf("Error: Can't create %s\n\n", path);
+		if (out != NULL)
+		{
+			fclose(out);
+		}
+		free(stack);
+		return FALSE;
+	}
+	profile_collapse(sim, &sim->PROFILE->root, stack, 0, size, out);
+	free(stack);
+	ok = (fclose(out) == 0);
+	if (!ok)
+	{
+		printf("Error: Can't write %s\n\n", path);
+	}
+	return ok;
+}
+
+/***************************************************************/
+/* Write the top hottest instructions and blocks as one JSON object        */
+/***************************************************************/
+void profile_json(sim_t *sim, FILE *out, uint32_t top)
+{
+	profile_t *profile = sim->PROFILE;
+	profile_row_t *rows;
+	uint32_t n, i;
+	char name[96], text[64];
+
+	fprintf(out, "{\"instructions\":%llu,\"hot\":[", (unsigned long long)profile->total);
+	n = profile_rows(profile, FALSE, &rows);
+	for (i = 0; i < n && i < top; i++)
+	{
+		disassemble(mem_read_32(sim, rows[i].pc), text, sizeof(text));
+		profile_name(sim, rows[i].pc, name, sizeof(name));
+		fprintf(out, "%s{\"pc\":%u,\"count\":%llu,\"insn\":", (i == 0) ? "" : ",", rows[i].pc, (unsigned long long)rows[i].insns);
+		json_string(out, text, strlen(text));
+		fprintf(out, ",\"function\":");
+		json_string(out, name, strlen(name));
+		fprintf(out, "}");
+	}
+	free(rows);
+	fprintf(out, "],\"blocks\":[");
+	n = profile_rows(profile, TRUE, &rows);
+	for (i = 0; i < n && i < top; i++)
+	{
+		profile_name(sim, rows[i].pc, name, sizeof(name));
+		fprintf(out, "%s{\"pc\":%u,\"entries\":%llu,\"instructions\":%llu,\"function\":", (i == 0) ? "" : ",",
+				rows[i].pc, (unsigned long long)rows[i].count, (unsigned long long)rows[i].insns);
+		json_string(out, name, strlen(name));
+		fprintf(out, "}");
+	}
+	free(rows);
+	fprintf(out, "]}");
+}
@@ -0,0 +1,238 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "mu-riscv.h"
+
+/* Access widths, in bytes, of the plain loads and stores */
+static int op_load_width(uint8_t op)
+{
+	switch (op)
+	{
+	case OP_lb:
+	case OP_lbu:
+		return 1;
+	case OP_lh:
+	case OP_lhu:
+		return 2;
+	case OP_lw:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+static int op_store_width(uint8_t op)
+{
+	switch (op)
+	{
+	case OP_sb:
+		return 1;
+	case OP_sh:
+		return 2;
+	case OP_sw:
+		return 4;
+	default:
+		return 0;
+	}
+}
+
+/***************************************************************/
+/* Count count retired instructions that started at pc; control went on to */
+/* next_pc after the last of them. Only the last can be a branch.              */
+/***************************************************************/
+void stats_retire(sim_t *sim, const decoded_insn_t *insns, uint32_t count, uint32_t pc, uint32_t next_pc)
+{
+	stats_t *stats = &sim->STATS;
+	uint32_t i;
+
+	if (count == 0)
+	{
+		return;
+	}
+	for (i = 0; i < count; i++)
+	{
+		stats->ops[insns[i].op]++;
+	}
+	if (ISA_TABLE[insns[count - 1].op].format == FMT_B && next_pc != pc + 4 * count)
+	{
+		stats->taken++;
+	}
+}
+
+/***************************************************************/
+/* Zero the counters of every hart                                                                    */
+/***************************************************************/
+void stats_clear(sim_t *sim)
+{
+	uint32_t i;
+
+	for (i = 0; i < sim->NUM_HARTS; i++)
+	{
+		if (sim->HARTS[i] != NULL)
+		{
+			memset(&sim->HARTS[i]->STATS, 0, sizeof(stats_t));
+		}
+	}
+}
+
+/***************************************************************/
+/* Add up the counters of every hart. Harts on their own threads run at    */
+/* the same time, so the host time is the longest of theirs; in lockstep   */
+/* they take turns and it is the sum.                                                        */
+/***************************************************************/
+static void stats_total(sim_t *sim, stats_t *total)
+{
+	const stats_t *stats;
+	uint32_t i, op;
+
+	memset(total, 0, sizeof(*total));
+	for (i = 0; i < sim->NUM_HARTS; i++)
+	{
+		if (sim->HARTS[i] == NULL)
+		{
+			continue;
+		}
+		stats = &sim->HARTS[i]->STATS;
+		for (op = 0; op < NUM_OPS; op++)
+		{
+			total->ops[op] += stats->ops[op];
+		}
+		total->taken += stats->taken;
+		if (sim->LOCKSTEP > 0 || sim->NUM_HARTS == 1)
+		{
+			total->nanoseconds += stats->nanoseconds;
+		}
+		else if (stats->nanoseconds > total->nanoseconds)
+		{
+			total->nanoseconds = stats->nanoseconds;
+		}
+	}
+}
+
+/* Everything the reports show, derived from the per-op counts */
+typedef struct {
+	uint64_t instructions;
+	uint64_t opcodes[128];
+	uint64_t loads[5], stores[5];	/* by width in bytes */
+	uint64_t branches, atomics;
+	double seconds, mips;
+} stats_summary_t;
+
+static void stats_summarize(const stats_t *stats, stats_summary_t *summary)
+{
+	uint32_t op;
+
+	memset(summary, 0, sizeof(*summary));
+	for (op = 0; op < NUM_OPS; op++)
+	{
+		if (stats->ops[op] == 0)
+		{
+			continue;
+		}
+		summary->instructions += stats->ops[op];
+		summary->opcodes[ISA_TABLE[op].opcode & 0x7F] += stats->ops[op];
+		summary->loads[op_load_width(op)] += stats->ops[op];
+		summary->stores[op_store_width(op)] += stats->ops[op];
+		if (ISA_TABLE[op].format == FMT_B)
+		{
+			summary->branches += stats->ops[op];
+		}
+		if (ISA_TABLE[op].format == FMT_AMO)
+		{
+			summary->atomics += stats->ops[op];
+		}
+	}
+	summary->seconds = stats->nanoseconds / 1e9;
+	summary->mips = (stats->nanoseconds > 0) ? summary->instructions * 1e3 / stats->nanoseconds : 0.0;
+}
+
+/***************************************************************/
+/* Dump the counters to the terminal                                                             */
+/***************************************************************/
+void stats_print(sim_t *sim)
+{
+	stats_t stats;
+	stats_summary_t summary;
+	uint32_t op, i;
+
+	stats_total(sim, &stats);
+	stats_summarize(&stats, &summary);
+	printf("-------------------------------------\n");
+	printf("Execution Statistics%s\n", sim->STATS_ON ? "" : " (off)");
+	printf("-------------------------------------\n");
+	printf("# Instructions Counted\t: %llu\n", (unsigned long long)summary.instructions);
+	printf("Host Seconds\t: %.6f\n", summary.seconds);
+	printf("Simulated MIPS\t: %.2f\n", summary.mips);
+	printf("-------------------------------------\n");
+	printf("[Opcode]\t[Count]\n");
+	printf("-------------------------------------\n");
+	for (i = 0; i < 128; i++)
+	{
+		if (summary.opcodes[i] != 0)
+		{
+			printf("[0x%02x]\t: %llu\n", i, (unsigned long long)summary.opcodes[i]);
+		}
+	}
+	printf("-------------------------------------\n");
+	printf("[Instruction]\t[Count]\n");
+	printf("-------------------------------------\n");
+	for (op = 0; op < NUM_OPS; op++)
+	{
+		if (stats.ops[op] != 0)
+		{
+			printf("[%s]\t: %llu\n", ISA_TABLE[op].mnemonic, (unsigned long long)stats.ops[op]);
+		}
+	}
+	printf("-------------------------------------\n");
+	printf("Loads (8/16/32)\t: %llu / %llu / %llu\n", (unsigned long long)summary.loads[1],
+		   (unsigned long long)summary.loads[2], (unsigned long long)summary.loads[4]);
+	printf("Stores (8/16/32)\t: %llu / %llu / %llu\n", (unsigned long long)summary.stores[1],
+		   (unsigned long long)summary.stores[2], (unsigned long long)summary.stores[4]);
+	printf("Atomics\t: %llu\n", (unsigned long long)summary.atomics);
+	printf("Branches Taken\t: %llu\n", (unsigned long long)stats.taken);
+	printf("Branches Not Taken\t: %llu\n", (unsigned long long)(summary.branches - stats.taken));
+	printf("-------------------------------------\n");
+}
+
+/***************************************************************/
+/* Write the counters as one JSON object                                                       */
+/***************************************************************/
+void stats_json(sim_t *sim, FILE *out)
+{
+	stats_t stats;
+	stats_summary_t summary;
+	const char *sep = "";
+	uint32_t op, i;
+
+	stats_total(sim, &stats);
+	stats_summarize(&stats, &summary);
+	fprintf(out, "{\"instructions\":%llu,\"seconds\":%.6f,\"mips\":%.2f,\"opcodes\":{",
+			(unsigned long long)summary.instructions, summary.seconds, summary.mips);
+	for (i = 0; i < 128; i++)
+	{
+		if (summary.opcodes[i] != 0)
+		{
+			fprintf(out, "%s\"0x%02x\":%llu", sep, i, (unsigned long long)summary.opcodes[i]);
+			sep = ",";
+		}
+	}
+	fprintf(out, "},\"ops\":{");
+	sep = "";
+	for (op = 0; op < NUM_OPS; op++)
+	{
+		if (stats.ops[op] != 0)
+		{
+			fprintf(out, "%s\"%s\":%llu", sep, ISA_TABLE[op].mnemonic, (unsigned long long)stats.ops[op]);
+			sep = ",";
+		}
+	}
+	fprintf(out, "},\"loads\":{\"8\":%llu,\"16\":%llu,\"32\":%llu}", (unsigned long long)summary.loads[1],
+			(unsigned long long)summary.loads[2], (unsigned long long)summary.loads[4]);
+	fprintf(out, ",\"stores\":{\"8\":%llu,\"16\":%llu,\"32\":%llu}", (unsigned long long)summary.stores[1],
+			(unsigned long long)summary.stores[2], (unsigned long long)summary.stores[4]);
+	fprintf(out, ",\"atomics\":%llu,\"branches\":{\"taken\":%llu,\"not_taken\":%llu}}",
+			(unsigned long long)summary.atomics, (unsigned long long)stats.taken,
+			(unsigned long long)(summary.branches - stats.taken));
+}
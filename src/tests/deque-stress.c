@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/time.h>
+
+#include "../mu-riscv.h"
+
+/***************************************************************/
+/* Work-stealing deque stress test                                                        */
+/*                                                                                                                          */
+/* Deals many more tiny jobs than there are workers, the way                */
+/* mu-riscv-batch does, round after round, and checks that every job    */
+/* was handed out exactly once and that no index past the last job     */
+/* ever came out.                                                                                  */
+/*                                                                                                                          */
+/* Threads only meet in the few instructions around the last job of a  */
+/* deque when they really run in parallel, so a second test puts the   */
+/* thief in a timer signal handler instead. It interrupts the owner's  */
+/* pop of a one-job deque at arbitrary points and completes a steal    */
+/* that read the deque before the pop started, which is exactly the    */
+/* race for the last job; a single CPU hits every part of it.          */
+/***************************************************************/
+
+#define WORKERS 8
+#define ROUNDS 3000
+#define MAX_JOBS (WORKERS * 8)
+
+static job_deque_t DEQUES[WORKERS] __attribute__((aligned(64)));
+static _Atomic uint32_t RUNS[MAX_JOBS + 1];
+static _Atomic int BAD_INDEX;
+static int NUM_JOBS;
+static pthread_barrier_t START, DONE;
+
+/* the interrupting thief */
+#define SIGNAL_POPS 2000000
+static job_deque_t VICTIM __attribute__((aligned(64)));
+static volatile sig_atomic_t ARMED;	/* a pop is under way */
+static volatile sig_atomic_t STOLE;	/* the handler took the job */
+static int64_t THIEF_TOP;	/* top the thief read before the pop */
+
+static void take(int64_t job)
+{
+	if (job >= NUM_JOBS)
+	{
+		atomic_store(&BAD_INDEX, TRUE);
+		job = MAX_JOBS;
+	}
+	atomic_fetch_add(&RUNS[job], 1);
+	if ((job & 3) == 0)
+	{
+		sched_yield();
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	int id = (int)(intptr_t)arg;
+	int64_t job;
+	int round, i;
+
+	for (round = 0; round < ROUNDS; round++)
+	{
+		pthread_barrier_wait(&START);
+		for (;;)
+		{
+			while ((job = deque_pop(&DEQUES[id])) >= 0)
+			{
+				take(job);
+			}
+			job = -1;
+			for (i = 1; i < WORKERS && job < 0; i++)
+			{
+				job = deque_steal(&DEQUES[(id + i) % WORKERS]);
+			}
+			if (job < 0)
+			{
+				break;
+			}
+			take(job);
+		}
+		pthread_barrier_wait(&DONE);
+	}
+	return NULL;
+}
+
+static void thief_signal(int sig)
+{
+	int64_t top = THIEF_TOP;
+
+	if (ARMED && !STOLE && atomic_compare_exchange_strong(&VICTIM.top, &top, top + 1))
+	{
+		STOLE = TRUE;
+	}
+}
+
+/***************************************************************/
+/* Race a pop against an interrupting steal; returns the failures            */
+/***************************************************************/
+static int signal_test()
+{
+	struct sigaction action = { .sa_handler = thief_signal };
+	struct itimerval timer = { { 0, 20 }, { 0, 20 } };
+	int64_t job;
+	uint32_t i, raced = 0;
+	int failed = 0;
+
+	sigaction(SIGALRM, &action, NULL);
+	setitimer(ITIMER_REAL, &timer, NULL);
+	for (i = 0; i < SIGNAL_POPS && failed < 10; i++)
+	{
+		deque_init(&VICTIM, 5, 6);
+		THIEF_TOP = 5;
+		STOLE = FALSE;
+		ARMED = TRUE;
+		job = deque_pop(&VICTIM);
+		ARMED = FALSE;
+		if ((job == 5) == (STOLE != 0))
+		{
+			printf("pop %u: job 5 went to %s\n", i, STOLE ? "both" : "neither");
+			failed++;
+		}
+		if (STOLE && job < 0)
+		{
+			raced++;
+		}
+		/* whoever won, the deque is empty now */
+		if ((job = deque_pop(&VICTIM)) >= 0 || (job = deque_steal(&VICTIM)) >= 0)
+		{
+			printf("pop %u: job %lld came out of an empty deque\n", i, (long long)job);
+			failed++;
+		}
+	}
+	timer.it_value.tv_usec = timer.it_interval.tv_usec = 0;
+	setitimer(ITIMER_REAL, &timer, NULL);
+	printf("deque-stress: %u pops, %u of them lost to an interrupting thief, %s\n", i, raced,
+		   failed ? "FAILED" : "ok");
+	return failed;
+}
+
+int main()
+{
+	pthread_t threads[WORKERS];
+	int round, i, chunk, failed = 0;
+
+	pthread_barrier_init(&START, NULL, WORKERS + 1);
+	pthread_barrier_init(&DONE, NULL, WORKERS + 1);
+	for (i = 0; i < WORKERS; i++)
+	{
+		pthread_create(&threads[i], NULL, worker_main, (void *)(intptr_t)i);
+	}
+	for (round = 0; round < ROUNDS; round++)
+	{
+		/* from one job per worker up to eight, so deques run dry at different times */
+		NUM_JOBS = WORKERS + round % (MAX_JOBS - WORKERS + 1);
+		chunk = (NUM_JOBS + WORKERS - 1) / WORKERS;
+		for (i = 0; i <= MAX_JOBS; i++)
+		{
+			atomic_store(&RUNS[i], 0);
+		}
+		for (i = 0; i < WORKERS; i++)
+		{
+			deque_init(&DEQUES[i], (int64_t)i * chunk < NUM_JOBS ? (int64_t)i * chunk : NUM_JOBS,
+					   (int64_t)(i + 1) * chunk < NUM_JOBS ? (int64_t)(i + 1) * chunk : NUM_JOBS);
+		}
+		pthread_barrier_wait(&START);
+		pthread_barrier_wait(&DONE);
+
+		for (i = 0; i < NUM_JOBS; i++)
+		{
+			if (atomic_load(&RUNS[i]) != 1)
+			{
+				printf("round %d: job %d of %d ran %u times\n", round, i, NUM_JOBS, atomic_load(&RUNS[i]));
+				failed = 1;
+			}
+		}
+		if (atomic_load(&BAD_INDEX))
+		{
+			printf("round %d: a job past the last of %d was handed out\n", round, NUM_JOBS);
+			atomic_store(&BAD_INDEX, FALSE);
+			failed = 1;
+		}
+	}
+	for (i = 0; i < WORKERS; i++)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	printf("deque-stress: %d rounds, %s\n", ROUNDS, failed ? "FAILED" : "ok");
+	failed |= signal_test() != 0;
+	return failed;
+}
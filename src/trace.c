@@ -0,0 +1,355 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "mu-riscv.h"
+
+/* What the encoder and decoder both keep track of (see mu-riscv.h) */
+typedef struct {
+	uint32_t next_pc;	/* previous PC + 4 */
+	uint32_t address;	/* last traced address */
+	uint32_t regs[RISCV_REGS];	/* last traced value of each register */
+	uint32_t cache_pc[TRACE_WORD_CACHE];
+	uint32_t cache_word[TRACE_WORD_CACHE];
+} trace_state_t;
+
+#define TRACE_SLOT(pc) (((pc) >> 2) & (TRACE_WORD_CACHE - 1))
+
+static void trace_state_init(trace_state_t *state)
+{
+	memset(state, 0, sizeof(*state));
+	/* no PC is odd, so every slot starts out missing */
+	memset(state->cache_pc, 0xFF, sizeof(state->cache_pc));
+}
+
+/***************************************************************/
+/* The register an instruction word writes, 0 if none                                      */
+/***************************************************************/
+static uint32_t trace_rd(uint32_t instruction)
+{
+	switch (ISA_TABLE[isa_decode_op(instruction)].format)
+	{
+	case FMT_R:
+	case FMT_I:
+	case FMT_SHIFT:
+	case FMT_LOAD:
+	case FMT_JALR:
+	case FMT_U:
+	case FMT_J:
+	case FMT_AMO:
+		return INSN_RD(instruction);
+	default:
+		return 0;
+	}
+}
+
+/***************************************************************/
+/* Does the instruction word access memory?                                                       */
+/***************************************************************/
+static int trace_accesses_memory(uint32_t instruction)
+{
+	uint8_t format = ISA_TABLE[isa_decode_op(instruction)].format;
+
+	return format == FMT_LOAD || format == FMT_S || format == FMT_AMO;
+}
+
+static void put_varint(FILE *out, int32_t delta)
+{
+	uint32_t value = ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31);
+
+	while (value >= 0x80)
+	{
+		putc_unlocked((value & 0x7F) | 0x80, out);
+		value >>= 7;
+	}
+	putc_unlocked(value, out);
+}
+
+/* FALSE at the end of the file */
+static int get_varint(FILE *in, int32_t *delta)
+{
+	uint32_t value = 0;
+	int shift, c;
+
+	for (shift = 0; shift < 35; shift += 7)
+	{
+		if ((c = getc(in)) == EOF)
+		{
+			return FALSE;
+		}
+		value |= (uint32_t)(c & 0x7F) << shift;
+		if (!(c & 0x80))
+		{
+			*delta = (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+/***************************************************************/
+/* Encode one record                                                                                      */
+/***************************************************************/
+static void trace_encode(trace_state_t *state, const trace_record_t *record, FILE *out)
+{
+	uint32_t slot = TRACE_SLOT(record->pc);
+	uint32_t rd = trace_rd(record->instruction);
+	uint8_t flags = 0;
+
+	if (record->pc != state->next_pc)
+	{
+		flags |= TRACE_JUMP;
+	}
+	if (state->cache_pc[slot] != record->pc || state->cache_word[slot] != record->instruction)
+	{
+		flags |= TRACE_WORD;
+	}
+	putc_unlocked(flags, out);
+	if (flags & TRACE_JUMP)
+	{
+		put_varint(out, record->pc - state->next_pc);
+	}
+	if (flags & TRACE_WORD)
+	{
+		putc_unlocked(record->instruction & 0xFF, out);
+		putc_unlocked((record->instruction >> 8) & 0xFF, out);
+		putc_unlocked((record->instruction >> 16) & 0xFF, out);
+		putc_unlocked(record->instruction >> 24, out);
+		state->cache_pc[slot] = record->pc;
+		state->cache_word[slot] = record->instruction;
+	}
+	if (rd != 0)
+	{
+		put_varint(out, record->value - state->regs[rd]);
+		state->regs[rd] = record->value;
+	}
+	if (trace_accesses_memory(record->instruction))
+	{
+		put_varint(out, record->address - state->address);
+		state->address = record->address;
+	}
+	state->next_pc = record->pc + 4;
+}
+
+/***************************************************************/
+/* Writer thread: encode whatever the simulation has put in the ring, and */
+/* nap briefly whenever it is empty                                                                 */
+/***************************************************************/
+static void *trace_writer(void *arg)
+{
+	trace_t *trace = arg;
+	trace_state_t *state = malloc(sizeof(trace_state_t));
+	struct timespec nap = { 0, 100000 };
+	uint64_t tail = trace->tail, head;
+
+	if (state == NULL)
+	{
+		printf("Error: Out of memory writing the trace\n");
+		exit(-1);
+	}
+	trace_state_init(state);
+	/* nobody else touches out until the writer is joined */
+	for (;;)
+	{
+		head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+		if (head == tail)
+		{
+			/* stop is only set after the last record went in */
+			if (__atomic_load_n(&trace->stop, __ATOMIC_ACQUIRE) &&
+				__atomic_load_n(&trace->head, __ATOMIC_ACQUIRE) == tail)
+			{
+				break;
+			}
+			nanosleep(&nap, NULL);
+			continue;
+		}
+		for (; tail != head; tail++)
+		{
+			trace_encode(state, &trace->ring[tail & (TRACE_RING_SIZE - 1)], trace->out);
+		}
+		__atomic_store_n(&trace->tail, tail, __ATOMIC_RELEASE);
+	}
+	free(state);
+	return NULL;
+}
+
+/***************************************************************/
+/* Start tracing the simulation to path. Returns FALSE if it can't.          */
+/***************************************************************/
+int trace_open(sim_t *sim, const char *path)
+{
+	trace_header_t header;
+	trace_t *trace;
+
+	if (sim->NUM_HARTS > 1)
+	{
+		printf("Error: Traces follow a single hart\n\n");
+		return FALSE;
+	}
+	trace_close(sim);
+	trace = aligned_alloc(64, sizeof(trace_t));
+	if (trace == NULL)
+	{
+		printf("Error: Out of memory opening a trace\n\n");
+		return FALSE;
+	}
+	memset(trace, 0, offsetof(trace_t, ring));
+	trace->out = fopen(path, "wb");
+	if (trace->out == NULL)
+	{
+		printf("Error: Can't create trace file %s\n\n", path);
+		free(trace);
+		return FALSE;
+	}
+	setvbuf(trace->out, NULL, _IOFBF, 1 << 20);
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	fwrite(&header, sizeof(header), 1, trace->out);
+
+	if (pthread_create(&trace->writer, NULL, trace_writer, trace) != 0)
+	{
+		printf("Error: Can't start the trace writer\n\n");
+		fclose(trace->out);
+		free(trace);
+		return FALSE;
+	}
+	sim->TRACE = trace;
+	sim_log("Tracing to %s.\n\n", path);
+	return TRUE;
+}
+
+/***************************************************************/
+/* Let the writer drain the ring, then close the trace file                         */
+/***************************************************************/
+void trace_close(sim_t *sim)
+{
+	trace_t *trace = sim->TRACE;
+
+	if (trace == NULL)
+	{
+		return;
+	}
+	__atomic_store_n(&trace->stop, TRUE, __ATOMIC_RELEASE);
+	pthread_join(trace->writer, NULL);
+	if (fclose(trace->out) != 0)
+	{
+		printf("Error: Can't write the trace\n\n");
+	}
+	sim_log("Trace closed, %llu instructions.\n\n", (unsigned long long)trace->head);
+	free(trace);
+	sim->TRACE = NULL;
+}
+
+/***************************************************************/
+/* Queue one retired instruction, waiting while the ring is full                 */
+/***************************************************************/
+void trace_record(sim_t *sim, uint32_t pc, uint32_t instruction, uint32_t value, uint32_t address)
+{
+	trace_t *trace = sim->TRACE;
+	uint64_t head = trace->head;
+	trace_record_t *record;
+
+	while (head - trace->tail_seen == TRACE_RING_SIZE)
+	{
+		trace->tail_seen = __atomic_load_n(&trace->tail, __ATOMIC_ACQUIRE);
+		if (head - trace->tail_seen == TRACE_RING_SIZE)
+		{
+			sched_yield();
+		}
+	}
+	record = &trace->ring[head & (TRACE_RING_SIZE - 1)];
+	record->pc = pc;
+	record->instruction = instruction;
+	record->value = value;
+	record->address = address;
+	__atomic_store_n(&trace->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/***************************************************************/
+/* Print the first limit instructions of the trace in as text, one per     */
+/* line. Returns FALSE if in is not a trace or ends in the middle of one.    */
+/***************************************************************/
+int trace_decode(FILE *in, FILE *out, uint64_t limit)
+{
+	trace_header_t header;
+	trace_state_t *state = malloc(sizeof(trace_state_t));
+	trace_record_t record;
+	uint64_t count;
+	uint32_t slot, rd;
+	int32_t delta;
+	int flags, c, i, ok = TRUE;
+	char text[64];
+
+	if (state == NULL)
+	{
+		printf("Error: Out of memory reading the trace\n");
+		exit(-1);
+	}
+	if (fread(&header, sizeof(header), 1, in) != 1 || memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+		header.version != TRACE_VERSION)
+	{
+		free(state);
+		return FALSE;
+	}
+	trace_state_init(state);
+
+	for (count = 0; count < limit && (flags = getc(in)) != EOF; count++)
+	{
+		record.pc = state->next_pc;
+		if ((flags & TRACE_JUMP) && (ok = get_varint(in, &delta)))
+		{
+			record.pc += delta;
+		}
+		slot = TRACE_SLOT(record.pc);
+		if (ok && (flags & TRACE_WORD))
+		{
+			for (i = 0, record.instruction = 0; i < 4 && (c = getc(in)) != EOF; i++)
+			{
+				record.instruction |= (uint32_t)c << (8 * i);
+			}
+			ok = (i == 4);
+			state->cache_pc[slot] = record.pc;
+			state->cache_word[slot] = record.instruction;
+		}
+		else
+		{
+			record.instruction = state->cache_word[slot];
+		}
+		rd = trace_rd(record.instruction);
+		if (ok && rd != 0 && (ok = get_varint(in, &delta)))
+		{
+			state->regs[rd] += delta;
+		}
+		if (ok && trace_accesses_memory(record.instruction) && (ok = get_varint(in, &delta)))
+		{
+			state->address += delta;
+		}
+		if (!ok)
+		{
+			break;
+		}
+		state->next_pc = record.pc + 4;
+
+		disassemble(record.instruction, text, sizeof(text));
+		fprintf(out, "0x%08x: 0x%08x  %-*s", record.pc, record.instruction,
+				(rd != 0 || trace_accesses_memory(record.instruction)) ? 28 : 0, text);
+		if (rd != 0)
+		{
+			fprintf(out, "  x%u=0x%08x", rd, state->regs[rd]);
+		}
+		if (trace_accesses_memory(record.instruction))
+		{
+			fprintf(out, "  [0x%08x]", state->address);
+		}
+		fprintf(out, "\n");
+	}
+	free(state);
+	return ok;
+}